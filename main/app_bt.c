@@ -23,15 +23,31 @@ Wait For Incoming Connection Request
 #define DEBUG_ACL 1
 #define DEBUG_USB_HOST 1
 #define EXTRADEBUG 1
+//#define PRINTLATENCY 1 // Print input latency statistics every 10 s
+//#define PRINTPROFILE 1 // Print the timeline of every connection
 
 #include <stdio.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_bt.h"
+#include "esp_timer.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "bt.h"
+#include "l2cap_config.h"
+#include "bt_link.h"
+#include "hid_host.h"
+#include "hid_driver.h"
+#include "latency.h"
+#include "conn_profile.h"
+#include "sdp.h"
+#include "bt_store.h"
+#include "provision.h"
+#include "hid_pipeline.h"
+#include "bt_timer.h"
+#include "bt_reconnect.h"
+#include "bt_discovery.h"
 
 /* Macros for HCI event flag tests */
 #define hci_check_flag(flag) (hci_event_flag & (flag))
@@ -45,11 +61,48 @@ uint8_t hcibuf[BULK_MAXPKTSIZE];
 
 uint8_t hci_state;
 uint8_t hci_version = 0;
-uint16_t hci_counter = 0;
+uint8_t hci_features[8]; // LMP features of the controller
+uint8_t hci_ext_features[8]; // Extended features page 1, the features enabled by the host
+uint8_t hci_commands[64]; // Supported commands, all zero before 1.2
+bool hci_caps_valid = false; // The above are read once, a controller reset does not change them
 uint16_t hci_event_flag = 0;
-uint16_t hci_num_reset_loops = 100;
+uint32_t hci_reset_timeout = HCI_RESET_TIMEOUT;
+volatile uint32_t hci_timeout_flag = 0; // HCI_TIMEOUT_* bits
+TaskHandle_t hci_task_handle = NULL;
+bt_timer_t hci_state_timer; // Timeout of the current HCI state
+bt_timer_t l2cap_rtx_timer;
+bt_timer_t sdp_timer;
+bt_timer_t hci_discovery_timer;
+bt_timer_t hci_watchdog_timer;
+uint8_t hci_cmd_pending = 0; // Commands sent and not yet answered with Command Complete or Command Status
+uint32_t hci_cmd_since = 0;  // Milliseconds, last time the controller answered a command
+uint16_t hci_cmd_opcode = 0; // Opcode and status of the last Command Complete
+uint8_t hci_cmd_status = 0;
+bool hci_recovering = false; // Resetting the controller after a stall
+uint8_t hci_recovery_resets = 0;
+bt_timer_t hci_reconnect_timer; // Wakes the task when the page of a bonded device is due
+
+/* Pairing request waiting for the user, guarded by hci_pairing_lock */
+portMUX_TYPE hci_pairing_lock = portMUX_INITIALIZER_UNLOCKED;
+uint8_t hci_pairing_event = 0; // EV_USER_CONFIRMATION_REQUEST or EV_USER_PASSKEY_REQUEST, 0 if none
+uint8_t hci_pairing_bdaddr[6];
+bool hci_pairing_answered = false;
+bool hci_pairing_accept = false; // Passkey replies are refused with false as well
+uint32_t hci_pairing_passkey = 0;
+bt_timer_t hci_pairing_timer; // Refuses the request if the user does not answer in time
+bool hci_reconnect_paging = false;
+uint8_t hci_reconnect_bdaddr[6]; // Device being paged, disc_bdaddr changes if another device connects meanwhile
+bool hci_link_lost = false; // Set by Disconnection Complete, the reconnect is scheduled from the task
+uint8_t hci_lost_bdaddr[6];
+uint8_t hci_lost_class[3];
+uint8_t hci_connect_role = BT_ROLE_MASTER; // Role of the connection being set up, until it has a link
+uint8_t hci_scan_mode = BT_SCAN_COUNT; // BT_SCAN_* set in the controller, BT_SCAN_COUNT until scanning starts
+uint32_t hci_scan_activity = 0; // Milliseconds, last time a link came or went
+bool hci_discovering = false; // A background inquiry slice is running
+bool hci_connect_cancelling = false; // The page timed out, waiting for its failed Connection Complete
+uint16_t hci_mode_handles[BT_MAX_LINKS]; // Links of the Sniff_Mode and Exit_Sniff_Mode commands waiting for their Command Status, oldest first
+uint8_t hci_mode_count = 0;
 uint16_t hci_handle;
-uint8_t inquiry_counter = 0;
 uint8_t identifier = 0;
 
 bool l2capConnectionClaimed = false;
@@ -62,16 +115,66 @@ bool activeConnection = false;
 bool readyToSend = false;
 
 const char *btdName = NULL;
-const char *btdPin = "0000";
+const char *btdPin = "0000"; // Only used by devices that do not support Secure Simple Pairing
+bool btdSimplePairing = true;
+uint8_t btdIoCapability = HCI_IO_CAP_NO_INPUT_NO_OUTPUT; // Just Works, so pairing needs nobody at the host
+/* Pairing with MITM protection needs somebody at the host. These are called from the VHCI callback, so
+   they must not block: the answer is given later with bt_confirm_reply() or bt_passkey_reply(), and the
+   request is refused after HCI_PAIRING_TIMEOUT. btdIoCapability only takes effect if the ones it needs
+   are set, see hci_io_capability(). */
+void (*btdConfirm)(const uint8_t *bdaddr, uint32_t value) = NULL; // Does the value shown on the device match? HCI_IO_CAP_DISPLAY_YES_NO
+void (*btdPasskeyDisplay)(const uint8_t *bdaddr, uint32_t passkey) = NULL; // To be typed on the device. HCI_IO_CAP_DISPLAY_ONLY and DISPLAY_YES_NO
+void (*btdPasskeyEntry)(const uint8_t *bdaddr) = NULL; // Ask for the passkey shown on the device. HCI_IO_CAP_KEYBOARD_ONLY
+bool btdProvisioning = false; // Pair, verify and drop every HID device in range, one after the other
+bt_timer_t provision_timer;
+bool btdMaster = true; // Be master of every link, so the controller schedules the polls of all devices
+bool btdBackgroundDiscovery = true; // Look for more HID devices while the links are up
+hid_pipeline_config_t btdTasks = HID_PIPELINE_CONFIG_DEFAULT(); // Cores and priorities of the Bluetooth tasks
+esp_bt_mode_t btdControllerMode = ESP_BT_MODE_BTDM; // Also used when the watchdog restarts the controller
 
 uint8_t own_bdaddr[6];
 uint8_t disc_bdaddr[6];
 
 uint8_t l2cap_state = L2CAP_WAIT;
-uint8_t l2cap_event_flag = 0;
+uint32_t l2cap_event_flag = 0;
 uint8_t l2capinbuf[BULK_MAXPKTSIZE];
 uint8_t control_scid[2];
 uint8_t interrupt_scid[2];
+uint8_t control_dcid[2] = { 0x40, 0x00 }; // Local CIDs used for the HID channels
+uint8_t interrupt_dcid[2] = { 0x41, 0x00 };
+uint8_t sdp_dcid[2] = { 0x42, 0x00 }; // Local CID of the SDP client channel
+uint8_t sdp_scid[2];
+l2cap_channel_t control_channel;
+l2cap_channel_t interrupt_channel;
+l2cap_channel_t sdp_channel;
+
+uint8_t sdp_state = SDP_IDLE;
+sdp_query_t sdp_query;
+uint8_t sdp_rx_buf[SDP_L2CAP_MTU]; // Responses may be split over several ACL packets
+uint16_t sdp_rx_length = 0;
+uint16_t sdp_rx_expected = 0;
+bt_store_hid_t hid_record;
+
+typedef struct {
+  uint16_t length;
+  uint8_t data[HCI_TX_MAX_PKTSIZE];
+} hci_tx_packet_t;
+
+hci_tx_packet_t hci_tx_queue[HCI_TX_QUEUE_LEN];
+uint8_t hci_tx_head = 0;
+uint8_t hci_tx_tail = 0;
+bool hci_tx_busy = false;
+uint8_t hci_tx_generation = 0; // Changed by hci_tx_flush(), so a packet sent meanwhile does not move the tail
+uint8_t hci_cmd_credits = 1;
+uint16_t hci_acl_credits = HCI_ACL_DEFAULT_CREDITS;
+uint16_t hci_acl_max_credits = HCI_ACL_DEFAULT_CREDITS;
+uint16_t hci_acl_mtu = 0;
+portMUX_TYPE hci_tx_lock = portMUX_INITIALIZER_UNLOCKED;
+
+uint8_t l2cap_sig_buf[9 + L2CAP_SIG_MTU];
+uint16_t l2cap_sig_length = 0;
+
+latency_stamps_t hci_stamps; // Stage times of the packet being handled
 
 #define min(a,b) ((a)<(b)?(a):(b))
 #define max(a,b) ((a)>(b)?(a):(b))
@@ -81,6 +184,94 @@ static void HCI_Event_Task(uint8_t *, uint16_t);
 static void ACL_Event_Task(uint8_t *, uint16_t);
 static void HCI_Task();
 static void L2CAP_Task();
+static void hci_tx_pump();
+static void l2cap_signal_flush();
+
+/* States that wait for the answer to a command of the init sequence */
+static bool hci_state_command(uint8_t state) {
+  switch (state) {
+    case HCI_CLASS_STATE:
+    case HCI_BDADDR_STATE:
+    case HCI_BUFFER_SIZE_STATE:
+    case HCI_LOCAL_VERSION_STATE:
+    case HCI_LOCAL_FEATURES_STATE:
+    case HCI_LOCAL_COMMANDS_STATE:
+    case HCI_LOCAL_EXT_FEATURES_STATE:
+    case HCI_EVENT_MASK_STATE:
+    case HCI_SIMPLE_PAIRING_STATE:
+    case HCI_INQUIRY_MODE_STATE:
+    case HCI_SET_NAME_STATE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void hci_set_state(uint8_t state) {
+  hci_state = state;
+  hci_connect_cancelling = false;
+  bt_timer_cancel(&hci_state_timer); // Other states with a timeout arm it after entering
+  __atomic_fetch_and(&hci_timeout_flag, ~HCI_TIMEOUT_STATE, __ATOMIC_RELEASE);
+  if (hci_state_command(state))
+    bt_timer_arm(&hci_state_timer, HCI_COMMAND_TIMEOUT);
+  profile_state(PROFILE_MACHINE_HCI, state);
+}
+
+static void l2cap_set_state(uint8_t state) {
+  l2cap_state = state;
+
+  if (state == L2CAP_WAIT || state == L2CAP_DONE)
+    bt_timer_cancel(&l2cap_rtx_timer);
+  else
+    bt_timer_arm(&l2cap_rtx_timer, L2CAP_RTX_TIMEOUT); // Every step of the setup gets its own response time
+  profile_state(PROFILE_MACHINE_L2CAP, state);
+
+#ifdef PRINTPROFILE
+  if (state == L2CAP_DONE) {
+    bt_link_t *link = bt_link_find(hci_handle);
+
+    if (link != NULL)
+      profile_print_timeline(&link->profile);
+    profile_print_stats();
+  }
+#endif
+}
+
+static uint32_t millis() {
+  return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+/* Optional commands are only sent if the controller and, for link features, the device support them */
+static bool hci_local_feature(uint8_t bit) {
+  return HCI_FEATURE(hci_features, bit);
+}
+
+static bool hci_local_command(uint8_t bit) {
+  return HCI_COMMAND(hci_commands, bit);
+}
+
+/* Marks a feature or command the controller refused as unsupported, so it is not tried again */
+static void hci_local_unsupported(uint8_t *bits, uint8_t bit) {
+  bits[bit / 8] &= ~(1 << (bit % 8));
+}
+
+static bool hci_link_feature(const bt_link_t *link, uint8_t bit) {
+  return hci_local_feature(bit) && link->features_valid && HCI_FEATURE(link->features, bit);
+}
+
+/* Timer wheel callback. Runs on the FreeRTOS timer task, so it only flags the timeout and wakes the
+   Bluetooth task to handle it. */
+static void hci_timeout(void *arg) {
+  __atomic_fetch_or(&hci_timeout_flag, (uint32_t)(uintptr_t)arg, __ATOMIC_RELEASE);
+
+  if (hci_task_handle != NULL)
+    xTaskNotifyGive(hci_task_handle);
+}
+
+/* Returns true once per expiry */
+static bool hci_check_timeout(uint32_t flag) {
+  return (__atomic_fetch_and(&hci_timeout_flag, ~flag, __ATOMIC_ACQ_REL) & flag) != 0;
+}
 
 static bool checkHciHandle(uint8_t *buf, uint16_t handle) {
   return (buf[0] == (handle & 0xFF)) && (buf[1] == ((handle >> 8) | 0x20));
@@ -89,6 +280,7 @@ static bool checkHciHandle(uint8_t *buf, uint16_t handle) {
 static void controller_send_ready(void) {
   readyToSend = true;
   printf("Controller ready to send\n");
+  hci_tx_pump();
 }
 
 static esp_vhci_host_callback_t vhci_host_cb = {
@@ -96,16 +288,102 @@ static esp_vhci_host_callback_t vhci_host_cb = {
     HCI_Packet_Task
 };
 
-void HCI_Command(uint8_t *data, uint16_t nbytes) {
-  if (!esp_vhci_host_check_send_available()) {
+/* Sends queued packets for as long as the controller has room. Only one caller drains the queue at a time,
+   the others just leave their packets for it. */
+static void hci_tx_pump() {
+  portENTER_CRITICAL(&hci_tx_lock);
+  if (hci_tx_busy) {
+    portEXIT_CRITICAL(&hci_tx_lock);
+    return;
+  }
+  hci_tx_busy = true;
+  portEXIT_CRITICAL(&hci_tx_lock);
+
+  while (1) {
+    bool send_avail = esp_vhci_host_check_send_available();
+    hci_tx_packet_t *pkt = NULL;
+
+    portENTER_CRITICAL(&hci_tx_lock);
+    uint8_t generation = hci_tx_generation;
+
+    if (send_avail && hci_tx_tail != hci_tx_head) {
+      pkt = &hci_tx_queue[hci_tx_tail];
+      bt_link_t *link = pkt->data[0] == HCIT_TYPE_ACL_DATA ? bt_link_find((pkt->data[1] | (pkt->data[2] << 8)) & 0x0FFF) : NULL;
+
+      if (pkt->data[0] == HCIT_TYPE_ACL_DATA && link == NULL) { // The link is gone, the controller would not return the credit
+        hci_tx_tail = (hci_tx_tail + 1) % HCI_TX_QUEUE_LEN;
+        portEXIT_CRITICAL(&hci_tx_lock);
+        continue;
+      } else if (pkt->data[0] == HCIT_TYPE_COMMAND && hci_cmd_credits) {
+        hci_cmd_credits--;
+        if (hci_cmd_pending++ == 0)
+          hci_cmd_since = millis();
+      } else if (pkt->data[0] == HCIT_TYPE_ACL_DATA && hci_acl_credits) {
+        hci_acl_credits--;
+        if (link->acl_outstanding++ == 0)
+          link->acl_since = millis();
+      } else if (pkt->data[0] == HCIT_TYPE_COMMAND || pkt->data[0] == HCIT_TYPE_ACL_DATA) {
+        pkt = NULL; // Wait for the controller to return a credit
+      }
+    }
+
+    if (pkt == NULL) {
+      hci_tx_busy = false;
+      portEXIT_CRITICAL(&hci_tx_lock);
+      return;
+    }
+    portEXIT_CRITICAL(&hci_tx_lock);
+
+    esp_vhci_host_send_packet(pkt->data, pkt->length);
+
+    portENTER_CRITICAL(&hci_tx_lock);
+    if (generation == hci_tx_generation) // Else the queue was flushed while the packet went out
+      hci_tx_tail = (hci_tx_tail + 1) % HCI_TX_QUEUE_LEN;
+    portEXIT_CRITICAL(&hci_tx_lock);
+  }
+}
+
+static void hci_tx_flush() {
+  portENTER_CRITICAL(&hci_tx_lock);
+  hci_tx_tail = hci_tx_head;
+  hci_tx_generation++;
+  hci_cmd_credits = 1;
+  hci_cmd_pending = 0;
+  hci_acl_credits = hci_acl_max_credits;
+  for (uint8_t i = 0; i < BT_MAX_LINKS; i++)
+    bt_links[i].acl_outstanding = 0;
+  portEXIT_CRITICAL(&hci_tx_lock);
+  hci_mode_count = 0;
+}
+
+/* Returns false if the queue is full and the packet was dropped */
+bool HCI_Command(uint8_t *data, uint16_t nbytes) {
+  bool queued = false;
+
+  if (nbytes <= HCI_TX_MAX_PKTSIZE) {
+    portENTER_CRITICAL(&hci_tx_lock);
+    uint8_t next = (hci_tx_head + 1) % HCI_TX_QUEUE_LEN;
+
+    if (next != hci_tx_tail) {
+      memcpy(hci_tx_queue[hci_tx_head].data, data, nbytes);
+      hci_tx_queue[hci_tx_head].length = nbytes;
+      hci_tx_head = next;
+      queued = true;
+    }
+    portEXIT_CRITICAL(&hci_tx_lock);
+  }
+
+  if (!queued) {
 #ifdef DEBUG_HCI
     printf("Unable to send HCI Command\n");
 #endif
-    return;
+    return false;
   }
-  hci_clear_flag(HCI_FLAG_CMD_COMPLETE);
 
-  esp_vhci_host_send_packet(data, nbytes);
+  if (data[0] == HCIT_TYPE_COMMAND)
+    hci_clear_flag(HCI_FLAG_CMD_COMPLETE | HCI_FLAG_CMD_ANSWERED);
+
+  hci_tx_pump();
 #ifdef DEBUG_HCI
   printf("HCI Command: Code 0x%x, Length %d (", data[1], nbytes);
 
@@ -114,10 +392,12 @@ void HCI_Command(uint8_t *data, uint16_t nbytes) {
 
   printf("0x%x)\n", data[nbytes - 1]);
 #endif
+  return true;
 }
 
 void hci_reset() {
   hci_event_flag = 0; // Clear all the flags
+  hci_tx_flush(); // Anything still queued belongs to the old controller state
   hcibuf[0] = HCIT_TYPE_COMMAND;
   hcibuf[1] = 0x03;
   hcibuf[2] = 0x03 << 2;
@@ -140,25 +420,73 @@ void hci_write_class_of_device() { // See http://bluetooth-pentest.narod.ru/soft
 
 void hci_write_scan_enable() {
   hci_clear_flag(HCI_FLAG_INCOMING_REQUEST);
-  hcibuf[0] = 0x1A; // HCI OCF = 1A
-  hcibuf[1] = 0x03 << 2; // HCI OGF = 3
-  hcibuf[2] = 0x01; // parameter length = 1
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x1A; // HCI OCF = 1A
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x01; // parameter length = 1
 
   if (btdName != NULL)
-    hcibuf[3] = 0x03; // Inquiry Scan enabled. Page Scan enabled.
+    hcibuf[4] = 0x03; // Inquiry Scan enabled. Page Scan enabled.
   else
-    hcibuf[3] = 0x02; // Inquiry Scan disabled. Page Scan enabled.
+    hcibuf[4] = 0x02; // Inquiry Scan disabled. Page Scan enabled.
 
-  HCI_Command(hcibuf, 4);
+  HCI_Command(hcibuf, 5);
+}
+
+void hci_write_page_scan_activity(uint16_t interval, uint16_t window) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x1C; // HCI OCF = 1C
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x04; // parameter length = 4
+  hcibuf[4] = interval & 0xFF; // Page_Scan_Interval
+  hcibuf[5] = (interval >> 8) & 0xFF;
+  hcibuf[6] = window & 0xFF; // Page_Scan_Window
+  hcibuf[7] = (window >> 8) & 0xFF;
+
+  HCI_Command(hcibuf, 8);
+}
+
+void hci_write_inquiry_scan_activity(uint16_t interval, uint16_t window) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x1E; // HCI OCF = 1E
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x04; // parameter length = 4
+  hcibuf[4] = interval & 0xFF; // Inquiry_Scan_Interval
+  hcibuf[5] = (interval >> 8) & 0xFF;
+  hcibuf[6] = window & 0xFF; // Inquiry_Scan_Window
+  hcibuf[7] = (window >> 8) & 0xFF;
+
+  HCI_Command(hcibuf, 8);
+}
+
+void hci_write_page_scan_type(bool interlaced) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x47; // HCI OCF = 47
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x01; // parameter length = 1
+  hcibuf[4] = interlaced ? 0x01 : 0x00; // Interlaced or standard scan
+
+  HCI_Command(hcibuf, 5);
+}
+
+void hci_write_inquiry_scan_type(bool interlaced) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x43; // HCI OCF = 43
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x01; // parameter length = 1
+  hcibuf[4] = interlaced ? 0x01 : 0x00; // Interlaced or standard scan
+
+  HCI_Command(hcibuf, 5);
 }
 
 void hci_write_scan_disable() {
-  hcibuf[0] = 0x1A; // HCI OCF = 1A
-  hcibuf[1] = 0x03 << 2; // HCI OGF = 3
-  hcibuf[2] = 0x01; // parameter length = 1
-  hcibuf[3] = 0x00; // Inquiry Scan disabled. Page Scan disabled.
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x1A; // HCI OCF = 1A
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x01; // parameter length = 1
+  hcibuf[4] = 0x00; // Inquiry Scan disabled. Page Scan disabled.
 
-  HCI_Command(hcibuf, 4);
+  HCI_Command(hcibuf, 5);
 }
 
 void hci_read_bdaddr() {
@@ -171,6 +499,16 @@ void hci_read_bdaddr() {
   HCI_Command(hcibuf, 4);
 }
 
+void hci_read_buffer_size() {
+  hci_clear_flag(HCI_FLAG_READ_BUFFER_SIZE);
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x05; // HCI OCF = 5
+  hcibuf[2] = 0x04 << 2; // HCI OGF = 4
+  hcibuf[3] = 0x00;
+
+  HCI_Command(hcibuf, 4);
+}
+
 void hci_read_local_version_information() {
   hci_clear_flag(HCI_FLAG_READ_VERSION);
   hcibuf[0] = HCIT_TYPE_COMMAND;
@@ -181,39 +519,107 @@ void hci_read_local_version_information() {
   HCI_Command(hcibuf, 4);
 }
 
+void hci_read_local_supported_features() {
+  hci_clear_flag(HCI_FLAG_READ_FEATURES);
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x03; // HCI OCF = 3
+  hcibuf[2] = 0x04 << 2; // HCI OGF = 4
+  hcibuf[3] = 0x00;
+
+  HCI_Command(hcibuf, 4);
+}
+
+void hci_read_local_supported_commands() {
+  hci_clear_flag(HCI_FLAG_READ_COMMANDS);
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x02; // HCI OCF = 2
+  hcibuf[2] = 0x04 << 2; // HCI OGF = 4
+  hcibuf[3] = 0x00;
+
+  HCI_Command(hcibuf, 4);
+}
+
+void hci_read_local_extended_features(uint8_t page) {
+  hci_clear_flag(HCI_FLAG_READ_FEATURES);
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x04; // HCI OCF = 4
+  hcibuf[2] = 0x04 << 2; // HCI OGF = 4
+  hcibuf[3] = 0x01; // parameter length = 1
+  hcibuf[4] = page; // Page_Number
+
+  HCI_Command(hcibuf, 5);
+}
+
+void hci_write_inquiry_mode(uint8_t mode) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x45; // HCI OCF = 45
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x01; // parameter length = 1
+  hcibuf[4] = mode; // 0 = standard, 1 = with RSSI
+
+  HCI_Command(hcibuf, 5);
+}
+
+void hci_read_remote_supported_features(uint16_t handle) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x1B; // HCI OCF = 1B
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x02; // parameter length = 2
+  hcibuf[4] = (uint8_t)(handle & 0xFF); // connection handle - low byte
+  hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); // connection handle - high byte
+
+  HCI_Command(hcibuf, 6);
+}
+
+void hci_change_connection_packet_type(uint16_t handle, uint16_t packet_types) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x0F; // HCI OCF = 0F
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x04; // parameter length = 4
+  hcibuf[4] = (uint8_t)(handle & 0xFF); // connection handle - low byte
+  hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); // connection handle - high byte
+  hcibuf[6] = (uint8_t)(packet_types & 0xFF); // Packet_Type
+  hcibuf[7] = (uint8_t)(packet_types >> 8);
+
+  HCI_Command(hcibuf, 8);
+}
+
 void hci_accept_connection() {
   hci_clear_flag(HCI_FLAG_CONNECT_COMPLETE);
-  hcibuf[0] = 0x09; // HCI OCF = 9
-  hcibuf[1] = 0x01 << 2; // HCI OGF = 1
-  hcibuf[2] = 0x07; // parameter length 7
-  hcibuf[3] = disc_bdaddr[0]; // 6 octet bdaddr
-  hcibuf[4] = disc_bdaddr[1];
-  hcibuf[5] = disc_bdaddr[2];
-  hcibuf[6] = disc_bdaddr[3];
-  hcibuf[7] = disc_bdaddr[4];
-  hcibuf[8] = disc_bdaddr[5];
-  hcibuf[9] = 0x00; // Switch role to master
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x09; // HCI OCF = 9
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x07; // parameter length 7
+  hcibuf[4] = disc_bdaddr[0]; // 6 octet bdaddr
+  hcibuf[5] = disc_bdaddr[1];
+  hcibuf[6] = disc_bdaddr[2];
+  hcibuf[7] = disc_bdaddr[3];
+  hcibuf[8] = disc_bdaddr[4];
+  hcibuf[9] = disc_bdaddr[5];
+  hcibuf[10] = btdMaster ? 0x00 : 0x01; // Switch role to master or remain slave
+  hci_connect_role = BT_ROLE_SLAVE; // Until a Role Change event says otherwise
 
-  HCI_Command(hcibuf, 10);
+  HCI_Command(hcibuf, 11);
 }
 
 void hci_remote_name() {
   hci_clear_flag(HCI_FLAG_REMOTE_NAME_COMPLETE);
-  hcibuf[0] = 0x19; // HCI OCF = 19
-  hcibuf[1] = 0x01 << 2; // HCI OGF = 1
-  hcibuf[2] = 0x0A; // parameter length = 10
-  hcibuf[3] = disc_bdaddr[0]; // 6 octet bdaddr
-  hcibuf[4] = disc_bdaddr[1];
-  hcibuf[5] = disc_bdaddr[2];
-  hcibuf[6] = disc_bdaddr[3];
-  hcibuf[7] = disc_bdaddr[4];
-  hcibuf[8] = disc_bdaddr[5];
-  hcibuf[9] = 0x01; // Page Scan Repetition Mode
-  hcibuf[10] = 0x00; // Reserved
-  hcibuf[11] = 0x00; // Clock offset - low byte
-  hcibuf[12] = 0x00; // Clock offset - high byte
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x19; // HCI OCF = 19
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x0A; // parameter length = 10
+  hcibuf[4] = disc_bdaddr[0]; // 6 octet bdaddr
+  hcibuf[5] = disc_bdaddr[1];
+  hcibuf[6] = disc_bdaddr[2];
+  hcibuf[7] = disc_bdaddr[3];
+  hcibuf[8] = disc_bdaddr[4];
+  hcibuf[9] = disc_bdaddr[5];
+  hcibuf[10] = 0x01; // Page Scan Repetition Mode
+  hcibuf[11] = 0x00; // Reserved
+  hcibuf[12] = 0x00; // Clock offset - low byte
+  hcibuf[13] = 0x00; // Clock offset - high byte
 
-  HCI_Command(hcibuf, 13);
+  HCI_Command(hcibuf, 14);
 }
 
 void hci_set_local_name(const char* name) {
@@ -231,7 +637,7 @@ void hci_set_local_name(const char* name) {
   HCI_Command(hcibuf, 5 + strlen(name));
 }
 
-void hci_inquiry() {
+void hci_inquiry_slice(uint8_t length, uint8_t responses) {
   hci_clear_flag(HCI_FLAG_DEVICE_FOUND);
   hcibuf[0] = HCIT_TYPE_COMMAND;
   hcibuf[1] = 0x01;
@@ -240,12 +646,16 @@ void hci_inquiry() {
   hcibuf[4] = 0x33; // LAP: Genera/Unlimited Inquiry Access Code (GIAC = 0x9E8B33) - see https://www.bluetooth.org/Technical/AssignedNumbers/baseband.htm
   hcibuf[5] = 0x8B;
   hcibuf[6] = 0x9E;
-  hcibuf[7] = 0x30; // Inquiry time = 61.44 sec (maximum)
-  hcibuf[8] = 0x0A; // 10 number of responses
+  hcibuf[7] = length; // Inquiry time in 1.28 sec units
+  hcibuf[8] = responses; // Number of responses, 0 = unlimited
 
   HCI_Command(hcibuf, 9);
 }
 
+void hci_inquiry() {
+  hci_inquiry_slice(0x30, 0x0A); // 61.44 sec (maximum), 10 responses
+}
+
 void hci_inquiry_cancel() {
   hcibuf[0] = HCIT_TYPE_COMMAND;
   hcibuf[1] = 0x02;
@@ -255,35 +665,41 @@ void hci_inquiry_cancel() {
   HCI_Command(hcibuf, 4);
 }
 
-/*
-static void hci_connect() {
-  hci_connect(disc_bdaddr); // Use last discovered device
-}
-*/
-
 void hci_connect(uint8_t *bdaddr) {
   hci_clear_flag(HCI_FLAG_CONNECT_COMPLETE | HCI_FLAG_CONNECT_EVENT);
   hcibuf[0] = HCIT_TYPE_COMMAND;
   hcibuf[1] = 0x05;
   hcibuf[2] = 0x01 << 2; // HCI OGF = 1
   hcibuf[3] = 0x0D; // parameter Total Length = 13
-  hcibuf[4] = disc_bdaddr[0]; // 6 octet bdaddr (LSB)
-  hcibuf[5] = disc_bdaddr[1];
-  hcibuf[6] = disc_bdaddr[2];
-  hcibuf[7] = disc_bdaddr[3];
-  hcibuf[8] = disc_bdaddr[4];
-  hcibuf[9] = disc_bdaddr[5];
-  hcibuf[10] = 0x18; // DM1 or DH1 may be used
-  hcibuf[11] = 0xCC; // DM3, DH3, DM5, DH5 may be used
+  hcibuf[4] = bdaddr[0]; // 6 octet bdaddr (LSB)
+  hcibuf[5] = bdaddr[1];
+  hcibuf[6] = bdaddr[2];
+  hcibuf[7] = bdaddr[3];
+  hcibuf[8] = bdaddr[4];
+  hcibuf[9] = bdaddr[5];
+  uint16_t packet_types = bt_packet_types(hci_features, NULL); // Narrowed down once the remote features are known
+  hcibuf[10] = (uint8_t)(packet_types & 0xFF); // Packet_Type
+  hcibuf[11] = (uint8_t)(packet_types >> 8);
   hcibuf[12] = 0x01; // Page repetition mode R1
   hcibuf[13] = 0x00; // Reserved
   hcibuf[14] = 0x00; // Clock offset
   hcibuf[15] = 0x00; // Invalid clock offset
-  hcibuf[16] = 0x01; // Do not allow role switch
+  hcibuf[16] = btdMaster ? 0x00 : 0x01; // Stay master and refuse role switch, or let the device decide
+  hci_connect_role = BT_ROLE_MASTER;
 
   HCI_Command(hcibuf, 17);
 }
 
+void hci_create_connection_cancel(const uint8_t *bdaddr) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x08; // HCI OCF = 08
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x06; // parameter length 6
+  memcpy(&hcibuf[4], bdaddr, 6); // 6 octet bdaddr
+
+  HCI_Command(hcibuf, 10);
+}
+
 void hci_pin_code_request_reply() {
   hcibuf[0] = HCIT_TYPE_COMMAND;
   hcibuf[1] = 0x0D; // HCI OCF = 0D
@@ -323,21 +739,197 @@ void hci_pin_code_negative_request_reply() {
   HCI_Command(hcibuf, 10);
 }
 
-void hci_link_key_request_negative_reply() {
+void hci_link_key_request_negative_reply(const uint8_t *bdaddr) {
   hcibuf[0] = HCIT_TYPE_COMMAND;
   hcibuf[1] = 0x0C; // HCI OCF = 0C
   hcibuf[2] = 0x01 << 2; // HCI OGF = 1
   hcibuf[3] = 0x06; // parameter length 6
-  hcibuf[4] = disc_bdaddr[0]; // 6 octet bdaddr
-  hcibuf[5] = disc_bdaddr[1];
-  hcibuf[6] = disc_bdaddr[2];
-  hcibuf[7] = disc_bdaddr[3];
-  hcibuf[8] = disc_bdaddr[4];
-  hcibuf[9] = disc_bdaddr[5];
+  memcpy(&hcibuf[4], bdaddr, 6); // 6 octet bdaddr
+
+  HCI_Command(hcibuf, 10);
+}
+
+void hci_link_key_request_reply(const uint8_t *bdaddr, const uint8_t *key) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x0B; // HCI OCF = 0B
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x16; // parameter length 22
+  memcpy(&hcibuf[4], bdaddr, 6); // 6 octet bdaddr
+  memcpy(&hcibuf[10], key, 16); // 16 octet link key
+
+  HCI_Command(hcibuf, 26);
+}
+
+void hci_set_event_mask(uint64_t mask) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x01; // HCI OCF = 01
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x08; // parameter length 8
+
+  for (uint8_t i = 0; i < 8; i++)
+    hcibuf[4 + i] = (uint8_t)(mask >> (8 * i));
+
+  HCI_Command(hcibuf, 12);
+}
+
+void hci_write_simple_pairing_mode(bool enable) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x56; // HCI OCF = 56
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x01; // parameter length 1
+  hcibuf[4] = enable ? 0x01 : 0x00;
+
+  HCI_Command(hcibuf, 5);
+}
+
+/* btdIoCapability, or Just Works if nothing is registered to show or ask for the values it implies */
+static uint8_t hci_io_capability() {
+  switch (btdIoCapability) {
+    case HCI_IO_CAP_DISPLAY_ONLY:
+      return btdPasskeyDisplay != NULL ? btdIoCapability : HCI_IO_CAP_NO_INPUT_NO_OUTPUT;
+    case HCI_IO_CAP_DISPLAY_YES_NO:
+      return btdConfirm != NULL && btdPasskeyDisplay != NULL ? btdIoCapability : HCI_IO_CAP_NO_INPUT_NO_OUTPUT;
+    case HCI_IO_CAP_KEYBOARD_ONLY:
+      return btdPasskeyEntry != NULL ? btdIoCapability : HCI_IO_CAP_NO_INPUT_NO_OUTPUT;
+    default:
+      return HCI_IO_CAP_NO_INPUT_NO_OUTPUT;
+  }
+}
+
+void hci_io_capability_request_reply(const uint8_t *bdaddr) {
+  uint8_t io_capability = hci_io_capability();
+
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x2B; // HCI OCF = 2B
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x09; // parameter length 9
+  memcpy(&hcibuf[4], bdaddr, 6); // 6 octet bdaddr
+  hcibuf[10] = io_capability;
+  hcibuf[11] = 0x00; // No out-of-band data
+  hcibuf[12] = HCI_AUTH_GENERAL_BONDING; // Bond so the link key can be stored
+  if (io_capability != HCI_IO_CAP_NO_INPUT_NO_OUTPUT)
+    hcibuf[12] |= HCI_AUTH_MITM;
+
+  HCI_Command(hcibuf, 13);
+}
+
+void hci_user_confirmation_request_reply(const uint8_t *bdaddr, bool accept) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = accept ? 0x2C : 0x2D; // HCI OCF = 2C or 2D for the negative reply
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x06; // parameter length 6
+  memcpy(&hcibuf[4], bdaddr, 6); // 6 octet bdaddr
+
+  HCI_Command(hcibuf, 10);
+}
+
+void hci_user_passkey_request_reply(const uint8_t *bdaddr, uint32_t passkey) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x2E; // HCI OCF = 2E
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x0A; // parameter length 10
+  memcpy(&hcibuf[4], bdaddr, 6); // 6 octet bdaddr
+  hcibuf[10] = (uint8_t)passkey; // 0 to 999999
+  hcibuf[11] = (uint8_t)(passkey >> 8);
+  hcibuf[12] = (uint8_t)(passkey >> 16);
+  hcibuf[13] = (uint8_t)(passkey >> 24);
+
+  HCI_Command(hcibuf, 14);
+}
+
+void hci_user_passkey_request_negative_reply(const uint8_t *bdaddr) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x2F; // HCI OCF = 2F
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x06; // parameter length 6
+  memcpy(&hcibuf[4], bdaddr, 6); // 6 octet bdaddr
 
   HCI_Command(hcibuf, 10);
 }
 
+/* Called from the VHCI callback. The reply is sent by the Bluetooth task, see hci_pairing_reply(). */
+static void hci_pairing_request(uint8_t event, const uint8_t *bdaddr) {
+  portENTER_CRITICAL(&hci_pairing_lock);
+  hci_pairing_event = event;
+  memcpy(hci_pairing_bdaddr, bdaddr, 6);
+  hci_pairing_answered = false;
+  portEXIT_CRITICAL(&hci_pairing_lock);
+  bt_timer_arm(&hci_pairing_timer, HCI_PAIRING_TIMEOUT);
+}
+
+/* Records the answer for the pending request of bdaddr and wakes the Bluetooth task to send it */
+static bool hci_pairing_answer(uint8_t event, const uint8_t *bdaddr, bool accept, uint32_t passkey) {
+  bool pending;
+
+  portENTER_CRITICAL(&hci_pairing_lock);
+  pending = hci_pairing_event == event && !hci_pairing_answered && memcmp(hci_pairing_bdaddr, bdaddr, 6) == 0;
+  if (pending) {
+    hci_pairing_answered = true;
+    hci_pairing_accept = accept;
+    hci_pairing_passkey = passkey;
+  }
+  portEXIT_CRITICAL(&hci_pairing_lock);
+
+  if (pending)
+    hci_timeout((void *)HCI_TIMEOUT_PAIRING);
+  return pending;
+}
+
+/* Answer to btdConfirm. Returns false if there is no such request, e.g. because it timed out. */
+bool bt_confirm_reply(const uint8_t *bdaddr, bool accept) {
+  return hci_pairing_answer(EV_USER_CONFIRMATION_REQUEST, bdaddr, accept, 0);
+}
+
+/* Answer to btdPasskeyEntry, 0 to 999999. Anything above refuses, e.g. if the user cancels. */
+bool bt_passkey_reply(const uint8_t *bdaddr, uint32_t passkey) {
+  return hci_pairing_answer(EV_USER_PASSKEY_REQUEST, bdaddr, passkey <= 999999, passkey);
+}
+
+/* Sends the answer of the user, or refuses the request once HCI_PAIRING_TIMEOUT has passed without one */
+static void hci_pairing_reply() {
+  uint8_t event, bdaddr[6];
+  bool accept;
+  uint32_t passkey;
+
+  portENTER_CRITICAL(&hci_pairing_lock);
+  event = hci_pairing_event;
+  if (event != 0 && !hci_pairing_answered && bt_timer_armed(&hci_pairing_timer))
+    event = 0; // Still waiting for the user
+  if (event != 0)
+    hci_pairing_event = 0;
+  memcpy(bdaddr, hci_pairing_bdaddr, 6);
+  accept = hci_pairing_answered && hci_pairing_accept;
+  passkey = hci_pairing_passkey;
+  portEXIT_CRITICAL(&hci_pairing_lock);
+
+  if (event == 0)
+    return;
+  bt_timer_cancel(&hci_pairing_timer);
+#ifdef DEBUG_USB_HOST
+  printf("Pairing request %s\n", accept ? "accepted" : "refused");
+#endif
+  if (event == EV_USER_CONFIRMATION_REQUEST)
+    hci_user_confirmation_request_reply(bdaddr, accept);
+  else if (accept)
+    hci_user_passkey_request_reply(bdaddr, passkey);
+  else
+    hci_user_passkey_request_negative_reply(bdaddr);
+}
+
+/* The device gave up or the link went down, so no reply is sent for its request */
+static void hci_pairing_drop(const uint8_t *bdaddr) {
+  bool dropped;
+
+  portENTER_CRITICAL(&hci_pairing_lock);
+  dropped = hci_pairing_event != 0 && memcmp(hci_pairing_bdaddr, bdaddr, 6) == 0;
+  if (dropped)
+    hci_pairing_event = 0;
+  portEXIT_CRITICAL(&hci_pairing_lock);
+
+  if (dropped)
+    bt_timer_cancel(&hci_pairing_timer);
+}
+
 void hci_authentication_request() {
   hcibuf[0] = HCIT_TYPE_COMMAND;
   hcibuf[1] = 0x11; // HCI OCF = 11
@@ -349,191 +941,1045 @@ void hci_authentication_request() {
   HCI_Command(hcibuf, 6);
 }
 
-void hci_disconnect(uint16_t handle) { // This is called by the different services
-  hci_clear_flag(HCI_FLAG_DISCONNECT_COMPLETE);
+void hci_write_automatic_flush_timeout(uint16_t handle, uint16_t timeout) {
+  uint32_t slots = (uint32_t)timeout * 8 / 5; // 0.625 ms baseband slots
+
+  if (slots > 0x07FF)
+    slots = 0x07FF; // Maximum is 1279 ms
+
   hcibuf[0] = HCIT_TYPE_COMMAND;
-  hcibuf[1] = 0x06; // HCI OCF = 6
-  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
-  hcibuf[3] = 0x03; // parameter length = 3
+  hcibuf[1] = 0x28; // HCI OCF = 28
+  hcibuf[2] = 0x03 << 2; // HCI OGF = 3
+  hcibuf[3] = 0x04; // parameter length = 4
   hcibuf[4] = (uint8_t)(handle & 0xFF); //connection handle - low byte
   hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); //connection handle - high byte
-  hcibuf[6] = 0x13; // reason
+  hcibuf[6] = (uint8_t)(slots & 0xFF); // Flush timeout, 0 = never flush
+  hcibuf[7] = (uint8_t)(slots >> 8);
 
-  HCI_Command(hcibuf, 7);
+  HCI_Command(hcibuf, 8);
 }
 
-void l2cap_connection_request() {
-  hcibuf[0] = HCIT_TYPE_ACL_DATA;
-  hcibuf[1] = (uint8_t)(hci_handle & 0xFF); // HCI handle with PB,BC flag
-  hcibuf[2] = (uint8_t)(((hci_handle >> 8) & 0x0f) | 0x20);
-  hcibuf[3] = (uint8_t)(12 & 0xFF); // HCI ACL total data length
-  hcibuf[4] = (uint8_t)(12 >> 8);
-  hcibuf[5] = (uint8_t)(8 & 0xFF); // L2CAP header: Length
-  hcibuf[6] = (uint8_t)(8 >> 8);
-  hcibuf[7] = (uint8_t)(1 & 0xFF);
-  hcibuf[8] = (uint8_t)(1 >> 8);
-  hcibuf[9] = L2CAP_CMD_CONNECTION_REQUEST; // Code
-  hcibuf[10] = 0x01; // Identifier
-  hcibuf[11] = 0x04; // Length
-  hcibuf[12] = 0x00;
-  hcibuf[13] = (uint8_t)(0x11 & 0xFF); // PSM
-  hcibuf[14] = (uint8_t)(0x11 >> 8);
-  hcibuf[15] = (uint8_t)(0x40 & 0xFF); // Source CID
-  hcibuf[16] = (uint8_t)(0x40 >> 8);
-
-  HCI_Command(hcibuf, 17);
-}
+void hci_qos_setup(uint16_t handle, const bt_qos_t *qos) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x07; // HCI OCF = 7
+  hcibuf[2] = 0x02 << 2; // HCI OGF = 2
+  hcibuf[3] = 0x14; // parameter length = 20
+  hcibuf[4] = (uint8_t)(handle & 0xFF); //connection handle - low byte
+  hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); //connection handle - high byte
+  hcibuf[6] = 0x00; // Flags
+  hcibuf[7] = qos->service_type;
 
-void l2cap_config_request() {
-  hcibuf[0] = HCIT_TYPE_ACL_DATA;
-  hcibuf[1] = (uint8_t)(hci_handle & 0xFF); // HCI handle with PB,BC flag
-  hcibuf[2] = (uint8_t)(((hci_handle >> 8) & 0x0f) | 0x20);
-  hcibuf[3] = (uint8_t)(16 & 0xFF); // HCI ACL total data length
-  hcibuf[4] = (uint8_t)(16 >> 8);
-  hcibuf[5] = (uint8_t)(12 & 0xFF); // L2CAP header: Length
-  hcibuf[6] = (uint8_t)(12 >> 8);
-  hcibuf[7] = (uint8_t)(1 & 0xFF);
-  hcibuf[8] = (uint8_t)(1 >> 8);
-  hcibuf[9] = L2CAP_CMD_CONFIG_REQUEST; // Code
-  hcibuf[10] = 0x01; // Identifier
-  hcibuf[11] = 0x08; // Length
-  hcibuf[12] = 0x00;
-  hcibuf[13] = 0x70;
-  hcibuf[14] = 0x00;
-  hcibuf[15] = 0x00; // Flags
-  hcibuf[16] = 0x00;
-  hcibuf[17] = 0x01; // Config Opt: type = MTU (Maximum Transmission Unit) - Hint
-  hcibuf[18] = 0x02; // Config Opt: length
-  hcibuf[19] = 0xFF; // MTU
-  hcibuf[20] = 0xFF;
-
-  HCI_Command(hcibuf, 21);
-}
-
-void l2cap_connection_response(uint8_t result) {
-  hcibuf[0] = HCIT_TYPE_ACL_DATA;
-  hcibuf[1] = (uint8_t)(hci_handle & 0xFF); // HCI handle with PB,BC flag
-  hcibuf[2] = (uint8_t)(((hci_handle >> 8) & 0x0f) | 0x20);
-  hcibuf[3] = (uint8_t)(16 & 0xFF); // HCI ACL total data length
-  hcibuf[4] = (uint8_t)(16 >> 8);
-  hcibuf[5] = (uint8_t)(12 & 0xFF); // L2CAP header: Length
-  hcibuf[6] = (uint8_t)(12 >> 8);
-  hcibuf[7] = (uint8_t)(1 & 0xFF);
-  hcibuf[8] = (uint8_t)(1 >> 8);
-  hcibuf[9] = L2CAP_CMD_CONNECTION_RESPONSE; // Code
-  hcibuf[10] = 0x01; // Identifier
-  hcibuf[11] = 0x08; // Length
-  hcibuf[12] = 0x00;
-  hcibuf[13] = 0x40; // Destination CID
-  hcibuf[14] = 0x00;
-  hcibuf[13] = (uint8_t)(control_scid[0] & 0xFF); // Source CID
-  hcibuf[14] = (uint8_t)(control_scid[1] >> 8);
-  hcibuf[17] = result; // Result: Pending or Success
-  hcibuf[18] = 0x00;
-  hcibuf[19] = 0x00; // No further information
-  hcibuf[20] = 0x00;
-
-  HCI_Command(hcibuf, 21);
-}
-
-void l2cap_config_response() {
-  hcibuf[0] = HCIT_TYPE_ACL_DATA;
-  hcibuf[1] = (uint8_t)(hci_handle & 0xFF); // HCI handle with PB,BC flag
-  hcibuf[2] = (uint8_t)(((hci_handle >> 8) & 0x0f) | 0x20);
-  hcibuf[3] = (uint8_t)(18 & 0xFF); // HCI ACL total data length
-  hcibuf[4] = (uint8_t)(18 >> 8);
-  hcibuf[5] = (uint8_t)(14 & 0xFF); // L2CAP header: Length
-  hcibuf[6] = (uint8_t)(14 >> 8);
-  hcibuf[7] = (uint8_t)(1 & 0xFF);
-  hcibuf[8] = (uint8_t)(1 >> 8);
-  hcibuf[9] = L2CAP_CMD_CONFIG_RESPONSE; // Code
-  hcibuf[10] = 0x01; // Identifier
-  hcibuf[11] = 0x0A; // Length
-  hcibuf[12] = 0x00;
-  hcibuf[13] = (uint8_t)(control_scid[0] & 0xFF); // Source CID
-  hcibuf[14] = (uint8_t)(control_scid[1] >> 8);
-  hcibuf[15] = 0x00; // Flag
-  hcibuf[16] = 0x00;
-  hcibuf[17] = 0x00; // Result
-  hcibuf[18] = 0x00;
-  hcibuf[19] = 0x01; // Config
-  hcibuf[20] = 0x02;
-  hcibuf[21] = 0xA0;
-  hcibuf[22] = 0x02;
-
-  HCI_Command(hcibuf, 23);
-}
-
-void l2cap_disconnection_request() {
-  hcibuf[0] = HCIT_TYPE_ACL_DATA;
-  hcibuf[1] = (uint8_t)(hci_handle & 0xFF); // HCI handle with PB,BC flag
-  hcibuf[2] = (uint8_t)(((hci_handle >> 8) & 0x0f) | 0x20);
-  hcibuf[3] = (uint8_t)(12 & 0xFF); // HCI ACL total data length
-  hcibuf[4] = (uint8_t)(12 >> 8);
-  hcibuf[5] = (uint8_t)(8 & 0xFF); // L2CAP header: Length
-  hcibuf[6] = (uint8_t)(8 >> 8);
-  hcibuf[7] = (uint8_t)(1 & 0xFF);
-  hcibuf[8] = (uint8_t)(1 >> 8);
-  hcibuf[9] = L2CAP_CMD_DISCONNECT_REQUEST; // Code
-  hcibuf[10] = 0x01; // Identifier
-  hcibuf[11] = 0x04; // Length
-  hcibuf[12] = 0x00;
-  hcibuf[13] = (uint8_t)(0x11 & 0xFF); // PSM
-  hcibuf[14] = (uint8_t)(0x11 >> 8);
-  hcibuf[15] = (uint8_t)(0x40 & 0xFF); // Source CID
-  hcibuf[16] = (uint8_t)(0x40 >> 8);
+  uint8_t *p = &hcibuf[8];
+  UINT32_TO_STREAM(p, qos->token_rate);
+  UINT32_TO_STREAM(p, qos->peak_bandwidth);
+  UINT32_TO_STREAM(p, qos->latency);
+  UINT32_TO_STREAM(p, qos->delay_variation);
 
-  HCI_Command(hcibuf, 17);
+  HCI_Command(hcibuf, 24);
 }
 
-void l2cap_disconnection_response() {
-  hcibuf[0] = HCIT_TYPE_ACL_DATA;
-  hcibuf[1] = (uint8_t)(hci_handle & 0xFF); // HCI handle with PB,BC flag
-  hcibuf[2] = (uint8_t)(((hci_handle >> 8) & 0x0f) | 0x20);
-  hcibuf[3] = (uint8_t)(12 & 0xFF); // HCI ACL total data length
-  hcibuf[4] = (uint8_t)(12 >> 8);
-  hcibuf[5] = (uint8_t)(8 & 0xFF); // L2CAP header: Length
-  hcibuf[6] = (uint8_t)(8 >> 8);
-  hcibuf[7] = (uint8_t)(1 & 0xFF);
-  hcibuf[8] = (uint8_t)(1 >> 8);
-  hcibuf[9] = L2CAP_CMD_DISCONNECT_RESPONSE; // Code
-  hcibuf[10] = 0x01; // Identifier
-  hcibuf[11] = 0x04; // Length
-  hcibuf[12] = 0x00;
-  hcibuf[13] = (uint8_t)(0x11 & 0xFF); // PSM
-  hcibuf[14] = (uint8_t)(0x11 >> 8);
-  hcibuf[15] = (uint8_t)(0x40 & 0xFF); // Source CID
-  hcibuf[16] = (uint8_t)(0x40 >> 8);
+void hci_flow_specification(uint16_t handle, uint8_t direction, const bt_qos_t *qos) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x10; // HCI OCF = 10
+  hcibuf[2] = 0x02 << 2; // HCI OGF = 2
+  hcibuf[3] = 0x15; // parameter length = 21
+  hcibuf[4] = (uint8_t)(handle & 0xFF); //connection handle - low byte
+  hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); //connection handle - high byte
+  hcibuf[6] = 0x00; // Flags
+  hcibuf[7] = direction; // 0 = outgoing, 1 = incoming
+  hcibuf[8] = qos->service_type;
+
+  uint8_t *p = &hcibuf[9];
+  UINT32_TO_STREAM(p, qos->token_rate);
+  UINT32_TO_STREAM(p, 0); // Token bucket size
+  UINT32_TO_STREAM(p, qos->peak_bandwidth);
+  UINT32_TO_STREAM(p, qos->latency); // Access latency
 
-  HCI_Command(hcibuf, 17);
+  HCI_Command(hcibuf, 25);
+}
+
+void hci_write_link_policy_settings(uint16_t handle, uint16_t settings) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x0D; // HCI OCF = 0D
+  hcibuf[2] = 0x02 << 2; // HCI OGF = 2
+  hcibuf[3] = 0x04; // parameter length = 4
+  hcibuf[4] = (uint8_t)(handle & 0xFF); //connection handle - low byte
+  hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); //connection handle - high byte
+  hcibuf[6] = (uint8_t)(settings & 0xFF);
+  hcibuf[7] = (uint8_t)(settings >> 8);
+
+  HCI_Command(hcibuf, 8);
+}
+
+void hci_switch_role(const uint8_t *bdaddr, uint8_t role) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x0B; // HCI OCF = 0B
+  hcibuf[2] = 0x02 << 2; // HCI OGF = 2
+  hcibuf[3] = 0x07; // parameter length = 7
+  memcpy(&hcibuf[4], bdaddr, 6); // 6 octet bdaddr
+  hcibuf[10] = role; // 0x00 = master, 0x01 = slave
+
+  HCI_Command(hcibuf, 11);
+}
+
+/* The Command Status of a mode command does not say which link it was for, but they come back in the order
+   the commands were sent */
+static void hci_mode_sent(uint16_t handle) {
+  if (hci_mode_count < BT_MAX_LINKS)
+    hci_mode_handles[hci_mode_count++] = handle;
+}
+
+static void hci_mode_status(uint8_t status) {
+  if (hci_mode_count == 0)
+    return;
+
+  bt_link_t *link = bt_link_find(hci_mode_handles[0]);
+
+  hci_mode_count--;
+  memmove(&hci_mode_handles[0], &hci_mode_handles[1], hci_mode_count * sizeof(hci_mode_handles[0]));
+
+  if (status && link != NULL) // No Mode Change follows, so the request can be made again
+    link->mode_pending = false;
+}
+
+/* Both return false if the command could not be queued */
+bool hci_sniff_mode(uint16_t handle, const bt_sniff_policy_t *sniff) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x03; // HCI OCF = 3
+  hcibuf[2] = 0x02 << 2; // HCI OGF = 2
+  hcibuf[3] = 0x0A; // parameter length = 10
+  hcibuf[4] = (uint8_t)(handle & 0xFF); //connection handle - low byte
+  hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); //connection handle - high byte
+  hcibuf[6] = (uint8_t)(sniff->max_interval & 0xFF);
+  hcibuf[7] = (uint8_t)(sniff->max_interval >> 8);
+  hcibuf[8] = (uint8_t)(sniff->min_interval & 0xFF);
+  hcibuf[9] = (uint8_t)(sniff->min_interval >> 8);
+  hcibuf[10] = (uint8_t)(sniff->attempt & 0xFF);
+  hcibuf[11] = (uint8_t)(sniff->attempt >> 8);
+  hcibuf[12] = (uint8_t)(sniff->timeout & 0xFF);
+  hcibuf[13] = (uint8_t)(sniff->timeout >> 8);
+
+  if (!HCI_Command(hcibuf, 14))
+    return false;
+
+  hci_mode_sent(handle);
+  return true;
+}
+
+bool hci_exit_sniff_mode(uint16_t handle) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x04; // HCI OCF = 4
+  hcibuf[2] = 0x02 << 2; // HCI OGF = 2
+  hcibuf[3] = 0x02; // parameter length = 2
+  hcibuf[4] = (uint8_t)(handle & 0xFF); //connection handle - low byte
+  hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); //connection handle - high byte
+
+  if (!HCI_Command(hcibuf, 6))
+    return false;
+
+  hci_mode_sent(handle);
+  return true;
+}
+
+void hci_sniff_subrating(uint16_t handle, const bt_sniff_policy_t *sniff) {
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x11; // HCI OCF = 11
+  hcibuf[2] = 0x02 << 2; // HCI OGF = 2
+  hcibuf[3] = 0x08; // parameter length = 8
+  hcibuf[4] = (uint8_t)(handle & 0xFF); //connection handle - low byte
+  hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); //connection handle - high byte
+  hcibuf[6] = (uint8_t)(sniff->max_latency & 0xFF);
+  hcibuf[7] = (uint8_t)(sniff->max_latency >> 8);
+  hcibuf[8] = (uint8_t)(sniff->min_remote_timeout & 0xFF);
+  hcibuf[9] = (uint8_t)(sniff->min_remote_timeout >> 8);
+  hcibuf[10] = (uint8_t)(sniff->min_local_timeout & 0xFF);
+  hcibuf[11] = (uint8_t)(sniff->min_local_timeout >> 8);
+
+  HCI_Command(hcibuf, 12);
+}
+
+void hci_disconnect(uint16_t handle) { // This is called by the different services
+  hci_clear_flag(HCI_FLAG_DISCONNECT_COMPLETE);
+  hcibuf[0] = HCIT_TYPE_COMMAND;
+  hcibuf[1] = 0x06; // HCI OCF = 6
+  hcibuf[2] = 0x01 << 2; // HCI OGF = 1
+  hcibuf[3] = 0x03; // parameter length = 3
+  hcibuf[4] = (uint8_t)(handle & 0xFF); //connection handle - low byte
+  hcibuf[5] = (uint8_t)((handle >> 8) & 0x0F); //connection handle - high byte
+  hcibuf[6] = 0x13; // reason
+
+  HCI_Command(hcibuf, 7);
+}
+
+/* Packet boundary flag for the first fragment of an L2CAP packet */
+static uint16_t hci_acl_pb_first(bool flushable) {
+  if (!flushable && hci_local_feature(HCI_FEATURE_NON_FLUSHABLE_PB))
+    return HCI_ACL_PB_FIRST_NON_FLUSHABLE;
+  return HCI_ACL_PB_HLM_FIRST;
+}
+
+/* Asks the controller to poll the device at least every poll_interval microseconds. The result ends up in
+   link->qos_achieved once QoS Setup Complete arrives. */
+void hci_link_qos_request(bt_link_t *link, uint32_t poll_interval) {
+  bt_qos_t *qos = &link->qos_requested;
+
+  qos->service_type = BT_QOS_GUARANTEED;
+  qos->token_rate = (uint32_t)L2CAP_HID_INTERRUPT_MTU * (1000000UL / poll_interval); // One full report per poll
+  qos->peak_bandwidth = 0;
+  qos->latency = poll_interval;
+  qos->delay_variation = 0xFFFFFFFF;
+  link->qos_state = BT_QOS_PENDING;
+
+#ifdef DEBUG_USB_HOST
+  printf("Requesting poll interval: %lu us\n", (unsigned long)poll_interval);
+#endif
+  hci_qos_setup(link->handle, qos);
+  hci_flow_specification(link->handle, 0x01, qos); // Incoming, used by 1.2+ controllers for the access latency
+}
+
+/* Role switch stays enabled in the link policy only while the host still has to become master, so once it
+   is the device cannot take the role back */
+static void hci_link_policy(bt_link_t *link) {
+  uint16_t settings = 0;
+
+  if (link->sniff->idle_timeout)
+    settings |= HCI_LINK_POLICY_SNIFF_MODE;
+  if (btdMaster && link->role != BT_ROLE_MASTER)
+    settings |= HCI_LINK_POLICY_ROLE_SWITCH;
+
+  if (settings != link->link_policy) {
+    hci_write_link_policy_settings(link->handle, settings);
+    link->link_policy = settings;
+  }
+}
+
+/* Asks to become master of a link the device connected as master */
+static void hci_link_role(bt_link_t *link) {
+  if (!btdMaster || link->role == BT_ROLE_MASTER || link->role_pending || link->role_attempts >= BT_ROLE_SWITCH_ATTEMPTS)
+    return;
+
+  if (!hci_link_feature(link, HCI_FEATURE_ROLE_SWITCH))
+    return;
+
+#ifdef DEBUG_USB_HOST
+  printf("Requesting master role\n");
+#endif
+  link->role_pending = true;
+  link->role_attempts++;
+  hci_switch_role(link->bdaddr, BT_ROLE_MASTER);
+}
+
+/* Switches the link to the packet types both sides support and to master, once the remote features are known */
+static void hci_link_features(bt_link_t *link) {
+  uint16_t packet_types = bt_packet_types(hci_features, link->features);
+
+  if (packet_types != link->packet_types && hci_local_command(HCI_COMMAND_CHANGE_PACKET_TYPE))
+    hci_change_connection_packet_type(link->handle, packet_types);
+  hci_link_role(link);
+}
+
+/* Applies the latency policy of the device class to a new link */
+static void hci_link_latency_setup(bt_link_t *link) {
+  link->last_activity = millis();
+  bt_timer_init(&link->idle_timer, hci_timeout, (void *)HCI_TIMEOUT_IDLE);
+
+  hci_link_policy(link);
+  if (link->sniff->idle_timeout)
+    bt_timer_arm(&link->idle_timer, link->sniff->idle_timeout);
+
+  if (link->latency->flush_timeout && link->latency->flushable_output && hci_local_feature(HCI_FEATURE_NON_FLUSHABLE_PB)) {
+#ifdef DEBUG_USB_HOST
+    printf("Automatic flush timeout: %d ms\n", link->latency->flush_timeout);
+#endif
+    hci_write_automatic_flush_timeout(link->handle, link->latency->flush_timeout);
+  }
+
+  if (link->latency->poll_interval)
+    hci_link_qos_request(link, link->latency->poll_interval);
+}
+
+/* Called for every packet sent or received on a link. Traffic on a sniffing link brings it back to active. */
+static void hci_link_activity(uint16_t handle, bool received) {
+  bt_link_t *link = bt_link_find(handle);
+
+  if (link == NULL)
+    return;
+
+  link->last_activity = millis();
+
+  if (received) { // Gaps in a stream of reports show how much air time a discovery slice takes from the link
+    uint32_t gap = link->last_activity - link->last_rx;
+
+    if (hci_discovering && link->rx_watch && link->mode == BT_MODE_ACTIVE && gap > link->rx_gap)
+      link->rx_gap = gap;
+    link->last_rx = link->last_activity;
+  }
+
+  if (link->mode == BT_MODE_SNIFF && !link->mode_pending)
+    link->mode_pending = hci_exit_sniff_mode(link->handle);
+}
+
+/* Moves links that have been idle long enough into sniff mode and then sniff subrating. Runs when an idle
+   timer expires. Traffic does not touch the timers, a link that was busy meanwhile is armed again for the
+   rest of its timeout instead. Mode Change events run it again for the next step. */
+static void hci_link_power_policy() {
+  uint32_t now = millis();
+
+  for (uint8_t i = 0; i < BT_MAX_LINKS; i++) {
+    bt_link_t *link = &bt_links[i];
+
+    if (!link->in_use || link->mode_pending || !link->sniff->idle_timeout || bt_timer_armed(&link->idle_timer))
+      continue;
+
+    uint32_t idle = now - link->last_activity;
+
+    if (link->mode == BT_MODE_ACTIVE) {
+      if (idle >= link->sniff->idle_timeout) {
+#ifdef EXTRADEBUG
+        printf("Link 0x%x idle for %lu ms, entering sniff mode\n", link->handle, (unsigned long)idle);
+#endif
+        link->mode_pending = hci_sniff_mode(link->handle, link->sniff);
+      } else {
+        bt_timer_arm(&link->idle_timer, link->sniff->idle_timeout - idle);
+      }
+    } else if (link->mode == BT_MODE_SNIFF && !link->subrated && !link->subrate_pending && link->sniff->subrate_timeout &&
+               hci_link_feature(link, HCI_FEATURE_SNIFF_SUBRATING) && hci_local_command(HCI_COMMAND_SNIFF_SUBRATING)) {
+      if (idle >= link->sniff->subrate_timeout) {
+        link->subrate_pending = true;
+        hci_sniff_subrating(link->handle, link->sniff);
+      } else {
+        bt_timer_arm(&link->idle_timer, link->sniff->subrate_timeout - idle);
+      }
+    }
+  }
+}
+
+/* Flush timeout to announce on the HID interrupt channel of the current link */
+static uint16_t l2cap_interrupt_flush_timeout() {
+  bt_link_t *link = bt_link_find(hci_handle);
+
+  if (link != NULL && link->latency->flush_timeout && link->latency->flushable_output && hci_local_feature(HCI_FEATURE_NON_FLUSHABLE_PB))
+    return link->latency->flush_timeout;
+  return L2CAP_FLUSH_TIMEOUT_INFINITE;
+}
+
+/* Sends a B-frame on a connected channel of the current link */
+void l2cap_send_data(uint8_t *dcid, const uint8_t *data, uint16_t length, bool flushable) {
+  uint8_t buf[HCI_TX_MAX_PKTSIZE];
+  uint16_t header = (hci_handle & 0x0FFF) | hci_acl_pb_first(flushable) | HCI_ACL_BC_POINT_TO_POINT;
+
+  if (length > sizeof(buf) - 9)
+    return;
+
+  buf[0] = HCIT_TYPE_ACL_DATA;
+  buf[1] = (uint8_t)(header & 0xFF); // HCI handle with PB,BC flag
+  buf[2] = (uint8_t)(header >> 8);
+  buf[3] = (uint8_t)((length + 4) & 0xFF); // HCI ACL total data length
+  buf[4] = (uint8_t)((length + 4) >> 8);
+  buf[5] = (uint8_t)(length & 0xFF); // L2CAP header: Length
+  buf[6] = (uint8_t)(length >> 8);
+  buf[7] = dcid[0]; // Channel ID
+  buf[8] = dcid[1];
+  memcpy(&buf[9], data, length);
+
+  hci_link_activity(hci_handle, false);
+  HCI_Command(buf, 9 + length);
+}
+
+/* HID output on the interrupt channel is flushable if the latency policy of the link says so */
+void hid_interrupt_send(const uint8_t *data, uint16_t length) {
+  bt_link_t *link = bt_link_find(hci_handle);
+
+  l2cap_send_data(interrupt_scid, data, length, link != NULL && link->latency->flushable_output);
+}
+
+void hid_control_send(const uint8_t *data, uint16_t length) {
+  l2cap_send_data(control_scid, data, length, false);
+}
+
+/* Devices come up in report protocol, so SET_PROTOCOL is only needed for boot protocol */
+static void hid_set_protocol() {
+  hid_device_t *device = hid_device_find(hci_handle);
+
+  if (device == NULL || device->protocol != HID_PROTOCOL_BOOT)
+    return;
+
+  uint8_t thdr = HID_THDR_SET_PROTOCOL | HID_PROTOCOL_BOOT;
+#ifdef DEBUG_USB_HOST
+  printf("Set HID Boot Protocol\n");
+#endif
+  hid_control_send(&thdr, 1);
+}
+
+/* Sends the signaling commands collected so far as one C-frame */
+static void l2cap_signal_flush() {
+  if (!l2cap_sig_length)
+    return;
+
+  uint16_t header = (hci_handle & 0x0FFF) | hci_acl_pb_first(false) | HCI_ACL_BC_POINT_TO_POINT;
+
+  l2cap_sig_buf[0] = HCIT_TYPE_ACL_DATA;
+  l2cap_sig_buf[1] = (uint8_t)(header & 0xFF); // HCI handle with PB,BC flag
+  l2cap_sig_buf[2] = (uint8_t)(header >> 8);
+  l2cap_sig_buf[3] = (uint8_t)((l2cap_sig_length + 4) & 0xFF); // HCI ACL total data length
+  l2cap_sig_buf[4] = (uint8_t)((l2cap_sig_length + 4) >> 8);
+  l2cap_sig_buf[5] = (uint8_t)(l2cap_sig_length & 0xFF); // L2CAP header: Length
+  l2cap_sig_buf[6] = (uint8_t)(l2cap_sig_length >> 8);
+  l2cap_sig_buf[7] = (uint8_t)(1 & 0xFF); // Signaling channel
+  l2cap_sig_buf[8] = (uint8_t)(1 >> 8);
+
+  HCI_Command(l2cap_sig_buf, 9 + l2cap_sig_length);
+  l2cap_sig_length = 0;
+}
+
+/* Appends a signaling command to the pending C-frame */
+static void l2cap_signal_add(uint8_t code, uint8_t rxid, const uint8_t *data, uint16_t length) {
+  if (4 + length > L2CAP_SIG_MTU) {
+#ifdef DEBUG_ACL
+    printf("L2CAP signaling command too long: %d\n", length);
+#endif
+    return;
+  }
+
+  if (l2cap_sig_length + 4 + length > L2CAP_SIG_MTU)
+    l2cap_signal_flush();
+
+  uint8_t *p = &l2cap_sig_buf[9 + l2cap_sig_length];
+  p[0] = code; // Code
+  p[1] = rxid; // Identifier
+  p[2] = (uint8_t)(length & 0xFF); // Length
+  p[3] = (uint8_t)(length >> 8);
+  memcpy(&p[4], data, length);
+  l2cap_sig_length += 4 + length;
+
+#ifndef L2CAP_COMBINE_SIGNALING
+  l2cap_signal_flush();
+#endif
+}
+
+void l2cap_connection_request(uint8_t rxid, uint8_t *scid, uint16_t psm) {
+  uint8_t cmd[4];
+  cmd[0] = (uint8_t)(psm & 0xFF); // PSM
+  cmd[1] = (uint8_t)(psm >> 8);
+  cmd[2] = scid[0]; // Source CID
+  cmd[3] = scid[1];
+
+  l2cap_signal_add(L2CAP_CMD_CONNECTION_REQUEST, rxid, cmd, 4);
+}
+
+void l2cap_config_request(uint8_t rxid, uint8_t *dcid, const l2cap_config_t *cfg) {
+  uint8_t cmd[4 + L2CAP_CFG_OPTIONS_MAX];
+  cmd[0] = dcid[0]; // Destination CID
+  cmd[1] = dcid[1];
+  cmd[2] = 0x00; // Flags
+  cmd[3] = 0x00;
+
+  l2cap_signal_add(L2CAP_CMD_CONFIG_REQUEST, rxid, cmd, 4 + l2cap_config_encode(&cmd[4], L2CAP_CFG_OPTIONS_MAX, cfg));
+}
+
+void l2cap_connection_response(uint8_t rxid, uint8_t *dcid, uint8_t *scid, uint8_t result) {
+  uint8_t cmd[8];
+  cmd[0] = dcid[0]; // Destination CID
+  cmd[1] = dcid[1];
+  cmd[2] = scid[0]; // Source CID
+  cmd[3] = scid[1];
+  cmd[4] = result; // Result: Pending or Success
+  cmd[5] = 0x00;
+  cmd[6] = 0x00; // No further information
+  cmd[7] = 0x00;
+
+  l2cap_signal_add(L2CAP_CMD_CONNECTION_RESPONSE, rxid, cmd, 8);
+}
+
+/* The options are whole ones encoded within L2CAP_CFG_OPTIONS_MAX, so they are never cut here */
+void l2cap_config_response(uint8_t rxid, uint8_t *scid, uint16_t result, const uint8_t *options, uint16_t length) {
+  uint8_t cmd[6 + L2CAP_CFG_OPTIONS_MAX];
+
+  if (length > L2CAP_CFG_OPTIONS_MAX)
+    return;
+
+  cmd[0] = scid[0]; // Source CID
+  cmd[1] = scid[1];
+  cmd[2] = 0x00; // Flag
+  cmd[3] = 0x00;
+  cmd[4] = (uint8_t)(result & 0xFF); // Result
+  cmd[5] = (uint8_t)(result >> 8);
+  memcpy(&cmd[6], options, length); // Config
+
+  l2cap_signal_add(L2CAP_CMD_CONFIG_RESPONSE, rxid, cmd, 6 + length);
+}
+
+void l2cap_disconnection_request(uint8_t rxid, uint8_t *dcid, uint8_t *scid) {
+  uint8_t cmd[4];
+  cmd[0] = dcid[0]; // Destination CID
+  cmd[1] = dcid[1];
+  cmd[2] = scid[0]; // Source CID
+  cmd[3] = scid[1];
+
+  l2cap_signal_add(L2CAP_CMD_DISCONNECT_REQUEST, rxid, cmd, 4);
+}
+
+void l2cap_disconnection_response(uint8_t rxid, uint8_t *dcid, uint8_t *scid) {
+  uint8_t cmd[4];
+  cmd[0] = dcid[0]; // Destination CID
+  cmd[1] = dcid[1];
+  cmd[2] = scid[0]; // Source CID
+  cmd[3] = scid[1];
+
+  l2cap_signal_add(L2CAP_CMD_DISCONNECT_RESPONSE, rxid, cmd, 4);
+}
+
+/* Bytes of options in the configuration command of a packet, which start at offset. Bounded by both the
+   command length and what was received, so a bogus length cannot make the parser read past the packet. */
+static uint16_t l2cap_config_options_length(const uint8_t *buf, uint16_t length, uint16_t offset) {
+  uint16_t command_length = buf[10] | (buf[11] << 8);
+  uint16_t fixed = offset - 12; // Parameters before the options
+
+  if (length < offset || command_length < fixed)
+    return 0;
+
+  return min(command_length - fixed, length - offset);
+}
+
+/* Answers a configuration request from the peer, accepting its options if we can live with them */
+static void l2cap_handle_config_request(uint8_t *buf, uint16_t packet_length, l2cap_channel_t *channel, uint8_t *scid) {
+  uint16_t length = l2cap_config_options_length(buf, packet_length, 16); // Options follow the DCID and flags
+  uint8_t options[L2CAP_CFG_OPTIONS_MAX];
+  l2cap_config_t cfg;
+
+  if (packet_length < 16 || (buf[10] | (buf[11] << 8)) < 4)
+    return;
+
+  l2cap_config_defaults(&cfg);
+  uint16_t result = l2cap_config_parse(&buf[16], length, &cfg);
+
+  if (result == L2CAP_CFG_UNKNOWN_OPTIONS) {
+    l2cap_config_response(buf[9], scid, result, options, l2cap_config_unknown(&buf[16], length, options, sizeof(options)));
+    return;
+  } else if (result != L2CAP_CFG_SUCCESS) {
+    l2cap_config_response(buf[9], scid, result, options, 0);
+    return;
+  }
+
+  l2cap_config_t check = cfg;
+  result = l2cap_config_negotiate(&check);
+
+  if (result == L2CAP_CFG_SUCCESS) {
+    channel->remote = cfg;
+    check.options &= L2CAP_CFG_MTU | L2CAP_CFG_FLUSH_TIMEOUT; // Echo the values that were accepted
+  }
+#ifdef EXTRADEBUG
+  printf("L2CAP Config Request - MTU: %d Flush timeout: %d Result: 0x%x\n", cfg.mtu, cfg.flush_timeout, result);
+#endif
+
+  l2cap_config_response(buf[9], scid, result, options, l2cap_config_encode(options, sizeof(options), &check));
+}
+
+/* The peer did not like our options. Take its suggestions and try again, up to L2CAP_CONFIG_MAX_ATTEMPTS
+   times; then the channel is disconnected and true is returned. */
+static bool l2cap_handle_config_response(uint8_t *buf, uint16_t packet_length, l2cap_channel_t *channel, uint8_t *dcid, uint8_t *scid) {
+  uint16_t length = l2cap_config_options_length(buf, packet_length, 18); // Options follow the SCID, flags and result
+  l2cap_config_t suggested = channel->local;
+
+  if (packet_length < 18 || (buf[10] | (buf[11] << 8)) < 6)
+    return false;
+
+  if (++channel->config_attempts >= L2CAP_CONFIG_MAX_ATTEMPTS) {
+#ifdef DEBUG_USB_HOST
+    printf("L2CAP configuration refused %d times, disconnecting the channel\n", channel->config_attempts);
+#endif
+    identifier++;
+    l2cap_disconnection_request(identifier, dcid, scid);
+    return true;
+  }
+
+  suggested.options = 0;
+  if (l2cap_config_parse(&buf[18], length, &suggested) != L2CAP_CFG_SUCCESS || !suggested.options)
+    return false;
+
+  // Only take the options we support, QoS, RFC and FCS suggestions are not ours to send
+  if (suggested.options & L2CAP_CFG_MTU)
+    channel->local.mtu = suggested.mtu;
+  if (suggested.options & L2CAP_CFG_FLUSH_TIMEOUT) {
+    channel->local.flush_timeout = suggested.flush_timeout;
+    channel->local.options |= L2CAP_CFG_FLUSH_TIMEOUT;
+  }
+  channel->local.options &= L2CAP_CFG_MTU | L2CAP_CFG_FLUSH_TIMEOUT;
+  channel->local.options |= L2CAP_CFG_MTU;
+#ifdef DEBUG_USB_HOST
+  printf("Retrying L2CAP Config Request - MTU: %d\n", channel->local.mtu);
+#endif
+  identifier++;
+  l2cap_config_request(identifier, dcid, &channel->local);
+  return false;
 }
 
 static void l2cap_reset() {
   connected = false;
   activeConnection = false;
   l2cap_event_flag = 0; // Reset flags
-  l2cap_state = L2CAP_WAIT;
+  l2cap_set_state(L2CAP_WAIT);
+}
+
+static void hci_command_answered(uint16_t opcode) {
+  if (opcode != 0x0000 && hci_cmd_pending) // Opcode 0 only hands out credits
+    hci_cmd_pending--;
+  hci_cmd_since = millis();
+}
+
+/* Pages a device again after its link was lost if it is bonded and its HID attributes expect the host to
+   reconnect */
+static void hci_reconnect_schedule(const uint8_t *bdaddr, const uint8_t *class_of_device) {
+  bt_store_link_key_t link_key;
+  bt_store_hid_t record;
+  uint8_t sdp_flags = 0; // Unknown attributes, page it
+
+  if (btdProvisioning || !bt_store_load_link_key(bdaddr, &link_key))
+    return;
+
+  if (bt_store_load_hid(bdaddr, &record))
+    sdp_flags = record.flags;
+
+  if (!bt_reconnect_wanted(sdp_flags)) {
+#ifdef DEBUG_USB_HOST
+    printf("Waiting for the device to reconnect\n");
+#endif
+    return;
+  }
+
+  uint32_t now = millis();
+  bt_reconnect_schedule(bdaddr, class_of_device, now);
+  bt_timer_arm(&hci_reconnect_timer, bt_reconnect_next(now));
+}
+
+/* Scans fast while waiting for a device and relaxes the duty cycle once the links are up and settled.
+   Only commands the controller when the mode changes. */
+static void hci_scan_policy() {
+  uint8_t mode = bt_reconnect_pending() ? BT_SCAN_FAST : bt_scan_mode(millis() - hci_scan_activity);
+
+  if (mode == hci_scan_mode)
+    return;
+
+  const bt_scan_policy_t *policy = bt_scan_policy(mode);
+  hci_write_page_scan_activity(policy->page_interval, policy->page_window);
+  hci_write_inquiry_scan_activity(policy->inquiry_interval, policy->inquiry_window);
+  if (hci_local_feature(HCI_FEATURE_INTERLACED_PAGE_SCAN) && hci_local_command(HCI_COMMAND_WRITE_PAGE_SCAN_TYPE))
+    hci_write_page_scan_type(policy->page_interlaced);
+  if (hci_local_feature(HCI_FEATURE_INTERLACED_INQUIRY_SCAN) && hci_local_command(HCI_COMMAND_WRITE_INQUIRY_SCAN_TYPE))
+    hci_write_inquiry_scan_type(policy->inquiry_interlaced);
+  hci_scan_mode = mode;
+#ifdef EXTRADEBUG
+  printf("Scan mode: %d\n", mode);
+#endif
+}
+
+/* Longest report gap of the watched links during the slice, counting the one still open. A starved link
+   gets no reports at all, so its open gap is the one that matters most. */
+static uint32_t hci_discovery_worst_gap(uint32_t now) {
+  uint32_t worst_gap = 0;
+
+  for (uint8_t i = 0; i < BT_MAX_LINKS; i++) {
+    bt_link_t *link = &bt_links[i];
+
+    if (!link->in_use || !link->rx_watch || link->mode != BT_MODE_ACTIVE)
+      continue;
+
+    uint32_t gap = max(link->rx_gap, now - link->last_rx);
+    if (gap > worst_gap)
+      worst_gap = gap;
+  }
+
+  return worst_gap;
+}
+
+/* Starts a short inquiry while HID links are up, as often as the report gaps on the links allow */
+static void hci_discovery_slice() {
+  const bt_discovery_policy_t *policy = bt_discovery_policy();
+  uint32_t now = millis();
+
+  for (uint8_t i = 0; i < BT_MAX_LINKS; i++) { // A device with nothing to send is not starved by the slice
+    bt_link_t *link = &bt_links[i];
+
+    link->rx_gap = 0;
+    link->rx_watch = link->in_use && link->mode == BT_MODE_ACTIVE && link->last_rx && now - link->last_rx < policy->idle_gap;
+  }
+
+  hci_inquiry_slice(policy->slice, policy->max_responses);
+  hci_discovering = true;
+  bt_timer_arm(&hci_discovery_timer, policy->gap_threshold);
+}
+
+/* Backs off when the slice disturbed the reports of a streaming link */
+static void hci_discovery_slice_done() {
+  uint32_t worst_gap = hci_discovery_worst_gap(millis());
+
+  hci_discovering = false;
+  bt_timer_cancel(&hci_discovery_timer);
+  bt_discovery_slice_done(worst_gap, millis());
+#ifdef EXTRADEBUG
+  printf("Discovery slice done, worst report gap %lu ms, next in %lu ms\n", (unsigned long)worst_gap, (unsigned long)bt_discovery_interval());
+#endif
+}
+
+/* Cancels the running slice as soon as a streaming link has gone without reports for too long */
+static void hci_discovery_check() {
+  const bt_discovery_policy_t *policy = bt_discovery_policy();
+
+  if (!hci_discovering)
+    return;
+
+  if (hci_discovery_worst_gap(millis()) > policy->gap_threshold) {
+#ifdef EXTRADEBUG
+    printf("Discovery slice cancelled, a link is starved\n");
+#endif
+    hci_inquiry_cancel(); // No Inquiry Complete follows
+    hci_discovery_slice_done();
+  } else {
+    bt_timer_arm(&hci_discovery_timer, policy->gap_threshold);
+  }
+}
+
+/* Throws away the host state of every link and resets the controller. A bonded device that was connected
+   is paged again once the controller is back. */
+static void hci_recover() {
+  for (uint8_t i = 0; i < BT_MAX_LINKS; i++) {
+    bt_link_t *link = &bt_links[i];
+
+    if (!link->in_use)
+      continue;
+
+    hci_reconnect_schedule(link->bdaddr, link->class_of_device);
+    hid_device_close(link->handle);
+    bt_link_remove(link->handle);
+  }
+
+  if (btdProvisioning) {
+    bt_timer_cancel(&provision_timer);
+    provision_unit_done(disc_bdaddr, false); // Nothing if no unit was in progress
+  }
+
+  l2cap_reset();
+  l2capConnectionClaimed = false;
+  connectToHIDDevice = false;
+  incomingHIDDevice = false;
+  waitingForConnection = false;
+  sdp_state = SDP_IDLE;
+  sdp_rx_expected = 0;
+  profile_state(PROFILE_MACHINE_AUTH, PROFILE_AUTH_IDLE);
+  profile_connection_done(false);
+  hci_reconnect_paging = false;
+  hci_discovering = false;
+  hci_scan_mode = BT_SCAN_COUNT; // The reset brings back the controller defaults
+
+  hci_recovering = true;
+  hci_recovery_resets = 0;
+  hci_reset_timeout = HCI_RESET_TIMEOUT;
+  hci_set_state(HCI_INIT_STATE);
+  bt_timer_arm(&hci_state_timer, BT_TIMER_TICK_MS); // Reset right away
+}
+
+/* Checks that the controller keeps answering commands and completing ACL packets */
+static void hci_watchdog() {
+  uint32_t now = millis();
+
+  if (hci_state == HCI_INIT_STATE || hci_state == HCI_RESET_STATE) // The reset has a timeout of its own
+    return;
+
+  if (hci_cmd_pending && now - hci_cmd_since > HCI_COMMAND_STALL_TIMEOUT) {
+    printf("Controller stalled: no answer to a command for %lu ms\n", (unsigned long)(now - hci_cmd_since));
+    hci_recover();
+  } else {
+    // Credits alone do not tell, a link can hold them for a while without the controller being stuck
+    for (uint8_t i = 0; i < BT_MAX_LINKS; i++) {
+      bt_link_t *link = &bt_links[i];
+
+      if (link->in_use && link->acl_outstanding && now - link->acl_since > HCI_ACL_STALL_TIMEOUT) {
+        printf("Controller stalled: no ACL packets of handle 0x%03X completed for %lu ms\n", link->handle, (unsigned long)(now - link->acl_since));
+        hci_recover();
+        return;
+      }
+    }
+  }
+}
+
+/* A signaling request of the HID channels got no response in time, so the link is given up */
+static void l2cap_rtx_expired() {
+  if (l2cap_state == L2CAP_WAIT || l2cap_state == L2CAP_DONE)
+    return;
+
+#ifdef DEBUG_USB_HOST
+  printf("L2CAP request timed out in state %d\n", l2cap_state);
+#endif
+  hci_disconnect(hci_handle);
+  l2cap_reset();
+  l2capConnectionClaimed = false;
+  connectToHIDDevice = false;
+}
+
+/* Closes the HID channels, interrupt first. The link is released once the control channel is gone. */
+static void hid_disconnect() {
+  identifier++;
+  l2cap_disconnection_request(identifier, interrupt_scid, interrupt_dcid);
+  l2cap_signal_flush();
+  l2cap_set_state(L2CAP_INTERRUPT_DISCONNECT);
 }
 
 /* Incoming HCI Packet */
 static int HCI_Packet_Task(uint8_t *buf, uint16_t length) {
+  hci_stamps.rx = esp_timer_get_time();
+
   switch (buf[0]) {
     case HCIT_TYPE_EVENT:
       HCI_Event_Task(++buf, length - 1);
       break;
 
     case HCIT_TYPE_ACL_DATA:
-      //ACL_Event_Task(++buf, length - 1);
+      ACL_Event_Task(++buf, length - 1);
+      break;
+
+    default:
+#ifdef DEBUG_HCI
+      printf("Unmanaged HCI Packet Type: 0x%x\n", buf[0]);
+#endif
+      break;
+  }
+
+  return 0;
+}
+
+/* Sets the device up from a stored record: the driver of its model if there is one, else its descriptor */
+static bool hid_apply_record(hid_device_t *device, const bt_store_hid_t *record) {
+  if (hid_device_set_model(device, record->vendor_source, record->vendor, record->product, record->product_version))
+    return true;
+
+  if (record->descriptor_length == 0)
+    return false;
+
+  return hid_device_set_descriptor(device, record->descriptor, record->descriptor_length);
+}
+
+/* Uses what an earlier connection of the device found out, so SDP is not needed. Also in boot protocol,
+   as the model may have a protocol override. */
+static bool hid_restore_record(hid_device_t *device, const uint8_t *bdaddr) {
+  if (!bt_store_load_hid(bdaddr, &hid_record))
+    return false;
+
+#ifdef DEBUG_USB_HOST
+  printf("Using stored HID record %04x:%04x (%d byte descriptor)\n", hid_record.vendor, hid_record.product, hid_record.descriptor_length);
+#endif
+  return hid_apply_record(device, &hid_record);
+}
+
+static void hid_save_record(const hid_device_t *device, uint8_t flags, const uint8_t *descriptor, uint16_t length) {
+  bt_link_t *link = bt_link_find(device->handle);
+
+  if (length > BT_STORE_MAX_DESCRIPTOR)
+    return;
+
+  memset(&hid_record, 0, sizeof(hid_record));
+  hid_record.version = BT_STORE_HID_VERSION;
+  hid_record.flags = flags;
+  hid_record.vendor_source = device->vendor_source;
+  hid_record.vendor = device->vendor;
+  hid_record.product = device->product;
+  hid_record.product_version = device->version;
+  hid_record.descriptor_length = length;
+  if (length > 0)
+    memcpy(hid_record.descriptor, descriptor, length);
+
+  if (link != NULL)
+    bt_store_save_hid(link->bdaddr, &hid_record);
+  if (device->vendor != 0)
+    bt_store_save_model(device->vendor_source, device->vendor, device->product, device->version, &hid_record);
+}
+
+/* Fetches the HID service record if the device has no descriptor yet */
+static void sdp_start() {
+  hid_device_t *device = hid_device_find(hci_handle);
+
+  if (device == NULL || device->plan_ready || device->protocol == HID_PROTOCOL_BOOT || sdp_state != SDP_IDLE)
+    return;
+
+#ifdef DEBUG_USB_HOST
+  printf("Send SDP Connection Request\n");
+#endif
+  l2cap_event_flag &= ~(L2CAP_FLAG_SDP_CONNECTED | L2CAP_FLAG_SDP_CONFIG_REQUEST | L2CAP_FLAG_CONFIG_SDP_SUCCESS | L2CAP_FLAG_DISCONNECT_RESPONSE);
+  l2cap_channel_init(&sdp_channel, SDP_L2CAP_MTU, L2CAP_FLUSH_TIMEOUT_INFINITE);
+  identifier++;
+  l2cap_connection_request(identifier, sdp_dcid, SDP_PSM);
+  sdp_state = SDP_CONNECT_REQUEST;
+  bt_timer_arm(&sdp_timer, SDP_RESPONSE_TIMEOUT);
+}
+
+static void sdp_send_request() {
+  uint8_t pdu[32 + SDP_MAX_CONTINUATION];
+
+  l2cap_signal_flush(); // The configuration has to reach the peer before the first request
+  l2cap_send_data(sdp_scid, pdu, sdp_query_request(&sdp_query, pdu), false);
+  bt_timer_arm(&sdp_timer, SDP_RESPONSE_TIMEOUT);
+}
+
+static void sdp_disconnect() {
+  identifier++;
+  l2cap_disconnection_request(identifier, sdp_scid, sdp_dcid);
+  sdp_state = SDP_DISCONNECT;
+  bt_timer_arm(&sdp_timer, SDP_RESPONSE_TIMEOUT);
+}
+
+/* The device stopped answering the SDP client. Provisioning waits for SDP_IDLE, so the query is given up. */
+static void sdp_expired() {
+  if (sdp_state == SDP_IDLE || bt_timer_armed(&sdp_timer)) // Done or restarted meanwhile
+    return;
+
+#ifdef DEBUG_USB_HOST
+  printf("SDP timed out in state %d\n", sdp_state);
+#endif
+  if (sdp_state == SDP_CONFIG_REQUEST || sdp_state == SDP_QUERY) { // Close the channel, the answer is not waited for
+    identifier++;
+    l2cap_disconnection_request(identifier, sdp_scid, sdp_dcid);
+  }
+  sdp_state = SDP_IDLE;
+  sdp_rx_expected = 0;
+}
+
+/* Device ID record is in. Returns true if the model is known well enough to skip the HID record. */
+static bool sdp_pnp_complete() {
+  hid_device_t *device = hid_device_find(hci_handle);
+  sdp_pnp_info_t info;
+
+  if (device == NULL || !sdp_pnp_info(&sdp_query, &info)) {
+#ifdef DEBUG_USB_HOST
+    printf("SDP: no Device ID record\n");
+#endif
+    return false;
+  }
+
+#ifdef DEBUG_USB_HOST
+  printf("SDP: Device ID %04x:%04x version %04x\n", info.vendor, info.product, info.version);
+#endif
+  bool driver_layout = hid_device_set_model(device, info.vendor_source, info.vendor, info.product, info.version);
+  bool cached = bt_store_load_model(info.vendor_source, info.vendor, info.product, info.version, &hid_record);
+
+  if (driver_layout) {
+    if (!cached) // The SDP_HID_* flags are only in the HID record
+      return false;
+
+    hid_save_record(device, hid_record.flags, NULL, 0);
+    return true;
+  }
+
+  if (cached && hid_apply_record(device, &hid_record)) {
+    hid_save_record(device, hid_record.flags, hid_record.descriptor, hid_record.descriptor_length);
+    return true;
+  }
+
+  return false;
+}
+
+static void sdp_query_complete() {
+  hid_device_t *device = hid_device_find(hci_handle);
+  sdp_hid_info_t info;
+
+  if (!sdp_hid_info(&sdp_query, &info)) {
+#ifdef DEBUG_USB_HOST
+    printf("SDP: no HID descriptor in the service record\n");
+#endif
+    return;
+  }
+
+#ifdef DEBUG_USB_HOST
+  printf("SDP: HID descriptor %d bytes, flags 0x%x\n", info.descriptor_length, info.flags);
+#endif
+  if (device != NULL && device->plan_ready) { // A driver supplies the layout, only the flags were missing
+    hid_save_record(device, info.flags, NULL, 0);
+    return;
+  }
+
+  if (device == NULL || !hid_device_set_descriptor(device, info.descriptor, info.descriptor_length))
+    return;
+
+  hid_save_record(device, info.flags, info.descriptor, info.descriptor_length);
+}
+
+static void sdp_query_hid() {
+  sdp_query_begin(&sdp_query, SDP_UUID_HID, SDP_ATTR_HID_VIRTUAL_CABLE, SDP_ATTR_HID_BOOT_DEVICE);
+  sdp_send_request();
+}
+
+static void sdp_input(const uint8_t *pdu, uint16_t length) {
+  if (sdp_state != SDP_QUERY)
+    return;
+
+  uint8_t result = sdp_query_response(&sdp_query, pdu, length);
+
+  if (result == SDP_QUERY_MORE) {
+    sdp_send_request();
+  } else if (sdp_query.uuid == SDP_UUID_PNP_INFORMATION) { // Without a Device ID record we still need the HID one
+    if (result == SDP_QUERY_DONE && sdp_pnp_complete())
+      sdp_disconnect();
+    else
+      sdp_query_hid();
+  } else {
+#ifdef DEBUG_USB_HOST
+    if (result != SDP_QUERY_DONE)
+      printf("SDP: error response 0x%x\n", pdu[0]);
+#endif
+    if (result == SDP_QUERY_DONE)
+      sdp_query_complete();
+    sdp_disconnect();
+  }
+}
+
+/* Collects an SDP PDU from one or more ACL packets */
+static void sdp_receive(const uint8_t *data, uint16_t length, bool first, uint16_t total) {
+  if (first) {
+    sdp_rx_length = 0;
+    sdp_rx_expected = total;
+  } else if (sdp_rx_expected == 0) {
+    return;
+  }
+
+  if (sdp_rx_expected > sizeof(sdp_rx_buf) || sdp_rx_length + length > sdp_rx_expected) {
+    sdp_rx_expected = 0; // Larger than our MTU, drop it
+    return;
+  }
+
+  memcpy(&sdp_rx_buf[sdp_rx_length], data, length);
+  sdp_rx_length += length;
+
+  if (sdp_rx_length == sdp_rx_expected) {
+    sdp_rx_expected = 0;
+    sdp_input(sdp_rx_buf, sdp_rx_length);
+  }
+}
+
+static void SDP_Task() {
+  switch (sdp_state) {
+    case SDP_CONNECT_REQUEST:
+      if (l2cap_check_flag(L2CAP_FLAG_SDP_CONNECTED)) {
+        identifier++;
+        l2cap_config_request(identifier, sdp_scid, &sdp_channel.local);
+        sdp_state = SDP_CONFIG_REQUEST;
+        bt_timer_arm(&sdp_timer, SDP_RESPONSE_TIMEOUT);
+      }
+      break;
+
+    case SDP_CONFIG_REQUEST:
+      if (l2cap_check_flag(L2CAP_FLAG_CONFIG_SDP_SUCCESS) && l2cap_check_flag(L2CAP_FLAG_SDP_CONFIG_REQUEST)) {
+#ifdef DEBUG_USB_HOST
+        printf("SDP Channel Configured\n");
+#endif
+        sdp_query_begin(&sdp_query, SDP_UUID_PNP_INFORMATION, SDP_ATTR_PNP_VENDOR_ID, SDP_ATTR_PNP_VENDOR_ID_SOURCE);
+        sdp_state = SDP_QUERY;
+        sdp_send_request();
+      }
       break;
 
-    default:
-#ifdef DEBUG_HCI
-      printf("Unmanaged HCI Packet Type: 0x%x\n", buf[0]);
-#endif
+    case SDP_DISCONNECT:
+      if (l2cap_check_flag(L2CAP_FLAG_DISCONNECT_RESPONSE))
+        sdp_state = SDP_IDLE;
       break;
   }
-
-  return 0;
 }
 
 static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
@@ -546,6 +1992,15 @@ static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
   printf("\n");
 #endif
 
+  hci_link_activity(buf[0] | ((buf[1] & 0x0F) << 8), true);
+
+  if ((buf[1] & 0x30) == (HCI_ACL_PB_HLM_CONTINUE >> 8)) { // Rest of a long L2CAP packet, only SDP responses get that long
+    if (buf[0] == (hci_handle & 0xFF) && (buf[1] & 0x0F) == ((hci_handle >> 8) & 0x0F))
+      sdp_receive(&buf[4], buf[2] | (buf[3] << 8), false, 0);
+    l2cap_signal_flush();
+    return;
+  }
+
   if (!l2capConnectionClaimed && incomingHIDDevice && !connected && !activeConnection) {
     if (buf[8] == L2CAP_CMD_CONNECTION_REQUEST) {
 #ifdef DEBUG_HCI
@@ -555,7 +2010,7 @@ static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
         incomingHIDDevice = false;
         l2capConnectionClaimed = true; // Claim that the incoming connection belongs to this service
         activeConnection = true;
-        l2cap_state = L2CAP_WAIT;
+        l2cap_set_state(L2CAP_WAIT);
 #ifdef EXTRADEBUG
         printf("L2CAP Connection claimed\n");
 #endif
@@ -564,6 +2019,7 @@ static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
   }
 
   if (checkHciHandle(buf, hci_handle)) { // acl_handle_ok
+    hci_stamps.hci = esp_timer_get_time(); // HCI is done with the packet, the rest is L2CAP
     if ((buf[6] | (buf[7] << 8)) == 0x0001U) { // l2cap_control - Channel ID for ACL-U
       if (buf[8] == L2CAP_CMD_COMMAND_REJECT) {
 #ifdef DEBUG_USB_HOST
@@ -583,7 +2039,16 @@ static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
             interrupt_scid[0] = buf[12];
             interrupt_scid[1] = buf[13];
             l2cap_set_flag(L2CAP_FLAG_INTERRUPT_CONNECTED);
+          } else if (buf[14] == sdp_dcid[0] && buf[15] == sdp_dcid[1]) {
+            sdp_scid[0] = buf[12];
+            sdp_scid[1] = buf[13];
+            l2cap_set_flag(L2CAP_FLAG_SDP_CONNECTED);
           }
+        } else if ((buf[16] | (buf[17] << 8)) > 0x0001 && buf[14] == sdp_dcid[0] && buf[15] == sdp_dcid[1]) { // Refused
+#ifdef DEBUG_USB_HOST
+          printf("SDP Connection Refused: 0x%x\n", buf[16]);
+#endif
+          sdp_state = SDP_IDLE;
         }
       } else if (buf[8] == L2CAP_CMD_CONNECTION_REQUEST) {
 #ifdef EXTRADEBUG
@@ -593,15 +2058,27 @@ static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
           identifier = buf[9];
           control_scid[0] = buf[14];
           control_scid[1] = buf[15];
+          l2cap_channel_init(&control_channel, L2CAP_HID_CONTROL_MTU, L2CAP_FLUSH_TIMEOUT_INFINITE);
           l2cap_set_flag(L2CAP_FLAG_CONNECTION_CONTROL_REQUEST);
         } else if ((buf[12] | (buf[13] << 8)) == 0x13) {
           identifier = buf[9];
           interrupt_scid[0] = buf[14];
           interrupt_scid[1] = buf[15];
+          l2cap_channel_init(&interrupt_channel, L2CAP_HID_INTERRUPT_MTU, l2cap_interrupt_flush_timeout());
           l2cap_set_flag(L2CAP_FLAG_CONNECTION_INTERRUPT_REQUEST);
         }
       } else if (buf[8] == L2CAP_CMD_CONFIG_RESPONSE) {
-        if ((buf[16] | (buf[17] << 8)) == 0x0000) { // Success
+        if ((buf[16] | (buf[17] << 8)) == L2CAP_CFG_UNACCEPTABLE_PARAMS) {
+          // A HID channel that is given up stalls the setup, so the link goes once the request times out
+          if (buf[12] == 0x40 && buf[13] == 0x00)
+            l2cap_handle_config_response(buf, length, &control_channel, control_scid, control_dcid);
+          else if (buf[12] == 0x41 && buf[13] == 0x00)
+            l2cap_handle_config_response(buf, length, &interrupt_channel, interrupt_scid, interrupt_dcid);
+          else if (buf[12] == sdp_dcid[0] && buf[13] == sdp_dcid[1] && l2cap_handle_config_response(buf, length, &sdp_channel, sdp_scid, sdp_dcid)) {
+            sdp_state = SDP_DISCONNECT;
+            bt_timer_arm(&sdp_timer, SDP_RESPONSE_TIMEOUT);
+          }
+        } else if ((buf[16] | (buf[17] << 8)) == 0x0000) { // Success
           if(buf[12] == 0x40 && buf[13] == 0x00) {
             printf("HID Control Configuration Complete\n");
             identifier = buf[9];
@@ -610,41 +2087,51 @@ static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
             printf("HID Interrupt Configuration Complete\n");
             identifier = buf[9];
             l2cap_set_flag(L2CAP_FLAG_CONFIG_INTERRUPT_SUCCESS);
+          } else if (buf[12] == sdp_dcid[0] && buf[13] == sdp_dcid[1]) {
+            l2cap_set_flag(L2CAP_FLAG_CONFIG_SDP_SUCCESS);
           }
         }
       } else if (buf[8] == L2CAP_CMD_CONFIG_REQUEST) {
         if (buf[12] == 0x40 && buf[13] == 0x00) {
           printf("HID Control Configuration Request\n");
-          l2cap_config_response();
+          l2cap_handle_config_request(buf, length, &control_channel, control_scid);
         } else if (buf[12] == 0x41 && buf[13] == 0x00) {
           printf("HID Interrupt Configuration Request\n");
-          l2cap_config_response();
+          l2cap_handle_config_request(buf, length, &interrupt_channel, interrupt_scid);
+        } else if (buf[12] == sdp_dcid[0] && buf[13] == sdp_dcid[1]) {
+          l2cap_handle_config_request(buf, length, &sdp_channel, sdp_scid);
+          l2cap_set_flag(L2CAP_FLAG_SDP_CONFIG_REQUEST);
         }
       } else if (buf[8] == L2CAP_CMD_DISCONNECT_REQUEST) {
-        if (buf[12] == 0x40 && l2capinbuf[13] == 0x00) {
+        if (buf[12] == 0x40 && buf[13] == 0x00) {
 #ifdef DEBUG_USB_HOST
           printf("Disconnect Request: Control Channel\n");
 #endif
           identifier = buf[9];
-          l2cap_disconnection_response();
+          l2cap_disconnection_response(identifier, control_dcid, control_scid);
           l2cap_reset();
         } else if (buf[12] == 0x41 && buf[13] == 0x00) {
 #ifdef DEBUG_USB_HOST
           printf("Disconnect Request: Interrupt Channel\n");
 #endif
           identifier = buf[9];
-          l2cap_disconnection_response();
+          l2cap_disconnection_response(identifier, interrupt_dcid, interrupt_scid);
           l2cap_reset();
+        } else if (buf[12] == sdp_dcid[0] && buf[13] == sdp_dcid[1]) {
+          l2cap_disconnection_response(buf[9], sdp_dcid, sdp_scid);
+          sdp_state = SDP_IDLE;
         }
       } else if (buf[8] == L2CAP_CMD_DISCONNECT_RESPONSE) {
         if (buf[12] == 0x40 && buf[13] == 0x00) {
           printf("Disconnect Response: Control Channel\n");
           identifier = buf[9];
           l2cap_set_flag(L2CAP_FLAG_DISCONNECT_CONTROL_RESPONSE);
-        } else if(l2capinbuf[12] == 0x41 && l2capinbuf[13] == 0x00) {
+        } else if (buf[12] == 0x41 && buf[13] == 0x00) {
           printf("Disconnect Response: Interrupt Channel\n");
           identifier = buf[9];
           l2cap_set_flag(L2CAP_FLAG_DISCONNECT_INTERRUPT_RESPONSE);
+        } else if (buf[12] == sdp_dcid[0] && buf[13] == sdp_dcid[1]) {
+          l2cap_set_flag(L2CAP_FLAG_DISCONNECT_RESPONSE);
         }
       } else {
 #ifdef EXTRADEBUG
@@ -664,10 +2151,27 @@ static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
 
       printf("\n");
 #endif
-      if (buf[8] == 0xA1) { // HID_THDR_DATA_INPUT
+      if (buf[8] == HID_THDR_DATA_INPUT) {
         uint16_t length = ((uint16_t)buf[5] << 8 | buf[4]);
-        //ParseBTHIDData((uint8_t)(length - 1), &buf[9]);
+
+        hci_stamps.l2cap = esp_timer_get_time();
+        if (length > 0)
+          hid_pipeline_submit(hci_handle, &buf[9], length - 1, &hci_stamps);
+        if (btdProvisioning)
+          provision_report();
       }
+    } else if (buf[6] == 0x40 && buf[7] == 0x00) { // l2cap_control
+      if ((buf[8] & 0xF0) == HID_THDR_HANDSHAKE) {
+        hid_device_t *device = hid_device_find(hci_handle);
+
+        if (device != NULL)
+          hid_device_handshake(device, buf[8] & 0x0F);
+      }
+    } else if (buf[6] == sdp_dcid[0] && buf[7] == sdp_dcid[1]) { // SDP client
+      uint16_t acl_length = buf[2] | (buf[3] << 8);
+
+      if (acl_length >= 4)
+        sdp_receive(&buf[8], acl_length - 4, true, buf[4] | (buf[5] << 8));
     }
   } else if (buf[6] == 0X40 && buf[7] == 0X00) { // l2cap_control
 #ifdef PRINTREPORT
@@ -693,6 +2197,7 @@ static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
 #endif
 
   L2CAP_Task();
+  SDP_Task();
 
   switch (l2cap_state) {
     case L2CAP_WAIT:
@@ -707,22 +2212,23 @@ static void ACL_Event_Task(uint8_t *buf, uint16_t length) {
 #endif
         l2cap_event_flag = 0; // Reset flags
         identifier = 0;
-        l2cap_connection_request();
-        l2cap_state = L2CAP_CONTROL_CONNECT_REQUEST;
+        l2cap_channel_init(&control_channel, L2CAP_HID_CONTROL_MTU, L2CAP_FLUSH_TIMEOUT_INFINITE);
+        l2cap_connection_request(identifier, control_dcid, 0x11);
+        l2cap_set_state(L2CAP_CONTROL_CONNECT_REQUEST);
       } else if (l2cap_check_flag(L2CAP_FLAG_CONNECTION_CONTROL_REQUEST)) {
 #ifdef DEBUG_USB_HOST
         printf("HID Control Incoming Connection Request\n");
 #endif
-        l2cap_connection_response(PENDING);
-        vTaskDelay(1 / portTICK_PERIOD_MS);
-        l2cap_connection_response(SUCCESSFUL);
+        l2cap_connection_response(identifier, control_dcid, control_scid, PENDING);
+        l2cap_connection_response(identifier, control_dcid, control_scid, SUCCESSFUL);
         identifier++;
-        vTaskDelay(1 / portTICK_PERIOD_MS);
-        l2cap_config_request();
-        l2cap_state = L2CAP_CONTROL_SUCCESS;
+        l2cap_config_request(identifier, control_scid, &control_channel.local);
+        l2cap_set_state(L2CAP_CONTROL_SUCCESS);
       }
       break;
   }
+
+  l2cap_signal_flush(); // Queue everything generated by this packet as one frame
 }
 
 static void L2CAP_Task() {
@@ -733,8 +2239,8 @@ static void L2CAP_Task() {
 #ifdef DEBUG_USB_HOST
       printf("HID Control Successfully Configured\n");
 #endif
-      //setProtocol(); // Set protocol before establishing HID interrupt channel
-      l2cap_state = L2CAP_INTERRUPT_SETUP;
+      hid_set_protocol(); // Set protocol before establishing HID interrupt channel
+      l2cap_set_state(L2CAP_INTERRUPT_SETUP);
     }
     break;
 
@@ -743,14 +2249,12 @@ static void L2CAP_Task() {
 #ifdef DEBUG_USB_HOST
       printf("HID Interrupt Incoming Connection Request\n");
 #endif
-      l2cap_connection_response(PENDING);
-      vTaskDelay(1 / portTICK_PERIOD_MS);
-      l2cap_connection_response(SUCCESSFUL);
+      l2cap_connection_response(identifier, interrupt_dcid, interrupt_scid, PENDING);
+      l2cap_connection_response(identifier, interrupt_dcid, interrupt_scid, SUCCESSFUL);
       identifier++;
-      vTaskDelay(1 / portTICK_PERIOD_MS);
-      l2cap_config_request();
+      l2cap_config_request(identifier, interrupt_scid, &interrupt_channel.local);
 
-      l2cap_state = L2CAP_INTERRUPT_CONFIG_REQUEST;
+      l2cap_set_state(L2CAP_INTERRUPT_CONFIG_REQUEST);
     }
     break;
 
@@ -761,21 +2265,21 @@ static void L2CAP_Task() {
       printf("Send HID Control Config Request\n");
 #endif
       identifier++;
-      l2cap_config_request();
-      l2cap_state = L2CAP_CONTROL_CONFIG_REQUEST;
+      l2cap_config_request(identifier, control_scid, &control_channel.local);
+      l2cap_set_state(L2CAP_CONTROL_CONFIG_REQUEST);
     }
     break;
 
   case L2CAP_CONTROL_CONFIG_REQUEST:
     if (l2cap_check_flag(L2CAP_FLAG_CONFIG_CONTROL_SUCCESS)) {
-      //setProtocol(); // Set protocol before establishing HID interrupt channel
-      vTaskDelay(1 / portTICK_PERIOD_MS); // Short delay between commands - just to be sure
+      hid_set_protocol(); // Set protocol before establishing HID interrupt channel
 #ifdef DEBUG_USB_HOST
     printf("Send HID Interrupt Connection Request\n");
 #endif
       identifier++;
-      l2cap_connection_request();
-      l2cap_state = L2CAP_INTERRUPT_CONNECT_REQUEST;
+      l2cap_channel_init(&interrupt_channel, L2CAP_HID_INTERRUPT_MTU, l2cap_interrupt_flush_timeout());
+      l2cap_connection_request(identifier, interrupt_dcid, 0x13);
+      l2cap_set_state(L2CAP_INTERRUPT_CONNECT_REQUEST);
     }
     break;
 
@@ -785,8 +2289,8 @@ static void L2CAP_Task() {
         printf("Send HID Interrupt Config Request\n");
 #endif
         identifier++;
-        l2cap_config_request();
-        l2cap_state = L2CAP_INTERRUPT_CONFIG_REQUEST;
+        l2cap_config_request(identifier, interrupt_scid, &interrupt_channel.local);
+        l2cap_set_state(L2CAP_INTERRUPT_CONFIG_REQUEST);
       }
       break;
 
@@ -798,8 +2302,14 @@ static void L2CAP_Task() {
         connectToHIDDevice = false;
         pairWithHIDDevice = false;
         connected = true;
-        //onInit();
-        l2cap_state = L2CAP_DONE;
+        if (btdProvisioning)
+          provision_stage(PROVISION_STAGE_VERIFY);
+
+        hid_device_t *device = hid_device_find(hci_handle);
+        if (device != NULL)
+          hid_device_connected(device);
+        l2cap_set_state(L2CAP_DONE);
+        sdp_start(); // Nothing to do if the descriptor was stored
       }
       break;
 
@@ -812,8 +2322,8 @@ static void L2CAP_Task() {
         printf("Disconnected Interrupt Channel\n");
 #endif
         identifier++;
-        l2cap_disconnection_request();
-        l2cap_state = L2CAP_CONTROL_DISCONNECT;
+        l2cap_disconnection_request(identifier, control_scid, control_dcid);
+        l2cap_set_state(L2CAP_CONTROL_DISCONNECT);
       }
       break;
 
@@ -822,10 +2332,11 @@ static void L2CAP_Task() {
 #ifdef DEBUG_USB_HOST
         printf("Disconnected Control Channel\n");
 #endif
+        l2cap_signal_flush(); // Must go out before the handle is released
         hci_disconnect(hci_handle);
         hci_handle = -1; // Reset handle
         l2cap_event_flag = 0; // Reset flags
-        l2cap_state = L2CAP_WAIT;
+        l2cap_set_state(L2CAP_WAIT);
       }
       break;
   }
@@ -847,6 +2358,12 @@ static void HCI_Event_Task(uint8_t *buf, uint16_t length) {
 #ifdef EXTRADEBUG
       printf("HCI Command Complete Status 0x%x\n", buf[5]);
 #endif
+      hci_cmd_credits = buf[2]; // Num_HCI_Command_Packets
+      hci_command_answered(buf[3] | (buf[4] << 8));
+      hci_cmd_opcode = buf[3] | (buf[4] << 8);
+      hci_cmd_status = buf[5];
+      hci_set_flag(HCI_FLAG_CMD_ANSWERED);
+
       if (!buf[5]) { // Check if command succeeded
         hci_set_flag(HCI_FLAG_CMD_COMPLETE); // Set command complete flag
 
@@ -861,8 +2378,34 @@ static void HCI_Event_Task(uint8_t *buf, uint16_t length) {
 #endif
           hci_version = buf[6]; // Used to check if it supports 2.0+EDR - see http://www.bluetooth.org/Technical/AssignedNumbers/hci.htm
           hci_set_flag(HCI_FLAG_READ_VERSION);
+        } else if ((buf[3] == 0x03) && (buf[4] == 0x10)) { // Parameters from read local supported features
+          memcpy(hci_features, &buf[6], sizeof(hci_features));
+          hci_set_flag(HCI_FLAG_READ_FEATURES);
+        } else if ((buf[3] == 0x02) && (buf[4] == 0x10)) { // Parameters from read local supported commands
+          memcpy(hci_commands, &buf[6], sizeof(hci_commands));
+          hci_set_flag(HCI_FLAG_READ_COMMANDS);
+        } else if ((buf[3] == 0x04) && (buf[4] == 0x10)) { // Parameters from read local extended features
+          if (buf[6] == 1)
+            memcpy(hci_ext_features, &buf[8], sizeof(hci_ext_features));
+          hci_set_flag(HCI_FLAG_READ_FEATURES);
+        } else if ((buf[3] == 0x05) && (buf[4] == 0x10)) { // Parameters from read buffer size
+          hci_acl_mtu = buf[6] | (buf[7] << 8);
+          hci_acl_max_credits = buf[9] | (buf[10] << 8);
+          hci_acl_credits = hci_acl_max_credits;
+#ifdef EXTRADEBUG
+          printf("ACL buffers: %d x %d bytes\n", hci_acl_max_credits, hci_acl_mtu);
+#endif
+          hci_set_flag(HCI_FLAG_READ_BUFFER_SIZE);
+        }
+      } else if ((buf[3] == 0x11) && (buf[4] == 0x08)) { // Sniff_Subrating refused, so no Sniff Subrating event follows
+        bt_link_t *link = bt_link_find(buf[6] | ((buf[7] & 0x0F) << 8));
+
+        if (link != NULL) {
+          link->subrate_pending = false;
+          bt_timer_arm(&link->idle_timer, link->sniff->subrate_timeout); // Try again after another while
         }
       }
+      hci_tx_pump();
       break;
 
     case EV_COMMAND_STATUS:
@@ -871,49 +2414,90 @@ static void HCI_Event_Task(uint8_t *buf, uint16_t length) {
         printf("HCI Command Failed: 0x%x\n", buf[2]);
 #endif
       }
-      break;
+      hci_cmd_credits = buf[3]; // Num_HCI_Command_Packets
+      hci_command_answered(buf[4] | (buf[5] << 8));
 
-    case EV_INQUIRY_COMPLETE:
-      if (inquiry_counter >= 5) {
-        inquiry_counter = 0;
-#ifdef DEBUG_USB_HOST
-        printf("Couldn't find HID device\n");
-#endif
+      if ((buf[4] == 0x03 || buf[4] == 0x04) && buf[5] == 0x08) // Sniff_Mode, Exit_Sniff_Mode
+        hci_mode_status(buf[2]);
+      hci_tx_pump();
+      break;
 
-        hci_state = HCI_SCANNING_STATE;
+    case EV_NUM_COMPLETE_PKT:
+      portENTER_CRITICAL(&hci_tx_lock);
+      for (uint8_t i = 0; i < buf[2]; i++) { // Number of handles
+        bt_link_t *link = bt_link_find((buf[3 + 4 * i] | (buf[4 + 4 * i] << 8)) & 0x0FFF);
+        uint16_t completed = buf[5 + 4 * i] | (buf[6 + 4 * i] << 8);
+
+        hci_acl_credits += completed;
+        if (hci_acl_credits > hci_acl_max_credits)
+          hci_acl_credits = hci_acl_max_credits;
+        if (link != NULL && completed) {
+          link->acl_outstanding -= min(completed, link->acl_outstanding);
+          link->acl_since = millis();
+        }
       }
+      portEXIT_CRITICAL(&hci_tx_lock);
+      hci_tx_pump();
+      break;
 
-      inquiry_counter++;
+    case EV_INQUIRY_COMPLETE:
+      if (hci_discovering) {
+        hci_discovery_slice_done();
+      } else if (btdProvisioning) { // Keep looking, the line never runs out of units
+        if ((hci_state == HCI_INQUIRY_STATE || hci_state == HCI_PROVISION_STATE) && !provision_candidate_pending())
+          hci_inquiry();
+      } else if (hci_state == HCI_INQUIRY_STATE && !hci_check_flag(HCI_FLAG_DEVICE_FOUND)) {
+        hci_inquiry(); // Until HCI_INQUIRY_TIMEOUT
+      }
       break;
 
     case EV_INQUIRY_RESULT:
+    case EV_INQUIRY_RESULT_RSSI: // One reserved byte less per response, and the RSSI at the end
       if (buf[2]) { // Check that there is more than zero responses
 
 #ifdef EXTRADEBUG
         printf("Number of responses: %d\n", buf[2]);
 #endif
         for (uint8_t i = 0; i < buf[2]; i++) {
-          uint8_t offset = 8 * buf[2] + 3 * i;
+          // The classes follow the addresses, page scan modes and one or two reserved bytes of every response
+          uint16_t offset = 3 + (buf[0] == EV_INQUIRY_RESULT_RSSI ? 8 : 9) * buf[2] + 3 * i;
+
+          uint8_t class_of_device[3]; // classOfDevice is only set for the device that is connected to
 
           for (uint8_t j = 0; j < 3; j++)
-            classOfDevice[j] = buf[j + 4 + offset];
+            class_of_device[j] = buf[offset + j];
+
+#ifdef EXTRADEBUG
+          if (buf[0] == EV_INQUIRY_RESULT_RSSI)
+            printf("RSSI: %d dBm\n", (int8_t)buf[3 + 13 * buf[2] + i]);
+#endif
 
 #ifdef EXTRADEBUG
-          printf("Class of device: 0x%x 0x%x 0x%x\n", classOfDevice[2], classOfDevice[1], classOfDevice[0]);
+          printf("Class of device: 0x%x 0x%x 0x%x\n", class_of_device[2], class_of_device[1], class_of_device[0]);
 #endif
 
-          if ((classOfDevice[1] & 0x05) && (classOfDevice[0] & 0xC8)) {
+          if ((class_of_device[1] & 0x05) && (class_of_device[0] & 0xC8)) {
+            if (btdProvisioning) { // disc_bdaddr belongs to the unit being provisioned
+              provision_candidate_add(&buf[3 + 6 * i], class_of_device);
+              continue;
+            }
+            if (hci_discovering) { // disc_bdaddr belongs to the connected device
+              if (bt_link_find_bdaddr(&buf[3 + 6 * i]) == NULL)
+                bt_discovery_found(&buf[3 + 6 * i], class_of_device);
+              continue;
+            }
 #ifdef DEBUG_USB_HOST
-            if (classOfDevice[0] & 0x80)
+            if (class_of_device[0] & 0x80)
               printf("Mouse found: ");
-            if (classOfDevice[0] & 0x40)
+            if (class_of_device[0] & 0x40)
               printf("Keyboard found:");
-            if (classOfDevice[0] & 0x08)
+            if (class_of_device[0] & 0x08)
               printf("Gamepad found: ");
 #endif
 
             for (uint8_t j = 0; j < 6; j++)
               disc_bdaddr[j] = buf[j + 3 + 6 * i];
+            memcpy(classOfDevice, class_of_device, 3);
 
 #ifdef DEBUG_USB_HOST
             for (uint8_t i = 0; i < 5; i++)
@@ -937,9 +2521,50 @@ static void HCI_Event_Task(uint8_t *buf, uint16_t length) {
         printf("Connection established\n");
 #endif
         hci_handle = buf[3] | ((buf[4] & 0x0F) << 8); // Store the handle for the ACL connection
+        if (hci_reconnect_paging && memcmp(&buf[5], hci_reconnect_bdaddr, 6) == 0)
+          hci_reconnect_paging = false;
+        bt_reconnect_cancel(&buf[5]); // It is back, whichever side paged
+        bt_discovery_forget(&buf[5]);
+        bt_discovery_start(millis()); // Gives the new link time to settle before the next slice
+        hci_scan_activity = millis();
+
+        // classOfDevice came with the inquiry result or Connection Request of disc_bdaddr, so it only
+        // applies if that device is the one that connected
+        static const uint8_t unknown_class[3] = { 0x00, 0x00, 0x00 };
+        bt_link_t *link = bt_link_add(hci_handle, &buf[5], memcmp(&buf[5], disc_bdaddr, 6) == 0 ? classOfDevice : unknown_class);
+        if (link != NULL) {
+          profile_link(hci_handle);
+          link->role = hci_connect_role;
+          hci_link_latency_setup(link);
+          if (bt_store_load_features(&buf[5], link->features)) { // Bonded, known from the last connection
+            link->features_valid = true;
+            hci_link_features(link);
+          } else {
+            hci_read_remote_supported_features(hci_handle);
+          }
+        }
+
+        hid_device_t *device = hid_device_open(hci_handle);
+        if (device != NULL)
+          hid_restore_record(device, &buf[5]);
+
         hci_set_flag(HCI_FLAG_CONNECT_COMPLETE); // Set connection complete flag
+      } else if (hci_reconnect_paging && memcmp(&buf[5], hci_reconnect_bdaddr, 6) == 0) {
+        hci_reconnect_paging = false;
+        hci_clear_flag(HCI_FLAG_CONNECT_EVENT);
+        bt_reconnect_failed(hci_reconnect_bdaddr, millis());
+        hci_timeout((void *)HCI_TIMEOUT_RECONNECT); // Rearms the timer for the next page
+        if (hci_state == HCI_RECONNECT_STATE) // Otherwise another device is connecting in the meantime
+          hci_set_state(HCI_CONNECT_IN_STATE); // Page scan is still enabled
+#ifdef DEBUG_USB_HOST
+        printf("Reconnect failed: 0x%x\n", buf[2]);
+#endif
       } else {
-        hci_state = HCI_CHECK_DEVICE_SERVICE;
+        if (btdProvisioning) {
+          provision_unit_done(disc_bdaddr, false);
+          hci_clear_flag(HCI_FLAG_CONNECT_EVENT); // The next unit must not see this attempt
+        }
+        hci_set_state(HCI_CHECK_DEVICE_SERVICE);
 #ifdef DEBUG_USB_HOST
         printf("Connection Failed: 0x%x\n", buf[2]);
 #endif
@@ -950,6 +2575,34 @@ static void HCI_Event_Task(uint8_t *buf, uint16_t length) {
       if (!buf[2]) { // Check if disconnected OK
         hci_set_flag(HCI_FLAG_DISCONNECT_COMPLETE); // Set disconnect command complete flag
         hci_clear_flag(HCI_FLAG_CONNECT_COMPLETE); // Clear connection complete flag
+
+        uint16_t handle = buf[3] | ((buf[4] & 0x0F) << 8);
+        bt_link_t *link = bt_link_find(handle);
+        bool lost = link != NULL && (buf[5] == 0x08 || buf[5] == 0x22); // Supervision or LMP response timeout
+        if (lost) {
+          memcpy(hci_lost_bdaddr, link->bdaddr, 6);
+          memcpy(hci_lost_class, link->class_of_device, 3);
+          hci_link_lost = true;
+        }
+        if (lost && handle == hci_handle) { // The channels never got a disconnect, ready them for the reconnect
+          l2cap_reset();
+          l2capConnectionClaimed = false;
+          connectToHIDDevice = false;
+        }
+        if (link != NULL) { // The controller flushes the packets of the link without completing them
+          portENTER_CRITICAL(&hci_tx_lock);
+          hci_acl_credits = min(hci_acl_credits + link->acl_outstanding, hci_acl_max_credits);
+          link->acl_outstanding = 0;
+          portEXIT_CRITICAL(&hci_tx_lock);
+        }
+        bt_link_remove(handle);
+        hid_device_close(handle);
+        hci_scan_activity = millis();
+        hci_tx_pump();
+        profile_state(PROFILE_MACHINE_AUTH, PROFILE_AUTH_IDLE);
+        profile_connection_done(false); // Nothing if the connection had already been completed
+        sdp_state = SDP_IDLE;
+        sdp_rx_expected = 0;
       }
       break;
 
@@ -994,6 +2647,7 @@ static void HCI_Event_Task(uint8_t *buf, uint16_t length) {
       break;
 
     case EV_PIN_CODE_REQUEST:
+      profile_state(PROFILE_MACHINE_AUTH, PROFILE_AUTH_PENDING);
       if (btdPin != NULL) {
 #ifdef DEBUG_USB_HOST
         printf("Bluetooth pin is set to: %s\n", btdPin);
@@ -1007,37 +2661,240 @@ static void HCI_Event_Task(uint8_t *buf, uint16_t length) {
       }
       break;
 
-    case EV_LINK_KEY_REQUEST:
+    case EV_LINK_KEY_REQUEST: {
+      bt_store_link_key_t link_key;
+
+      profile_state(PROFILE_MACHINE_AUTH, PROFILE_AUTH_PENDING);
+      if (bt_store_load_link_key(&buf[2], &link_key)) {
+#ifdef DEBUG_USB_HOST
+        printf("Received Key Request - using stored key\n");
+#endif
+        hci_link_key_request_reply(&buf[2], link_key.key);
+      } else {
+#ifdef DEBUG_USB_HOST
+        printf("Received Key Request\n");
+#endif
+        hci_link_key_request_negative_reply(&buf[2]);
+      }
+      break;
+    }
+
+    case EV_LINK_KEY_NOTIFICATION: {
+      bt_store_link_key_t link_key;
+
+      memcpy(link_key.key, &buf[8], 16);
+      link_key.type = buf[24];
+#ifdef EXTRADEBUG
+      printf("Link key type: 0x%x\n", link_key.type);
+#endif
+      bt_store_save_link_key(&buf[2], &link_key);
+
+      bt_link_t *link = bt_link_find_bdaddr(&buf[2]);
+      if (link != NULL && link->features_valid)
+        bt_store_save_features(link->bdaddr, link->features);
+      break;
+    }
+
+    case EV_IO_CAPABILITY_REQUEST:
+      profile_state(PROFILE_MACHINE_AUTH, PROFILE_AUTH_PENDING);
+#ifdef DEBUG_USB_HOST
+      printf("Simple pairing - IO capability: %d\n", hci_io_capability());
+#endif
+      hci_io_capability_request_reply(&buf[2]);
+      break;
+
+    case EV_IO_CAPABILITY_RESPONSE:
+#ifdef EXTRADEBUG
+      printf("Remote IO capability: %d Authentication: 0x%x\n", buf[8], buf[10]);
+#endif
+      break;
+
+    case EV_USER_CONFIRMATION_REQUEST: { // Numeric comparison, or Just Works if either side has no IO
+      uint32_t value = buf[8] | (buf[9] << 8) | (buf[10] << 16) | ((uint32_t)buf[11] << 24);
+
+#ifdef DEBUG_USB_HOST
+      printf("Simple pairing value: %06lu\n", (unsigned long)value);
+#endif
+      if (hci_io_capability() == HCI_IO_CAP_DISPLAY_YES_NO) {
+        hci_pairing_request(EV_USER_CONFIRMATION_REQUEST, &buf[2]);
+        btdConfirm(&buf[2], value);
+      } else {
+        hci_user_confirmation_request_reply(&buf[2], true);
+      }
+      break;
+    }
+
+    case EV_USER_PASSKEY_REQUEST:
+      if (hci_io_capability() == HCI_IO_CAP_KEYBOARD_ONLY) {
+        hci_pairing_request(EV_USER_PASSKEY_REQUEST, &buf[2]);
+        btdPasskeyEntry(&buf[2]);
+      } else {
+        hci_user_passkey_request_negative_reply(&buf[2]);
+      }
+      break;
+
+    case EV_USER_PASSKEY_NOTIFICATION: {
+      uint32_t passkey = buf[8] | (buf[9] << 8) | (buf[10] << 16) | ((uint32_t)buf[11] << 24);
+
+#ifdef DEBUG_USB_HOST
+      printf("Enter passkey on the device: %06lu\n", (unsigned long)passkey);
+#endif
+      if (btdPasskeyDisplay != NULL)
+        btdPasskeyDisplay(&buf[2], passkey);
+      break;
+    }
+
+    case EV_SIMPLE_PAIRING_COMPLETE: // Authentication Complete follows
+      hci_pairing_drop(&buf[3]);
 #ifdef DEBUG_USB_HOST
-      printf("Received Key Request\n");
+      if (buf[2])
+        printf("Simple pairing failed: 0x%x\n", buf[2]);
 #endif
-      hci_link_key_request_negative_reply();
       break;
 
     case EV_AUTHENTICATION_COMPLETE:
+      profile_state(PROFILE_MACHINE_AUTH, PROFILE_AUTH_IDLE);
       if (!connectToHIDDevice) {
 #ifdef DEBUG_USB_HOST
         printf("Pairing successful with HID device\n");
 #endif
         connectToHIDDevice = true; // Used to indicate to the BTHID service, that it should connect to this device
+
+        if (btdProvisioning) { // Look for the next unit while this one sets up its channels
+          provision_stage(PROVISION_STAGE_L2CAP);
+          if (!provision_candidate_pending())
+            hci_inquiry();
+        }
       } else {
 #ifdef DEBUG_USB_HOST
         printf("Pairing Failed: 0x%x\n", buf[2]);
 #endif
         hci_disconnect(hci_handle);
-        hci_state = HCI_DISCONNECT_STATE;
+        hci_set_state(HCI_DISCONNECT_STATE);
       }
       break;
 
-    case EV_NUM_COMPLETE_PKT:
-    case EV_ROLE_CHANGED:
+    case EV_QOS_SETUP_COMPLETE: {
+      bt_link_t *link = bt_link_find(buf[3] | ((buf[4] & 0x0F) << 8));
+
+      if (link != NULL) {
+        bt_qos_t achieved;
+        achieved.service_type = buf[6];
+        achieved.token_rate = buf[7] | (buf[8] << 8) | (buf[9] << 16) | ((uint32_t)buf[10] << 24);
+        achieved.peak_bandwidth = buf[11] | (buf[12] << 8) | (buf[13] << 16) | ((uint32_t)buf[14] << 24);
+        achieved.latency = buf[15] | (buf[16] << 8) | (buf[17] << 16) | ((uint32_t)buf[18] << 24);
+        achieved.delay_variation = buf[19] | (buf[20] << 8) | (buf[21] << 16) | ((uint32_t)buf[22] << 24);
+        bt_link_qos_complete(link, buf[2], &achieved);
+#ifdef DEBUG_USB_HOST
+        printf("QoS Setup Complete - Status: 0x%x Latency: %lu us State: %d\n", buf[2], (unsigned long)achieved.latency, link->qos_state);
+#endif
+      }
+      break;
+    }
+
+    case EV_FLOW_SPEC_COMPLETE: {
+      bt_link_t *link = bt_link_find(buf[3] | ((buf[4] & 0x0F) << 8));
+
+      if (link != NULL && !buf[2] && buf[6] == 0x01) // Incoming flow
+        link->access_latency = buf[20] | (buf[21] << 8) | (buf[22] << 16) | ((uint32_t)buf[23] << 24); // After the token rate, bucket size and peak bandwidth
+      break;
+    }
+
+    case EV_MODE_CHANGE: {
+      bt_link_t *link = bt_link_find(buf[3] | ((buf[4] & 0x0F) << 8));
+
+      if (link != NULL) {
+        link->mode_pending = false;
+
+        if (!buf[2]) {
+          link->mode = buf[5];
+          link->sniff_interval = buf[6] | (buf[7] << 8);
+
+          if (link->mode == BT_MODE_ACTIVE) {
+            link->subrated = false;
+            link->subrate_pending = false;
+          }
+        }
+#ifdef EXTRADEBUG
+        printf("Mode Change - Status: 0x%x Handle: 0x%x Mode: %d Interval: %d\n", buf[2], link->handle, link->mode, link->sniff_interval);
+#endif
+        hci_timeout((void *)HCI_TIMEOUT_IDLE); // Arm the idle timer for whatever comes next in the new mode
+      }
+      break;
+    }
+
+    case EV_READ_REMOTE_FEATURES_COMPLETE: {
+      bt_link_t *link = bt_link_find(buf[3] | ((buf[4] & 0x0F) << 8));
+
+      if (!buf[2] && link != NULL) {
+        bt_store_link_key_t link_key;
+
+        memcpy(link->features, &buf[5], sizeof(link->features));
+        link->features_valid = true;
+        if (bt_store_load_link_key(link->bdaddr, &link_key)) // Not bonded yet on the first connection, saved with the link key then
+          bt_store_save_features(link->bdaddr, link->features);
+        hci_link_features(link);
+      }
+      break;
+    }
+
+    case EV_PACKET_TYPE_CHANGED: {
+      bt_link_t *link = bt_link_find(buf[3] | ((buf[4] & 0x0F) << 8));
+
+      if (!buf[2] && link != NULL) {
+        link->packet_types = buf[5] | (buf[6] << 8);
+#ifdef DEBUG_USB_HOST
+        printf("Packet types: 0x%04x%s\n", link->packet_types, (link->packet_types & HCI_PACKET_NO_EDR) != HCI_PACKET_NO_EDR ? " EDR" : "");
+#endif
+      }
+      break;
+    }
+
+    case EV_ROLE_CHANGED: {
+      bt_link_t *link = bt_link_find_bdaddr(&buf[3]);
+
+#ifdef DEBUG_USB_HOST
+      printf("Role change - Status: 0x%x Role: %s\n", buf[2], buf[9] == BT_ROLE_MASTER ? "master" : "slave");
+#endif
+      if (link == NULL) { // During connection setup, before Connection Complete
+        if (!buf[2])
+          hci_connect_role = buf[9];
+        break;
+      }
+
+      link->role_pending = false;
+      if (!buf[2])
+        link->role = buf[9];
+      hci_link_policy(link);
+      hci_link_role(link); // Tries again if the switch failed or the device took the role back
+      break;
+    }
+
+    case EV_SNIFF_SUBRATING: { // Also sent when the device sets up subrating itself
+      bt_link_t *link = bt_link_find(buf[3] | ((buf[4] & 0x0F) << 8));
+
+      if (link != NULL) {
+        link->subrate_pending = false;
+
+        if (!buf[2]) {
+          link->max_tx_latency = buf[5] | (buf[6] << 8);
+          link->max_rx_latency = buf[7] | (buf[8] << 8);
+          // A latency of one sniff interval is a subrate of 1, which is plain sniff mode
+          link->subrated = link->mode == BT_MODE_SNIFF &&
+                           (link->max_tx_latency > link->sniff_interval || link->max_rx_latency > link->sniff_interval);
+        }
+#ifdef EXTRADEBUG
+        printf("Sniff Subrating - Status: 0x%x Handle: 0x%x Max latency TX: %d RX: %d\n", buf[2], link->handle, link->max_tx_latency, link->max_rx_latency);
+#endif
+      }
+      break;
+    }
+
     case EV_PAGE_SCAN_REP_MODE:
     case EV_LOOPBACK_COMMAND:
     case EV_DATA_BUFFER_OVERFLOW:
     case EV_CHANGE_CONNECTION_LINK:
     case EV_MAX_SLOTS_CHANGE:
-    case EV_QOS_SETUP_COMPLETE:
-    case EV_LINK_KEY_NOTIFICATION:
     case EV_ENCRYPTION_CHANGE:
     case EV_READ_REMOTE_VERSION_INFORMATION_COMPLETE:
       break;
@@ -1052,10 +2909,93 @@ static void HCI_Event_Task(uint8_t *buf, uint16_t length) {
   }
 }
 
+/* Whether the controller answered the command, successful or not. The optional init steps go on either way
+   and record a refusal as unsupported. */
+static bool hci_command_done(uint16_t opcode) {
+  if (!hci_check_flag(HCI_FLAG_CMD_ANSWERED) || hci_cmd_opcode != opcode)
+    return false;
+
+#ifdef DEBUG_USB_HOST
+  if (hci_cmd_status)
+    printf("Command 0x%04x not supported: 0x%x\n", opcode, hci_cmd_status);
+#endif
+  return true;
+}
+
+/* The optional steps at the end of init, each only taken if the controller supports it */
+static void hci_init_name() {
+  if (btdName != NULL) {
+    hci_set_local_name(btdName);
+    hci_set_state(HCI_SET_NAME_STATE);
+  } else {
+    hci_set_state(HCI_CHECK_DEVICE_SERVICE);
+  }
+}
+
+static void hci_init_inquiry_mode() {
+  if (hci_local_feature(HCI_FEATURE_RSSI_INQUIRY) && hci_local_command(HCI_COMMAND_WRITE_INQUIRY_MODE)) {
+    hci_write_inquiry_mode(0x01);
+    hci_set_state(HCI_INQUIRY_MODE_STATE);
+  } else {
+    hci_init_name();
+  }
+}
+
+static void hci_init_ext_features() {
+  if (!hci_caps_valid && hci_local_feature(HCI_FEATURE_EXTENDED) && hci_local_command(HCI_COMMAND_READ_LOCAL_EXT_FEATURES)) {
+    hci_read_local_extended_features(1); // After Write_Simple_Pairing_Mode, so it shows whether that took effect
+    hci_set_state(HCI_LOCAL_EXT_FEATURES_STATE);
+  } else {
+    hci_caps_valid = true;
+    hci_init_inquiry_mode();
+  }
+}
+
+/* Every controller gets the mask, Sniff Subrating is not reported by default either */
+static void hci_init_event_mask() {
+  hci_set_event_mask(HCI_EVENT_MASK);
+  hci_set_state(HCI_EVENT_MASK_STATE);
+}
+
 void mainTask(void *pvParameters) {
+  hci_task_handle = xTaskGetCurrentTaskHandle();
+
   while (1) {
+    if (hci_link_lost) { // Reads the store, so it is not done from the VHCI callback
+      hci_link_lost = false;
+      hci_reconnect_schedule(hci_lost_bdaddr, hci_lost_class);
+    }
     HCI_Task();
-    vTaskDelay(100 / portTICK_PERIOD_MS);
+    if (hci_check_timeout(HCI_TIMEOUT_IDLE))
+      hci_link_power_policy();
+    if (hci_check_timeout(HCI_TIMEOUT_L2CAP_RTX))
+      l2cap_rtx_expired();
+    if (hci_check_timeout(HCI_TIMEOUT_SDP))
+      sdp_expired();
+    if (hci_check_timeout(HCI_TIMEOUT_DISCOVERY))
+      hci_discovery_check();
+    if (hci_check_timeout(HCI_TIMEOUT_PAIRING))
+      hci_pairing_reply();
+    if (hci_check_timeout(HCI_TIMEOUT_RECONNECT)) {
+      uint32_t next = bt_reconnect_next(millis());
+      if (next) // Otherwise the page is due, HCI_Task picks it up
+        bt_timer_arm(&hci_reconnect_timer, next);
+    }
+    if (hci_check_timeout(HCI_TIMEOUT_WATCHDOG)) {
+      hci_watchdog();
+      if (hci_scan_mode != BT_SCAN_COUNT && !hci_recovering) // Scanning has been set up
+        hci_scan_policy();
+      bt_timer_arm(&hci_watchdog_timer, HCI_WATCHDOG_PERIOD);
+    }
+    hci_tx_pump(); // Catch up on anything left waiting for a credit
+#ifdef PRINTLATENCY
+    static uint32_t latency_timer = 0;
+    if (millis() - latency_timer > 10000) {
+      latency_timer = millis();
+      latency_print();
+    }
+#endif
+    ulTaskNotifyTake(pdTRUE, 100 / portTICK_PERIOD_MS); // Timeouts wake it right away
   }
 
   return;
@@ -1064,43 +3004,50 @@ void mainTask(void *pvParameters) {
 static void HCI_Task() {
   esp_vhci_host_register_callback(&vhci_host_cb);
 
+  if (hci_state_command(hci_state) && hci_check_timeout(HCI_TIMEOUT_STATE)) { // Refused or lost, init cannot go on
+    printf("No answer to the command of HCI state %d\n", hci_state);
+    hci_recover();
+    return;
+  }
+
   switch (hci_state) {
     case HCI_INIT_STATE:
-      hci_counter++;
-
-      if (hci_counter > hci_num_reset_loops) { // wait until we have looped x times to clear any old events
+      if (hci_check_timeout(HCI_TIMEOUT_STATE)) { // Wait a while to clear any old events
 #ifdef DEBUG_USB_HOST
         printf("Resetting HCI State\n");
 #endif
         hci_reset();
-        hci_state = HCI_RESET_STATE;
-        hci_counter = 0;
+        hci_set_state(HCI_RESET_STATE);
+        bt_timer_arm(&hci_state_timer, hci_reset_timeout);
       }
       break;
 
     case HCI_RESET_STATE:
-      hci_counter++;
-
       if (hci_check_flag(HCI_FLAG_CMD_COMPLETE)) {
-        hci_counter = 0;
-
 #ifdef DEBUG_USB_HOST
         printf("HCI Reset complete\n");
 #endif
 
-        hci_state = HCI_CLASS_STATE;
+        hci_set_state(HCI_CLASS_STATE);
         hci_write_class_of_device();
-      } else if (hci_counter > hci_num_reset_loops) {
-        hci_num_reset_loops *= 10;
-
-        if (hci_num_reset_loops > 2000)
-          hci_num_reset_loops = 2000;
+      } else if (hci_check_timeout(HCI_TIMEOUT_STATE)) {
+        if (!hci_recovering) {
+          hci_reset_timeout *= 2;
+
+          if (hci_reset_timeout > HCI_RESET_TIMEOUT_MAX)
+            hci_reset_timeout = HCI_RESET_TIMEOUT_MAX;
+        } else if (++hci_recovery_resets >= HCI_RECOVERY_MAX_RESETS) { // Wedged for good, restart the controller
+          printf("Restarting Bluetooth controller\n");
+          esp_bt_controller_disable();
+          esp_bt_controller_enable(btdControllerMode);
+          hci_recovery_resets = 0;
+        }
 
 #ifdef DEBUG_USB_HOST
         printf("No response to HCI Reset\n");
 #endif
-        hci_state = HCI_INIT_STATE;
-        hci_counter = 0;
+        hci_set_state(HCI_INIT_STATE);
+        bt_timer_arm(&hci_state_timer, hci_reset_timeout);
       }
       break;
 
@@ -1109,7 +3056,7 @@ static void HCI_Task() {
 #ifdef DEBUG_USB_HOST
         printf("Write class of device\n");
 #endif
-        hci_state = HCI_BDADDR_STATE;
+        hci_set_state(HCI_BDADDR_STATE);
         hci_read_bdaddr();
       }
       break;
@@ -1125,58 +3072,162 @@ static void HCI_Task() {
 
         printf("%x\n", own_bdaddr[0]);
 #endif
+        hci_read_buffer_size();
+        hci_set_state(HCI_BUFFER_SIZE_STATE);
+      }
+      break;
+
+    case HCI_BUFFER_SIZE_STATE:
+      if (hci_check_flag(HCI_FLAG_READ_BUFFER_SIZE)) {
         hci_read_local_version_information();
-        hci_state = HCI_LOCAL_VERSION_STATE;
+        hci_set_state(HCI_LOCAL_VERSION_STATE);
       }
       break;
 
     case HCI_LOCAL_VERSION_STATE: // The local version is used by the PS3BT class
       if (hci_check_flag(HCI_FLAG_READ_VERSION)) {
-        if (btdName != NULL) {
-          hci_set_local_name(btdName);
-          hci_state = HCI_SET_NAME_STATE;
+        if (hci_caps_valid) { // Already known from before the controller was reset
+          hci_init_event_mask();
+        } else {
+          hci_read_local_supported_features();
+          hci_set_state(HCI_LOCAL_FEATURES_STATE);
+        }
+      }
+      break;
+
+    case HCI_LOCAL_FEATURES_STATE:
+      if (hci_check_flag(HCI_FLAG_READ_FEATURES)) {
+        if (hci_version >= 2) { // Read_Local_Supported_Commands came with 1.2
+          hci_read_local_supported_commands();
+          hci_set_state(HCI_LOCAL_COMMANDS_STATE);
+        } else {
+          hci_init_event_mask();
+        }
+      }
+      break;
+
+    case HCI_LOCAL_COMMANDS_STATE:
+      if (hci_command_done(0x1002)) { // Read_Local_Supported_Commands
+        if (hci_cmd_status)
+          memset(hci_commands, 0, sizeof(hci_commands));
+        hci_init_event_mask();
+      }
+      break;
+
+    case HCI_LOCAL_EXT_FEATURES_STATE:
+      if (hci_command_done(0x1004)) { // Read_Local_Extended_Features
+        if (hci_cmd_status) {
+          hci_local_unsupported(hci_features, HCI_FEATURE_EXTENDED);
+          memset(hci_ext_features, 0, sizeof(hci_ext_features));
+        }
+#ifdef DEBUG_USB_HOST
+        if (HCI_FEATURE(hci_ext_features, HCI_FEATURE_HOST_SIMPLE_PAIRING))
+          printf("Simple pairing enabled\n");
+#endif
+        hci_caps_valid = true;
+        hci_init_inquiry_mode();
+      }
+      break;
+
+    case HCI_INQUIRY_MODE_STATE:
+      if (hci_command_done(0x0C45)) { // Write_Inquiry_Mode
+        if (hci_cmd_status) // Results come without RSSI
+          hci_local_unsupported(hci_features, HCI_FEATURE_RSSI_INQUIRY);
+        hci_init_name();
+      }
+      break;
+
+    case HCI_EVENT_MASK_STATE:
+      if (hci_command_done(0x0C01)) { // Set_Event_Mask
+        if (hci_cmd_status) { // The pairing and subrating events would not get through
+          hci_local_unsupported(hci_features, HCI_FEATURE_SIMPLE_PAIRING);
+          hci_local_unsupported(hci_features, HCI_FEATURE_SNIFF_SUBRATING);
+        }
+        if (btdSimplePairing && hci_local_feature(HCI_FEATURE_SIMPLE_PAIRING) && hci_local_command(HCI_COMMAND_WRITE_SIMPLE_PAIRING_MODE)) {
+          hci_write_simple_pairing_mode(true);
+          hci_set_state(HCI_SIMPLE_PAIRING_STATE);
         } else {
-          hci_state = HCI_CHECK_DEVICE_SERVICE;
+          hci_init_ext_features();
         }
       }
       break;
 
+    case HCI_SIMPLE_PAIRING_STATE:
+      if (hci_command_done(0x0C56)) { // Write_Simple_Pairing_Mode
+        if (hci_cmd_status) // Legacy pairing with btdPin
+          hci_local_unsupported(hci_features, HCI_FEATURE_SIMPLE_PAIRING);
+        hci_init_ext_features();
+      }
+      break;
+
     case HCI_SET_NAME_STATE:
       if (hci_check_flag(HCI_FLAG_CMD_COMPLETE)) {
 #ifdef DEBUG_USB_HOST
         printf("The name is set to: %s\n", btdName);
 #endif
-        hci_state = HCI_CHECK_DEVICE_SERVICE;
+        hci_set_state(HCI_CHECK_DEVICE_SERVICE);
       }
       break;
 
     case HCI_CHECK_DEVICE_SERVICE:
+      hci_recovering = false;
+
+      if (bt_reconnect_pending()) { // The controller was reset under a bonded device, page it with page scan on
+        hci_set_state(HCI_SCANNING_STATE);
+        break;
+      }
+
+      if (btdProvisioning && provision_candidate_next(disc_bdaddr, classOfDevice)) { // Found during the last unit
+        hci_inquiry_cancel(); // The inquiry that found it may still be running, and would slow down the page
+        hci_set_state(HCI_CONNECT_DEVICE_STATE);
+        bt_timer_arm(&hci_state_timer, HCI_COMMAND_TIMEOUT);
+        break;
+      }
 #ifdef DEBUG_USB_HOST
       printf("Please enable discovery of your device\n");
 #endif
+      if (hci_discovering) { // A background slice would make the controller refuse the inquiry
+        hci_inquiry_cancel();
+        hci_discovering = false;
+      }
       hci_inquiry();
-      hci_state = HCI_INQUIRY_STATE;
+      hci_set_state(HCI_INQUIRY_STATE);
+      if (!btdProvisioning)
+        bt_timer_arm(&hci_state_timer, HCI_INQUIRY_TIMEOUT);
       break;
 
     case HCI_INQUIRY_STATE:
-      if (hci_check_flag(HCI_FLAG_DEVICE_FOUND)) {
+      if (hci_check_flag(HCI_FLAG_DEVICE_FOUND) || (btdProvisioning && provision_candidate_next(disc_bdaddr, classOfDevice))) {
         hci_inquiry_cancel(); // Stop inquiry
 
 #ifdef DEBUG_USB_HOST
         printf("HID device found\n");
 #endif
-        hci_state = HCI_CONNECT_DEVICE_STATE;
+        hci_set_state(HCI_CONNECT_DEVICE_STATE);
+        bt_timer_arm(&hci_state_timer, HCI_COMMAND_TIMEOUT);
+      } else if (hci_check_timeout(HCI_TIMEOUT_STATE)) {
+        hci_inquiry_cancel();
+#ifdef DEBUG_USB_HOST
+        printf("Couldn't find HID device\n");
+#endif
+        hci_set_state(HCI_SCANNING_STATE);
       }
       break;
 
-    case HCI_CONNECT_DEVICE_STATE:
-      if (hci_check_flag(HCI_FLAG_CMD_COMPLETE)) {
+    case HCI_CONNECT_DEVICE_STATE: // Pages only once the inquiry is cancelled, the controller does not do both well
+      // Inquiry_Cancel is answered with an error if the inquiry had ended already, which is fine as well
+      if ((hci_check_flag(HCI_FLAG_CMD_ANSWERED) && hci_cmd_opcode == 0x0402) || hci_check_timeout(HCI_TIMEOUT_STATE)) {
 #ifdef DEBUG_USB_HOST
         printf("Connecting to HID device\n");
 #endif
 
+        if (btdProvisioning) {
+          provision_stage(PROVISION_STAGE_CONNECT);
+          bt_timer_arm(&provision_timer, PROVISION_UNIT_TIMEOUT);
+        }
         hci_connect(disc_bdaddr);
-        hci_state = HCI_CONNECTED_DEVICE_STATE;
+        hci_set_state(HCI_CONNECTED_DEVICE_STATE);
+        bt_timer_arm(&hci_state_timer, HCI_CONNECT_TIMEOUT);
       }
       break;
 
@@ -1191,13 +3242,33 @@ static void HCI_Task() {
 #endif
 
           hci_authentication_request(); // This will start the pairing with the Wiimote
+          profile_state(PROFILE_MACHINE_AUTH, PROFILE_AUTH_PENDING);
           //l2cap_connection_request();
-          hci_state = HCI_SCANNING_STATE;
+          if (btdProvisioning) {
+            provision_stage(PROVISION_STAGE_PAIR);
+            hci_set_state(HCI_PROVISION_STATE);
+          } else {
+            hci_set_state(HCI_SCANNING_STATE);
+          }
         } else {
 #ifdef DEBUG_USB_HOST
           printf("Trying to connect one more time...\n");
 #endif
           hci_connect(disc_bdaddr); // Try to connect one more time
+          bt_timer_arm(&hci_state_timer, HCI_CONNECT_TIMEOUT);
+        }
+      } else if (hci_check_timeout(HCI_TIMEOUT_STATE)) {
+        if (!hci_connect_cancelling) { // Its failed Connection Complete moves on to the next device
+#ifdef DEBUG_USB_HOST
+          printf("Connection timed out\n");
+#endif
+          hci_create_connection_cancel(disc_bdaddr);
+          hci_connect_cancelling = true;
+          bt_timer_arm(&hci_state_timer, HCI_COMMAND_TIMEOUT);
+        } else { // The controller never completed the page
+          if (btdProvisioning)
+            provision_unit_done(disc_bdaddr, false);
+          hci_set_state(HCI_CHECK_DEVICE_SERVICE);
         }
       }
       break;
@@ -1207,22 +3278,72 @@ static void HCI_Task() {
 #ifdef DEBUG_USB_HOST
         printf("Wait For Incoming Connection Request\n");
 #endif
+        hci_scan_policy();
         hci_write_scan_enable();
         waitingForConnection = true;
-        hci_state = HCI_CONNECT_IN_STATE;
+        hci_set_state(HCI_CONNECT_IN_STATE);
       }
       break;
 
-    case HCI_CONNECT_IN_STATE:
+    case HCI_CONNECT_IN_STATE: {
+      bt_reconnect_t *reconnect;
+
       if (hci_check_flag(HCI_FLAG_INCOMING_REQUEST)) {
         waitingForConnection = false;
 #ifdef DEBUG_USB_HOST
         printf("Incoming Connection Request\n");
 #endif
         hci_remote_name();
-        hci_state = HCI_REMOTE_NAME_STATE;
-      } else if (hci_check_flag(HCI_FLAG_DISCONNECT_COMPLETE))
-        hci_state = HCI_DISCONNECT_STATE;
+        hci_set_state(HCI_REMOTE_NAME_STATE);
+      } else if (hci_check_flag(HCI_FLAG_DISCONNECT_COMPLETE)) {
+        hci_set_state(HCI_DISCONNECT_STATE);
+      } else if ((reconnect = bt_reconnect_due(millis())) != NULL) {
+        if (hci_discovering) { // Paging comes first
+          hci_inquiry_cancel();
+          hci_discovering = false;
+        }
+        memcpy(hci_reconnect_bdaddr, reconnect->bdaddr, 6);
+        memcpy(disc_bdaddr, reconnect->bdaddr, 6);
+        memcpy(classOfDevice, reconnect->class_of_device, 3);
+#ifdef DEBUG_USB_HOST
+        printf("Reconnecting to bonded device, attempt %d\n", reconnect->attempts + 1);
+#endif
+        hci_reconnect_paging = true;
+        hci_clear_flag(HCI_FLAG_CONNECT_EVENT);
+        hci_clear_flag(HCI_FLAG_CONNECT_COMPLETE); // May still be set by another link
+        hci_connect(disc_bdaddr);
+        hci_set_state(HCI_RECONNECT_STATE);
+        bt_timer_arm(&hci_state_timer, HCI_RECONNECT_PAGE_TIMEOUT);
+      } else if (!hci_discovering && (connected || !activeConnection) && bt_discovery_next(disc_bdaddr, classOfDevice)) {
+#ifdef DEBUG_USB_HOST
+        printf("Connecting to HID device found in the background\n"); // Not while the HID channels of another device are being set up
+#endif
+        hci_connect(disc_bdaddr);
+        hci_set_state(HCI_CONNECTED_DEVICE_STATE);
+        bt_timer_arm(&hci_state_timer, HCI_CONNECT_TIMEOUT);
+      } else if (btdBackgroundDiscovery && !btdProvisioning && !hci_discovering && connected && bt_link_count() < BT_MAX_LINKS && bt_discovery_due(millis())) {
+        hci_discovery_slice();
+      }
+      break;
+    }
+
+    case HCI_RECONNECT_STATE: // Page scan stays enabled, so the device may just as well connect to us
+      if (hci_check_flag(HCI_FLAG_CONNECT_COMPLETE)) {
+        if (!readyToSend)
+          break;
+
+        waitingForConnection = false;
+        hci_authentication_request(); // Encrypts the link with the stored key
+        profile_state(PROFILE_MACHINE_AUTH, PROFILE_AUTH_PENDING);
+        hci_set_state(HCI_SCANNING_STATE);
+      } else if (hci_check_flag(HCI_FLAG_INCOMING_REQUEST)) {
+        hci_create_connection_cancel(hci_reconnect_bdaddr); // The failed page is counted when it completes
+        waitingForConnection = false;
+        hci_remote_name();
+        hci_set_state(HCI_REMOTE_NAME_STATE);
+      } else if (hci_check_timeout(HCI_TIMEOUT_STATE)) {
+        hci_create_connection_cancel(hci_reconnect_bdaddr); // Gives page scan its turn
+      }
       break;
 
     case HCI_REMOTE_NAME_STATE:
@@ -1231,7 +3352,7 @@ static void HCI_Task() {
         printf("Remote Name: %s\n", remote_name);
 #endif
         hci_accept_connection();
-        hci_state = HCI_CONNECTED_STATE;
+        hci_set_state(HCI_CONNECTED_STATE);
       }
       break;
 
@@ -1251,19 +3372,39 @@ static void HCI_Task() {
         l2capConnectionClaimed = false;
 
         hci_event_flag = 0;
-        hci_state = HCI_DONE_STATE;
+        hci_set_state(HCI_DONE_STATE);
+        bt_timer_arm(&hci_state_timer, HCI_DONE_DELAY);
       }
       break;
 
-    case HCI_DONE_STATE:
-      hci_counter++;
+    case HCI_PROVISION_STATE:
+      if (hci_check_flag(HCI_FLAG_DISCONNECT_COMPLETE)) {
+        bt_timer_cancel(&provision_timer);
+        provision_unit_done(disc_bdaddr, provision_current_stage() == PROVISION_STAGE_DISCONNECT);
+        provision_print();
 
-      if (hci_counter > 1000) { // Wait until we have looped 1000 times to make sure that the L2CAP connection has been started
-        hci_counter = 0;
-        hci_state = HCI_SCANNING_STATE;
+        // Ready the channels for the next unit
+        l2cap_reset();
+        l2capConnectionClaimed = false;
+        connectToHIDDevice = false;
+        hci_clear_flag(HCI_FLAG_CONNECT_EVENT | HCI_FLAG_CONNECT_COMPLETE | HCI_FLAG_DISCONNECT_COMPLETE | HCI_FLAG_DEVICE_FOUND);
+        hci_set_state(HCI_CHECK_DEVICE_SERVICE); // Connects right away if inquiry already found the next unit
+      } else if (provision_current_stage() == PROVISION_STAGE_VERIFY && provision_verified() && sdp_state == SDP_IDLE) {
+        provision_stage(PROVISION_STAGE_DISCONNECT);
+        hid_disconnect();
+      } else if (hci_check_timeout(HCI_TIMEOUT_PROVISION) && provision_current_stage() != PROVISION_STAGE_DISCONNECT) {
+#ifdef DEBUG_USB_HOST
+        printf("Provisioning timed out in stage %d\n", provision_current_stage());
+#endif
+        hci_disconnect(hci_handle);
       }
       break;
 
+    case HCI_DONE_STATE:
+      if (hci_check_timeout(HCI_TIMEOUT_STATE)) // Make sure that the L2CAP connection has been started
+        hci_set_state(HCI_SCANNING_STATE);
+      break;
+
     case HCI_DISCONNECT_STATE:
       if (hci_check_flag(HCI_FLAG_DISCONNECT_COMPLETE)) {
 #ifdef DEBUG_USB_HOST
@@ -1275,7 +3416,16 @@ static void HCI_Task() {
         memset(hcibuf, 0, BULK_MAXPKTSIZE);
         memset(l2capinbuf, 0, BULK_MAXPKTSIZE);
 
-        hci_state = HCI_SCANNING_STATE;
+        if (btdProvisioning) { // Pairing failed
+          bt_timer_cancel(&provision_timer);
+          provision_unit_done(disc_bdaddr, false);
+          l2cap_reset();
+          l2capConnectionClaimed = false;
+          connectToHIDDevice = false;
+          hci_set_state(HCI_CHECK_DEVICE_SERVICE);
+        } else {
+          hci_set_state(HCI_SCANNING_STATE);
+        }
       }
       break;
 
@@ -1294,14 +3444,38 @@ void app_main() {
         return;
     }
 
-    // Setup dual mode
-    if (esp_bt_controller_enable(ESP_BT_MODE_BTDM) != ESP_OK) {
+    if (esp_bt_controller_enable(btdControllerMode) != ESP_OK) {
         printf("Bluetooth controller enable failed\n");
         return;
     }
 
-    hci_state = HCI_INIT_STATE;
-    hci_num_reset_loops = 100;
+#ifdef HID_BENCHMARK
+    hid_plan_benchmark();
+#endif
+#ifdef SDP_SELFTEST
+    printf("SDP self test %s\n", sdp_selftest() ? "passed" : "failed");
+#endif
+#ifdef HID_DRIVER_SELFTEST
+    printf("HID driver self test %s\n", hid_driver_selftest() ? "passed" : "failed");
+#endif
 
-    xTaskCreatePinnedToCore(&mainTask, "mainTask", 2048, NULL, 5, NULL, 0);
+    bt_timer_init(&hci_state_timer, hci_timeout, (void *)HCI_TIMEOUT_STATE);
+    bt_timer_init(&l2cap_rtx_timer, hci_timeout, (void *)HCI_TIMEOUT_L2CAP_RTX);
+    bt_timer_init(&sdp_timer, hci_timeout, (void *)HCI_TIMEOUT_SDP);
+    bt_timer_init(&hci_discovery_timer, hci_timeout, (void *)HCI_TIMEOUT_DISCOVERY);
+    bt_timer_init(&provision_timer, hci_timeout, (void *)HCI_TIMEOUT_PROVISION);
+    bt_timer_init(&hci_watchdog_timer, hci_timeout, (void *)HCI_TIMEOUT_WATCHDOG);
+    bt_timer_init(&hci_reconnect_timer, hci_timeout, (void *)HCI_TIMEOUT_RECONNECT);
+    bt_timer_init(&hci_pairing_timer, hci_timeout, (void *)HCI_TIMEOUT_PAIRING);
+    bt_timer_start();
+    bt_timer_arm(&hci_watchdog_timer, HCI_WATCHDOG_PERIOD);
+
+    hci_set_state(HCI_INIT_STATE);
+    hci_reset_timeout = HCI_RESET_TIMEOUT;
+    bt_timer_arm(&hci_state_timer, hci_reset_timeout);
+    if (btdProvisioning)
+      provision_start();
+
+    if (!hid_pipeline_start(&btdTasks, &mainTask))
+        printf("Bluetooth task could not be created\n");
 }
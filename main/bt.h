@@ -1,6 +1,6 @@
 #define BULK_MAXPKTSIZE 64
 
-#define UINT32_TO_STREAM(p, u32) {*(p)++ = (UINT8)(u32); *(p)++ = (UINT8)((u32) >> 8); *(p)++ = (UINT8)((u32) >> 16); *(p)++ = (UINT8)((u32) >> 24);}
+#define UINT32_TO_STREAM(p, u32) {*(p)++ = (uint8_t)(u32); *(p)++ = (uint8_t)((u32) >> 8); *(p)++ = (uint8_t)((u32) >> 16); *(p)++ = (uint8_t)((u32) >> 24);}
 #define UINT24_TO_STREAM(p, u24) {*(p)++ = (UINT8)(u24); *(p)++ = (UINT8)((u24) >> 8); *(p)++ = (UINT8)((u24) >> 16);}
 #define UINT16_TO_STREAM(p, u16) {*(p)++ = (uint8_t)(u16); *(p)++ = (uint8_t)((u16) >> 8);}
 #define UINT8_TO_STREAM(p, u8)   {*(p)++ = (uint8_t)(u8);}
@@ -14,12 +14,58 @@
 #define ARRAY_TO_STREAM(p, a, len) {register int ijk; for (ijk = 0; ijk < len;        ijk++) *(p)++ = (UINT8) a[ijk];}
 #define REVERSE_ARRAY_TO_STREAM(p, a, len)  {register int ijk; for (ijk = 0; ijk < len; ijk++) *(p)++ = (UINT8) a[len - 1 - ijk];}
 
-#define PACKET_TYPES ( HCI_PKT_TYPES_MASK_DM1 | HCI_PKT_TYPES_MASK_DH1 \
-                     | HCI_PKT_TYPES_MASK_DM3 | HCI_PKT_TYPES_MASK_DH3 \
-                     | HCI_PKT_TYPES_MASK_DM5 | HCI_PKT_TYPES_MASK_DH5 )
+/* ACL packet types of Create_Connection and Change_Connection_Packet_Type. The EDR bits are inverted: a set
+   bit means the packet type may not be used. */
+#define HCI_PACKET_NO_2_DH1             0x0002
+#define HCI_PACKET_NO_3_DH1             0x0004
+#define HCI_PACKET_DM1                  0x0008
+#define HCI_PACKET_DH1                  0x0010
+#define HCI_PACKET_NO_2_DH3             0x0100
+#define HCI_PACKET_NO_3_DH3             0x0200
+#define HCI_PACKET_DM3                  0x0400
+#define HCI_PACKET_DH3                  0x0800
+#define HCI_PACKET_NO_2_DH5             0x1000
+#define HCI_PACKET_NO_3_DH5             0x2000
+#define HCI_PACKET_DM5                  0x4000
+#define HCI_PACKET_DH5                  0x8000
+#define HCI_PACKET_NO_EDR               (HCI_PACKET_NO_2_DH1 | HCI_PACKET_NO_3_DH1 | HCI_PACKET_NO_2_DH3 | \
+                                         HCI_PACKET_NO_3_DH3 | HCI_PACKET_NO_2_DH5 | HCI_PACKET_NO_3_DH5)
+
+#define PACKET_TYPES ( HCI_PACKET_DM1 | HCI_PACKET_DH1 \
+                     | HCI_PACKET_DM3 | HCI_PACKET_DH3 \
+                     | HCI_PACKET_DM5 | HCI_PACKET_DH5 )
+
+/* LMP feature bits, numbered as in the feature mask: byte * 8 + bit */
+#define HCI_FEATURE_3_SLOT              0
+#define HCI_FEATURE_5_SLOT              1
+#define HCI_FEATURE_ROLE_SWITCH         5
+#define HCI_FEATURE_EDR_2M              25
+#define HCI_FEATURE_EDR_3M              26
+#define HCI_FEATURE_INTERLACED_INQUIRY_SCAN 28
+#define HCI_FEATURE_INTERLACED_PAGE_SCAN 29
+#define HCI_FEATURE_RSSI_INQUIRY        30
+#define HCI_FEATURE_3_SLOT_EDR          39
+#define HCI_FEATURE_5_SLOT_EDR          40
+#define HCI_FEATURE_SNIFF_SUBRATING     41
+#define HCI_FEATURE_SIMPLE_PAIRING      51
+#define HCI_FEATURE_NON_FLUSHABLE_PB    54 // Without it every packet on a link with a flush timeout could be flushed
+#define HCI_FEATURE_EXTENDED            63
+#define HCI_FEATURE_HOST_SIMPLE_PAIRING 0  // Extended features page 1
+#define HCI_FEATURE(features, bit)      (((features)[(bit) / 8] >> ((bit) % 8)) & 0x01)
+
+/* Supported commands bits, numbered as octet * 8 + bit */
+#define HCI_COMMAND_CHANGE_PACKET_TYPE  14
+#define HCI_COMMAND_WRITE_INQUIRY_SCAN_TYPE 101
+#define HCI_COMMAND_WRITE_INQUIRY_MODE  103
+#define HCI_COMMAND_WRITE_PAGE_SCAN_TYPE 105
+#define HCI_COMMAND_READ_LOCAL_EXT_FEATURES 118
+#define HCI_COMMAND_SNIFF_SUBRATING     140
+#define HCI_COMMAND_WRITE_SIMPLE_PAIRING_MODE 142
+#define HCI_COMMAND(commands, bit)      HCI_FEATURE(commands, bit)
 
 #define HCI_PARAM_SIZE_L2CAP_CONNECTION_REQUEST_CONTROL (12)
 
+#define HCI_ACL_PB_FIRST_NON_FLUSHABLE (0 << 12)
 #define HCI_ACL_PB_HLM_CONTINUE (1 << 12)
 #define HCI_ACL_PB_HLM_FIRST    (2 << 12)
 
@@ -55,6 +101,49 @@
 #define HCI_DISABLE_SCAN_STATE          14
 #define HCI_DONE_STATE                  15
 #define HCI_DISCONNECT_STATE            16
+#define HCI_BUFFER_SIZE_STATE           17
+#define HCI_EVENT_MASK_STATE            18
+#define HCI_SIMPLE_PAIRING_STATE        19 // Only used if the controller supports Secure Simple Pairing
+#define HCI_PROVISION_STATE             20 // Current unit is being set up and verified while inquiry looks for the next
+#define HCI_RECONNECT_STATE             21 // Paging a bonded device that lost its link
+#define HCI_LOCAL_FEATURES_STATE        22
+#define HCI_LOCAL_COMMANDS_STATE        23
+#define HCI_LOCAL_EXT_FEATURES_STATE    24
+#define HCI_INQUIRY_MODE_STATE          25 // Only used if the controller reports RSSI with inquiry results
+
+/* Timeouts in milliseconds, run on the timer wheel */
+#define HCI_RESET_TIMEOUT               1000  // Doubled every time the controller does not answer the reset
+#define HCI_RESET_TIMEOUT_MAX           30000
+#define HCI_INQUIRY_TIMEOUT             30000 // Inquiry is restarted until then, then it falls back to page scan
+#define HCI_CONNECT_TIMEOUT             10000 // Longer than the default page timeout of the controller
+#define HCI_COMMAND_TIMEOUT             2000  // Answer to a command the init sequence waits for
+#define HCI_DONE_DELAY                  2000  // Time given to the L2CAP connection to start before scanning again
+#define L2CAP_RTX_TIMEOUT               5000  // Response time for every signaling request while setting up
+#define SDP_RESPONSE_TIMEOUT            5000  // Per step of the SDP client, the query is given up after that
+#define HCI_PAIRING_TIMEOUT             30000 // Time the user has to answer btdConfirm or btdPasskeyEntry
+
+/* Controller watchdog. A stall is noticed within the stall timeout plus one period. Recovery then resets
+   the controller every HCI_RESET_TIMEOUT and restarts it after HCI_RECOVERY_MAX_RESETS unanswered resets,
+   so input is back within a few seconds. */
+#define HCI_WATCHDOG_PERIOD             500
+#define HCI_COMMAND_STALL_TIMEOUT       2000 // Oldest command without Command Complete or Command Status
+#define HCI_ACL_STALL_TIMEOUT           5000 // ACL packets in the controller without Number Of Completed Packets
+#define HCI_RECOVERY_MAX_RESETS         3
+
+/* A reconnect page is cancelled after this long so page scan gets its turn. Backoff between pages is set
+   with bt_reconnect_policy_set. */
+#define HCI_RECONNECT_PAGE_TIMEOUT      2560
+
+/* Bits in hci_timeout_flag, set by the timer wheel and handled by the Bluetooth task */
+#define HCI_TIMEOUT_STATE               (1UL << 0) // The current HCI state timed out
+#define HCI_TIMEOUT_L2CAP_RTX           (1UL << 1)
+#define HCI_TIMEOUT_IDLE                (1UL << 2) // The idle timer of a link expired
+#define HCI_TIMEOUT_PROVISION           (1UL << 3)
+#define HCI_TIMEOUT_WATCHDOG            (1UL << 4)
+#define HCI_TIMEOUT_RECONNECT           (1UL << 5) // The page of a bonded device is due
+#define HCI_TIMEOUT_SDP                 (1UL << 6)
+#define HCI_TIMEOUT_DISCOVERY           (1UL << 7) // Time to look at the report gaps during a discovery slice
+#define HCI_TIMEOUT_PAIRING             (1UL << 8) // The user answered the pairing request, or took too long
 
 /* HCI event flags*/
 #define HCI_FLAG_CMD_COMPLETE           (1UL << 0)
@@ -66,6 +155,17 @@
 #define HCI_FLAG_READ_VERSION           (1UL << 6)
 #define HCI_FLAG_DEVICE_FOUND           (1UL << 7)
 #define HCI_FLAG_CONNECT_EVENT          (1UL << 8)
+#define HCI_FLAG_READ_BUFFER_SIZE       (1UL << 9)
+#define HCI_FLAG_READ_FEATURES          (1UL << 10)
+#define HCI_FLAG_READ_COMMANDS          (1UL << 11)
+#define HCI_FLAG_CMD_ANSWERED           (1UL << 12) // Command Complete for hci_cmd_opcode, whatever its status
+
+/* Outgoing HCI packet queue. Commands are released as the controller hands out command credits
+   (Num_HCI_Command_Packets) and ACL packets as it reports completed packets, so nothing has to sleep
+   between packets. */
+#define HCI_TX_QUEUE_LEN                16 // Room for the scan setup burst next to output reports
+#define HCI_TX_MAX_PKTSIZE              128
+#define HCI_ACL_DEFAULT_CREDITS         4 // Used until Read_Buffer_Size has completed
 
 /* HCI Events managed */
 #define EV_INQUIRY_COMPLETE                             0x01
@@ -78,6 +178,7 @@
 #define EV_ENCRYPTION_CHANGE                            0x08
 #define EV_CHANGE_CONNECTION_LINK                       0x09
 #define EV_ROLE_CHANGED                                 0x12
+#define EV_MODE_CHANGE                                  0x14
 #define EV_NUM_COMPLETE_PKT                             0x13
 #define EV_PIN_CODE_REQUEST                             0x16
 #define EV_LINK_KEY_REQUEST                             0x17
@@ -90,6 +191,37 @@
 #define EV_COMMAND_STATUS                               0x0F
 #define EV_LOOPBACK_COMMAND                             0x19
 #define EV_PAGE_SCAN_REP_MODE                           0x20
+#define EV_FLOW_SPEC_COMPLETE                           0x21
+#define EV_SNIFF_SUBRATING                              0x2E
+#define EV_READ_REMOTE_FEATURES_COMPLETE                0x0B
+#define EV_PACKET_TYPE_CHANGED                          0x1D
+#define EV_INQUIRY_RESULT_RSSI                          0x22
+#define EV_IO_CAPABILITY_REQUEST                        0x31
+#define EV_IO_CAPABILITY_RESPONSE                       0x32
+#define EV_USER_CONFIRMATION_REQUEST                    0x33
+#define EV_USER_PASSKEY_REQUEST                         0x34
+#define EV_SIMPLE_PAIRING_COMPLETE                      0x36
+#define EV_USER_PASSKEY_NOTIFICATION                    0x3B
+
+/* Events enabled by Set_Event_Mask: the default mask plus Sniff Subrating and the Secure Simple Pairing
+   events above, which the controller does not report unless asked to. Written on every controller during
+   init, whether it supports Secure Simple Pairing or not. */
+#define HCI_EVENT_MASK                  0x042F3FFFFFFFFFFFULL
+
+/* IO capabilities used for Secure Simple Pairing. They decide between Just Works, numeric comparison and
+   passkey entry together with the capabilities of the device. */
+#define HCI_IO_CAP_DISPLAY_ONLY         0x00
+#define HCI_IO_CAP_DISPLAY_YES_NO       0x01
+#define HCI_IO_CAP_KEYBOARD_ONLY        0x02
+#define HCI_IO_CAP_NO_INPUT_NO_OUTPUT   0x03 // Just Works
+
+#define HCI_AUTH_GENERAL_BONDING        0x04
+#define HCI_AUTH_MITM                   0x01 // Added to the authentication requirements if the IO capabilities allow it
+
+/* Link policy settings */
+#define HCI_LINK_POLICY_ROLE_SWITCH     0x0001
+#define HCI_LINK_POLICY_HOLD_MODE       0x0002
+#define HCI_LINK_POLICY_SNIFF_MODE      0x0004
 
 /* Bluetooth states for the different Bluetooth drivers */
 #define L2CAP_WAIT                      0
@@ -117,6 +249,13 @@
 
 #define L2CAP_DISCONNECT_RESPONSE       14 // Used for both SDP and RFCOMM channel
 
+/* SDP client, runs next to the HID channels once they are up */
+#define SDP_IDLE                        0
+#define SDP_CONNECT_REQUEST             1
+#define SDP_CONFIG_REQUEST              2
+#define SDP_QUERY                       3
+#define SDP_DISCONNECT                  4
+
 /* Bluetooth states used by some drivers */
 #define TURN_ON_LED                     17
 #define PS3_ENABLE_SIXAXIS              18
@@ -148,6 +287,10 @@
 
 #define L2CAP_FLAG_DISCONNECT_RESPONSE                  (1UL << 14)
 
+/* L2CAP event flags for the SDP client channel */
+#define L2CAP_FLAG_SDP_CONNECTED                        (1UL << 15)
+#define L2CAP_FLAG_SDP_CONFIG_REQUEST                   (1UL << 16)
+
 /* Macros for L2CAP event flag tests */
 #define l2cap_check_flag(flag) (l2cap_event_flag & (flag))
 #define l2cap_set_flag(flag) (l2cap_event_flag |= (flag))
@@ -164,6 +307,16 @@
 #define L2CAP_CMD_INFORMATION_REQUEST   0x0A
 #define L2CAP_CMD_INFORMATION_RESPONSE  0x0B
 
+/* Signaling commands generated while handling one packet are combined into a single C-frame.
+   Undefine to send one C-frame per command. */
+#define L2CAP_COMBINE_SIGNALING
+#define L2CAP_SIG_MTU                   48 // Minimum signaling MTU every device must accept
+#define L2CAP_CFG_OPTIONS_MAX           (L2CAP_SIG_MTU - 10) // Options that fit in a configuration request or response
+
+/* Receive MTU offered on the HID channels. Interrupt reports are small, so its buffer is kept small too. */
+#define L2CAP_HID_CONTROL_MTU           672
+#define L2CAP_HID_INTERRUPT_MTU         128
+
 // Used For Connection Response - Remember to Include High Byte
 #define PENDING     0x01
 #define SUCCESSFUL  0x00
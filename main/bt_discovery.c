@@ -0,0 +1,89 @@
+#include <string.h>
+#include "bt_discovery.h"
+
+typedef struct {
+  bool in_use;
+  uint8_t bdaddr[6];
+  uint8_t class_of_device[3];
+} bt_discovered_t;
+
+static bt_discovered_t found[BT_DISCOVERY_MAX_FOUND];
+static uint32_t interval;
+static uint32_t due;
+
+/* A 1.28 s slice every few seconds finds a device in discoverable mode well within its usual two minute
+   window. Gamepads report every few ms, so a gap of 30 ms is already felt as a stutter. */
+static bt_discovery_policy_t discovery_policy = { 1, 4, 5000, 60000, 30, 250 };
+
+void bt_discovery_start(uint32_t now) {
+  interval = discovery_policy.min_interval;
+  due = now + interval;
+}
+
+bool bt_discovery_due(uint32_t now) {
+  return (int32_t)(now - due) >= 0;
+}
+
+void bt_discovery_slice_done(uint32_t worst_gap, uint32_t now) {
+  if (worst_gap > discovery_policy.gap_threshold) {
+    interval *= 2;
+    if (interval > discovery_policy.max_interval)
+      interval = discovery_policy.max_interval;
+  } else {
+    interval /= 2;
+    if (interval < discovery_policy.min_interval)
+      interval = discovery_policy.min_interval;
+  }
+
+  due = now + interval;
+}
+
+uint32_t bt_discovery_interval() {
+  return interval;
+}
+
+void bt_discovery_found(const uint8_t *bdaddr, const uint8_t *class_of_device) {
+  bt_discovered_t *device = NULL;
+
+  for (uint8_t i = 0; i < BT_DISCOVERY_MAX_FOUND; i++) {
+    if (found[i].in_use && memcmp(found[i].bdaddr, bdaddr, 6) == 0)
+      return;
+    if (!found[i].in_use && device == NULL)
+      device = &found[i];
+  }
+
+  if (device == NULL)
+    return;
+
+  device->in_use = true;
+  memcpy(device->bdaddr, bdaddr, 6);
+  memcpy(device->class_of_device, class_of_device, 3);
+}
+
+bool bt_discovery_next(uint8_t *bdaddr, uint8_t *class_of_device) {
+  for (uint8_t i = 0; i < BT_DISCOVERY_MAX_FOUND; i++) {
+    if (found[i].in_use) {
+      found[i].in_use = false;
+      memcpy(bdaddr, found[i].bdaddr, 6);
+      memcpy(class_of_device, found[i].class_of_device, 3);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void bt_discovery_forget(const uint8_t *bdaddr) {
+  for (uint8_t i = 0; i < BT_DISCOVERY_MAX_FOUND; i++) {
+    if (found[i].in_use && memcmp(found[i].bdaddr, bdaddr, 6) == 0)
+      found[i].in_use = false;
+  }
+}
+
+const bt_discovery_policy_t *bt_discovery_policy() {
+  return &discovery_policy;
+}
+
+void bt_discovery_policy_set(const bt_discovery_policy_t *policy) {
+  discovery_policy = *policy;
+}
@@ -0,0 +1,38 @@
+#ifndef BT_DISCOVERY_H
+#define BT_DISCOVERY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BT_DISCOVERY_MAX_FOUND          4
+
+/* Background inquiry while HID links are up. It runs in short slices, and the time between slices doubles
+   whenever a slice stretched the gap between reports on an active link past gap_threshold, and halves
+   again when it did not. */
+typedef struct {
+  uint8_t slice;           // Inquiry_Length, 1.28 s units
+  uint8_t max_responses;
+  uint32_t min_interval;   // Milliseconds between slices
+  uint32_t max_interval;
+  uint32_t gap_threshold;  // Milliseconds, a running slice is cancelled once a gap grows past it
+  uint32_t idle_gap;       // Milliseconds, a link without reports for longer is idle and not watched by a slice
+} bt_discovery_policy_t;
+
+/* Restarts the backoff, the first slice is due after min_interval */
+void bt_discovery_start(uint32_t now);
+bool bt_discovery_due(uint32_t now);
+
+/* worst_gap is the longest report gap during the slice on a link that was streaming when it started,
+   including a gap still open when it ended */
+void bt_discovery_slice_done(uint32_t worst_gap, uint32_t now);
+uint32_t bt_discovery_interval();
+
+/* HID devices found by the slices, waiting to be connected */
+void bt_discovery_found(const uint8_t *bdaddr, const uint8_t *class_of_device);
+bool bt_discovery_next(uint8_t *bdaddr, uint8_t *class_of_device);
+void bt_discovery_forget(const uint8_t *bdaddr);
+
+const bt_discovery_policy_t *bt_discovery_policy();
+void bt_discovery_policy_set(const bt_discovery_policy_t *policy);
+
+#endif
@@ -0,0 +1,205 @@
+#include <string.h>
+#include "bt.h"
+#include "bt_link.h"
+
+bt_link_t bt_links[BT_MAX_LINKS];
+
+/* Keystrokes must never be lost, so keyboards keep the default of retransmitting until delivered.
+   For pointer and gamepad output a late packet is useless, so it is dropped after a few polls.
+   Gamepads and mice are polled every 2 and 4 slots, keyboards are fine with the controller default. */
+static bt_latency_policy_t latency_policies[BT_DEVICE_CLASS_COUNT] = {
+  { 0, false, 0 },     // BT_DEVICE_CLASS_OTHER
+  { 0, false, 0 },     // BT_DEVICE_CLASS_KEYBOARD
+  { 20, true, 2500 },  // BT_DEVICE_CLASS_MOUSE
+  { 16, true, 1250 },  // BT_DEVICE_CLASS_GAMEPAD
+};
+
+/* Idle keyboards and mice go into sniff after a few seconds and subrate after a while longer, which leaves
+   more air time for the active links. Gamepads report continuously while in use, so they only sniff when
+   left alone for a long time and never subrate. */
+static bt_sniff_policy_t sniff_policies[BT_DEVICE_CLASS_COUNT] = {
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0 },                               // BT_DEVICE_CLASS_OTHER
+  { 5000, 0x0024, 0x0012, 4, 1, 30000, 0x0190, 0, 0 },         // BT_DEVICE_CLASS_KEYBOARD
+  { 2000, 0x0024, 0x0012, 4, 1, 10000, 0x00C8, 0, 0 },         // BT_DEVICE_CLASS_MOUSE
+  { 10000, 0x0012, 0x000C, 2, 1, 0, 0, 0, 0 },                 // BT_DEVICE_CLASS_GAMEPAD
+};
+
+/* The controller default is a 11.25 ms window every 1.28 s, so a reconnecting device waits 1.28 s on
+   average and up to 2.56 s when it pages on the other train. While nothing is connected, or right after a
+   link came or went, an interlaced scan every 160 ms gets it back within a few hundred ms. */
+static bt_scan_policy_t scan_policies[BT_SCAN_COUNT] = {
+  { 0x0100, 0x0012, true, 0x0800, 0x0012, true },    // BT_SCAN_FAST
+  { 0x0800, 0x0012, true, 0x0800, 0x0012, false },   // BT_SCAN_NORMAL
+  { 0x1000, 0x0012, false, 0x1000, 0x0012, false },  // BT_SCAN_SLOW
+};
+
+bt_link_t *bt_link_add(uint16_t handle, const uint8_t *bdaddr, const uint8_t *class_of_device) {
+  bt_link_t *link = bt_link_find(handle);
+
+  for (uint8_t i = 0; link == NULL && i < BT_MAX_LINKS; i++) {
+    if (!bt_links[i].in_use)
+      link = &bt_links[i];
+  }
+
+  if (link == NULL)
+    return NULL;
+
+  bt_timer_cancel(&link->idle_timer); // Still armed if the handle is reused
+  memset(link, 0, sizeof(*link));
+  link->in_use = true;
+  link->handle = handle;
+  memcpy(link->bdaddr, bdaddr, sizeof(link->bdaddr));
+  memcpy(link->class_of_device, class_of_device, sizeof(link->class_of_device));
+  link->device_class = bt_device_class(class_of_device);
+  link->latency = bt_latency_policy(link->device_class);
+  link->sniff = bt_sniff_policy(link->device_class);
+  link->mode = BT_MODE_ACTIVE;
+
+  return link;
+}
+
+bt_link_t *bt_link_find(uint16_t handle) {
+  for (uint8_t i = 0; i < BT_MAX_LINKS; i++) {
+    if (bt_links[i].in_use && bt_links[i].handle == handle)
+      return &bt_links[i];
+  }
+
+  return NULL;
+}
+
+bt_link_t *bt_link_find_bdaddr(const uint8_t *bdaddr) {
+  for (uint8_t i = 0; i < BT_MAX_LINKS; i++) {
+    if (bt_links[i].in_use && memcmp(bt_links[i].bdaddr, bdaddr, 6) == 0)
+      return &bt_links[i];
+  }
+
+  return NULL;
+}
+
+void bt_link_remove(uint16_t handle) {
+  bt_link_t *link = bt_link_find(handle);
+
+  if (link != NULL) {
+    bt_timer_cancel(&link->idle_timer);
+    link->in_use = false;
+  }
+}
+
+uint8_t bt_link_count() {
+  uint8_t count = 0;
+
+  for (uint8_t i = 0; i < BT_MAX_LINKS; i++) {
+    if (bt_links[i].in_use)
+      count++;
+  }
+
+  return count;
+}
+
+void bt_link_qos_complete(bt_link_t *link, uint8_t status, const bt_qos_t *achieved) {
+  if (status) {
+    link->qos_state = BT_QOS_REJECTED;
+    return;
+  }
+
+  link->qos_achieved = *achieved;
+
+  if (achieved->service_type != link->qos_requested.service_type || achieved->latency > link->qos_requested.latency)
+    link->qos_state = BT_QOS_DEGRADED;
+  else
+    link->qos_state = BT_QOS_ACCEPTED;
+}
+
+uint8_t bt_device_class(const uint8_t *class_of_device) {
+  if (!(class_of_device[1] & 0x05)) // Major class peripheral
+    return BT_DEVICE_CLASS_OTHER;
+
+  if (class_of_device[0] & 0x40) // Checked first so combo keyboards/pointers never lose keystrokes
+    return BT_DEVICE_CLASS_KEYBOARD;
+  if (class_of_device[0] & 0x80)
+    return BT_DEVICE_CLASS_MOUSE;
+  if (class_of_device[0] & 0x08)
+    return BT_DEVICE_CLASS_GAMEPAD;
+
+  return BT_DEVICE_CLASS_OTHER;
+}
+
+static bool bt_feature_both(const uint8_t *local, const uint8_t *remote, uint8_t bit) {
+  return HCI_FEATURE(local, bit) && (remote == NULL || HCI_FEATURE(remote, bit));
+}
+
+uint16_t bt_packet_types(const uint8_t *local, const uint8_t *remote) {
+  uint16_t types = HCI_PACKET_DM1 | HCI_PACKET_DH1 | HCI_PACKET_NO_EDR;
+  bool slot3 = bt_feature_both(local, remote, HCI_FEATURE_3_SLOT);
+  bool slot5 = bt_feature_both(local, remote, HCI_FEATURE_5_SLOT);
+
+  if (slot3)
+    types |= HCI_PACKET_DM3 | HCI_PACKET_DH3;
+  if (slot5)
+    types |= HCI_PACKET_DM5 | HCI_PACKET_DH5;
+
+  // 2 Mbps and 3 Mbps modulation, multi slot EDR packets also need the multi slot basic rate packets
+  if (bt_feature_both(local, remote, HCI_FEATURE_EDR_2M)) {
+    types &= ~HCI_PACKET_NO_2_DH1;
+    if (slot3 && bt_feature_both(local, remote, HCI_FEATURE_3_SLOT_EDR))
+      types &= ~HCI_PACKET_NO_2_DH3;
+    if (slot5 && bt_feature_both(local, remote, HCI_FEATURE_5_SLOT_EDR))
+      types &= ~HCI_PACKET_NO_2_DH5;
+  }
+  if (bt_feature_both(local, remote, HCI_FEATURE_EDR_3M)) {
+    types &= ~HCI_PACKET_NO_3_DH1;
+    if (slot3 && bt_feature_both(local, remote, HCI_FEATURE_3_SLOT_EDR))
+      types &= ~HCI_PACKET_NO_3_DH3;
+    if (slot5 && bt_feature_both(local, remote, HCI_FEATURE_5_SLOT_EDR))
+      types &= ~HCI_PACKET_NO_3_DH5;
+  }
+
+  return types;
+}
+
+const bt_latency_policy_t *bt_latency_policy(uint8_t device_class) {
+  if (device_class >= BT_DEVICE_CLASS_COUNT)
+    device_class = BT_DEVICE_CLASS_OTHER;
+
+  return &latency_policies[device_class];
+}
+
+void bt_latency_policy_set(uint8_t device_class, const bt_latency_policy_t *policy) {
+  if (device_class < BT_DEVICE_CLASS_COUNT)
+    latency_policies[device_class] = *policy;
+}
+
+const bt_sniff_policy_t *bt_sniff_policy(uint8_t device_class) {
+  if (device_class >= BT_DEVICE_CLASS_COUNT)
+    device_class = BT_DEVICE_CLASS_OTHER;
+
+  return &sniff_policies[device_class];
+}
+
+void bt_sniff_policy_set(uint8_t device_class, const bt_sniff_policy_t *policy) {
+  if (device_class < BT_DEVICE_CLASS_COUNT)
+    sniff_policies[device_class] = *policy;
+}
+
+uint8_t bt_scan_mode(uint32_t since_activity) {
+  uint8_t links = bt_link_count();
+
+  if (links == 0 || since_activity < BT_SCAN_FAST_HOLD)
+    return BT_SCAN_FAST;
+  if (links >= BT_MAX_LINKS)
+    return BT_SCAN_SLOW;
+
+  return BT_SCAN_NORMAL;
+}
+
+const bt_scan_policy_t *bt_scan_policy(uint8_t mode) {
+  if (mode >= BT_SCAN_COUNT)
+    mode = BT_SCAN_NORMAL;
+
+  return &scan_policies[mode];
+}
+
+void bt_scan_policy_set(uint8_t mode, const bt_scan_policy_t *policy) {
+  if (mode < BT_SCAN_COUNT)
+    scan_policies[mode] = *policy;
+}
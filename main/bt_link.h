@@ -0,0 +1,152 @@
+#ifndef BT_LINK_H
+#define BT_LINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_timer.h"
+#include "conn_profile.h"
+
+#define BT_MAX_LINKS                    4 // Matches CONFIG_BT_ACL_CONNECTIONS
+
+/* Device classes derived from the minor class of device of a peripheral */
+#define BT_DEVICE_CLASS_OTHER           0
+#define BT_DEVICE_CLASS_KEYBOARD        1
+#define BT_DEVICE_CLASS_MOUSE           2
+#define BT_DEVICE_CLASS_GAMEPAD         3
+#define BT_DEVICE_CLASS_COUNT           4
+
+/* QoS service types */
+#define BT_QOS_NO_TRAFFIC               0x00
+#define BT_QOS_BEST_EFFORT              0x01
+#define BT_QOS_GUARANTEED               0x02
+
+/* State of the QoS request on a link */
+#define BT_QOS_NONE                     0 // Nothing requested, the controller picks the poll interval
+#define BT_QOS_PENDING                  1
+#define BT_QOS_ACCEPTED                 2 // Achieved latency is at least as good as requested
+#define BT_QOS_DEGRADED                 3 // Accepted, but with a longer latency than requested
+#define BT_QOS_REJECTED                 4
+
+typedef struct {
+  uint8_t service_type;
+  uint32_t token_rate;      // Bytes/second
+  uint32_t peak_bandwidth;  // Bytes/second, 0 = unknown
+  uint32_t latency;         // Microseconds, upper bound for the poll interval
+  uint32_t delay_variation; // Microseconds, 0xFFFFFFFF = don't care
+} bt_qos_t;
+
+/* How stale data is treated on a link. With a flush timeout, output on the HID interrupt channel is sent
+   as automatically flushable, so the controller drops it instead of retransmitting it after the timeout.
+   Signaling and control channel data is always sent non-flushable. */
+typedef struct {
+  uint16_t flush_timeout; // Milliseconds, 0 = never flush
+  bool flushable_output;  // Send interrupt channel output as automatically flushable
+  uint32_t poll_interval; // Microseconds requested with QoS_Setup, 0 = leave it to the controller
+} bt_latency_policy_t;
+
+/* Current mode reported in Mode Change events */
+#define BT_MODE_ACTIVE                  0x00
+#define BT_MODE_HOLD                    0x01
+#define BT_MODE_SNIFF                   0x02
+#define BT_MODE_PARK                    0x03
+
+/* Role of the host on a link, as reported in Role Change events */
+#define BT_ROLE_MASTER                  0x00
+#define BT_ROLE_SLAVE                   0x01
+
+#define BT_ROLE_SWITCH_ATTEMPTS         2 // Switch_Role requests per link before it is left as slave
+
+/* When an idle link is moved into sniff mode, and later sniff subrating. Intervals are in 0.625 ms slots. */
+typedef struct {
+  uint32_t idle_timeout;     // Milliseconds without traffic before entering sniff mode, 0 = never sniff
+  uint16_t max_interval;
+  uint16_t min_interval;
+  uint16_t attempt;
+  uint16_t timeout;
+  uint32_t subrate_timeout;  // Milliseconds without traffic before enabling sniff subrating, 0 = never
+  uint16_t max_latency;      // Sniff subrating parameters
+  uint16_t min_remote_timeout;
+  uint16_t min_local_timeout;
+} bt_sniff_policy_t;
+
+/* Page and inquiry scan duty cycle, picked from the number of links and how recently a link came or went */
+#define BT_SCAN_FAST                    0 // Waiting for a device to connect or reconnect
+#define BT_SCAN_NORMAL                  1 // Links are up, but one may still be added
+#define BT_SCAN_SLOW                    2 // Every link is in use, scanning only takes air time from them
+#define BT_SCAN_COUNT                   3
+
+#define BT_SCAN_FAST_HOLD               10000 // Milliseconds of fast scanning after a link came or went
+
+/* Intervals and windows are in 0.625 ms slots. An interlaced scan listens on both hop trains in one
+   interval, so a device paging on the other train is heard in a single interval instead of two. */
+typedef struct {
+  uint16_t page_interval;
+  uint16_t page_window;
+  bool page_interlaced;
+  uint16_t inquiry_interval;
+  uint16_t inquiry_window;
+  bool inquiry_interlaced;
+} bt_scan_policy_t;
+
+typedef struct {
+  bool in_use;
+  uint16_t handle;
+  uint8_t bdaddr[6];
+  uint8_t class_of_device[3];
+  uint8_t device_class;
+  const bt_latency_policy_t *latency;
+  uint8_t qos_state;
+  bt_qos_t qos_requested;
+  bt_qos_t qos_achieved; // Parameters reported in QoS Setup Complete
+  uint32_t access_latency; // Microseconds, from Flow Specification Complete for incoming data
+  const bt_sniff_policy_t *sniff;
+  uint8_t mode;
+  bool mode_pending; // A mode change has been requested
+  bool subrated; // Set from the Sniff Subrating event, not when Sniff_Subrating is sent
+  bool subrate_pending; // Sniff_Subrating has been sent, the Sniff Subrating event tells how it went
+  uint16_t sniff_interval;
+  uint16_t max_tx_latency; // Slots, from the Sniff Subrating event
+  uint16_t max_rx_latency;
+  uint8_t features[8]; // LMP features from Read_Remote_Supported_Features
+  bool features_valid;
+  uint16_t packet_types; // HCI_PACKET_* in use, reported by Connection Packet Type Changed
+  uint8_t role;
+  bool role_pending; // Switch_Role has been requested
+  uint8_t role_attempts;
+  uint16_t link_policy; // HCI_LINK_POLICY_* last written to the controller
+  uint16_t acl_outstanding; // ACL packets sent and not yet reported by Number Of Completed Packets
+  uint32_t acl_since;       // Milliseconds, last time packets of the link completed, or the first one went out
+  uint32_t last_activity; // Milliseconds
+  uint32_t last_rx;       // Milliseconds
+  uint32_t rx_gap;        // Milliseconds, longest gap between received packets during a discovery slice
+  bool rx_watch;          // The link was streaming when the slice started, so its gaps count against the slice
+  bt_timer_t idle_timer; // Wakes the power policy when the link may have been idle long enough
+  profile_timeline_t profile; // How the connection was made, filled in once it is up or has failed
+} bt_link_t;
+
+extern bt_link_t bt_links[BT_MAX_LINKS];
+
+bt_link_t *bt_link_add(uint16_t handle, const uint8_t *bdaddr, const uint8_t *class_of_device);
+bt_link_t *bt_link_find(uint16_t handle);
+bt_link_t *bt_link_find_bdaddr(const uint8_t *bdaddr);
+void bt_link_remove(uint16_t handle);
+uint8_t bt_link_count();
+
+/* Checks the parameters the controller reported against the request and updates qos_state */
+void bt_link_qos_complete(bt_link_t *link, uint8_t status, const bt_qos_t *achieved);
+
+/* ACL packet types both sides support, with EDR when both have it. remote is NULL while it is unknown. */
+uint16_t bt_packet_types(const uint8_t *local, const uint8_t *remote);
+
+uint8_t bt_device_class(const uint8_t *class_of_device);
+const bt_latency_policy_t *bt_latency_policy(uint8_t device_class);
+void bt_latency_policy_set(uint8_t device_class, const bt_latency_policy_t *policy);
+const bt_sniff_policy_t *bt_sniff_policy(uint8_t device_class);
+void bt_sniff_policy_set(uint8_t device_class, const bt_sniff_policy_t *policy);
+
+/* since_activity is the time in milliseconds since a link was added, lost or is being reconnected */
+uint8_t bt_scan_mode(uint32_t since_activity);
+const bt_scan_policy_t *bt_scan_policy(uint8_t mode);
+void bt_scan_policy_set(uint8_t mode, const bt_scan_policy_t *policy);
+
+#endif
@@ -0,0 +1,119 @@
+#include <string.h>
+#include "esp_system.h"
+#include "sdp.h"
+#include "bt_reconnect.h"
+
+static bt_reconnect_t devices[BT_RECONNECT_MAX_DEVICES];
+
+/* A brief RF dropout is usually over within a second, so the first pages come quickly. Page scan stays
+   enabled in between, which lets devices that reconnect by themselves get through. */
+static bt_reconnect_policy_t reconnect_policy = { 100, 5000, 25, 20 };
+
+static bt_reconnect_t *bt_reconnect_find(const uint8_t *bdaddr) {
+  for (uint8_t i = 0; i < BT_RECONNECT_MAX_DEVICES; i++) {
+    if (devices[i].in_use && memcmp(devices[i].bdaddr, bdaddr, 6) == 0)
+      return &devices[i];
+  }
+
+  return NULL;
+}
+
+static void bt_reconnect_arm(bt_reconnect_t *device, uint32_t now) {
+  uint32_t delay = device->delay;
+  uint32_t spread = delay * reconnect_policy.jitter / 100;
+
+  if (spread)
+    delay = delay - spread + esp_random() % (2 * spread + 1);
+
+  device->due = now + delay;
+}
+
+bool bt_reconnect_wanted(uint8_t sdp_flags) {
+  return !(sdp_flags & SDP_HID_RECONNECT_INITIATE) || (sdp_flags & SDP_HID_NORMALLY_CONNECTABLE);
+}
+
+void bt_reconnect_schedule(const uint8_t *bdaddr, const uint8_t *class_of_device, uint32_t now) {
+  bt_reconnect_t *device = bt_reconnect_find(bdaddr);
+
+  for (uint8_t i = 0; device == NULL && i < BT_RECONNECT_MAX_DEVICES; i++) {
+    if (!devices[i].in_use)
+      device = &devices[i];
+  }
+
+  if (device == NULL)
+    return;
+
+  device->in_use = true;
+  memcpy(device->bdaddr, bdaddr, 6);
+  memcpy(device->class_of_device, class_of_device, 3);
+  device->attempts = 0;
+  device->delay = reconnect_policy.initial_delay;
+  bt_reconnect_arm(device, now);
+}
+
+void bt_reconnect_cancel(const uint8_t *bdaddr) {
+  bt_reconnect_t *device = bt_reconnect_find(bdaddr);
+
+  if (device != NULL)
+    device->in_use = false;
+}
+
+bt_reconnect_t *bt_reconnect_due(uint32_t now) {
+  for (uint8_t i = 0; i < BT_RECONNECT_MAX_DEVICES; i++) {
+    if (devices[i].in_use && (int32_t)(now - devices[i].due) >= 0)
+      return &devices[i];
+  }
+
+  return NULL;
+}
+
+void bt_reconnect_failed(const uint8_t *bdaddr, uint32_t now) {
+  bt_reconnect_t *device = bt_reconnect_find(bdaddr);
+
+  if (device == NULL)
+    return;
+
+  if (reconnect_policy.max_attempts && ++device->attempts >= reconnect_policy.max_attempts) {
+    device->in_use = false;
+    return;
+  }
+
+  device->delay *= 2;
+  if (device->delay > reconnect_policy.max_delay)
+    device->delay = reconnect_policy.max_delay;
+  bt_reconnect_arm(device, now);
+}
+
+bool bt_reconnect_pending() {
+  for (uint8_t i = 0; i < BT_RECONNECT_MAX_DEVICES; i++) {
+    if (devices[i].in_use)
+      return true;
+  }
+
+  return false;
+}
+
+uint32_t bt_reconnect_next(uint32_t now) {
+  uint32_t next = 0;
+
+  for (uint8_t i = 0; i < BT_RECONNECT_MAX_DEVICES; i++) {
+    if (!devices[i].in_use)
+      continue;
+
+    int32_t left = (int32_t)(devices[i].due - now);
+    if (left <= 0)
+      return 0;
+    if (next == 0 || (uint32_t)left < next)
+      next = left;
+  }
+
+  return next;
+}
+
+const bt_reconnect_policy_t *bt_reconnect_policy() {
+  return &reconnect_policy;
+}
+
+void bt_reconnect_policy_set(const bt_reconnect_policy_t *policy) {
+  reconnect_policy = *policy;
+}
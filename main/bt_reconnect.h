@@ -0,0 +1,50 @@
+#ifndef BT_RECONNECT_H
+#define BT_RECONNECT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_link.h"
+
+#define BT_RECONNECT_MAX_DEVICES        BT_MAX_LINKS
+
+/* How bonded devices are paged after the link was lost. The delay between pages starts at initial_delay
+   and doubles up to max_delay. Each delay is moved by up to jitter percent at random, so devices that
+   dropped together do not page in lockstep. */
+typedef struct {
+  uint32_t initial_delay; // Milliseconds
+  uint32_t max_delay;
+  uint8_t jitter;         // Percent
+  uint8_t max_attempts;   // Pages before the device is left to reconnect by itself, 0 = never give up
+} bt_reconnect_policy_t;
+
+typedef struct {
+  bool in_use;
+  uint8_t bdaddr[6];
+  uint8_t class_of_device[3];
+  uint8_t attempts;
+  uint32_t delay; // Milliseconds, before jitter
+  uint32_t due;   // millis() of the next page
+} bt_reconnect_t;
+
+/* Whether the host should page a device with these SDP_HID_* flags. A device that initiates reconnection
+   itself and is not page scanning when idle is left alone. */
+bool bt_reconnect_wanted(uint8_t sdp_flags);
+
+void bt_reconnect_schedule(const uint8_t *bdaddr, const uint8_t *class_of_device, uint32_t now);
+void bt_reconnect_cancel(const uint8_t *bdaddr);
+
+/* Device whose page is due, NULL if none */
+bt_reconnect_t *bt_reconnect_due(uint32_t now);
+
+/* The page of a device failed, schedules the next one or gives up after max_attempts */
+void bt_reconnect_failed(const uint8_t *bdaddr, uint32_t now);
+
+bool bt_reconnect_pending();
+
+/* Milliseconds until the next page is due, 0 if one is due now or none is scheduled */
+uint32_t bt_reconnect_next(uint32_t now);
+
+const bt_reconnect_policy_t *bt_reconnect_policy();
+void bt_reconnect_policy_set(const bt_reconnect_policy_t *policy);
+
+#endif
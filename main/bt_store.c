@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include "nvs.h"
+#include "bt_store.h"
+
+#define BT_STORE_NAMESPACE              "bt_store"
+
+/* NVS keys are limited to 15 characters: a type letter and the address in hex */
+static void bt_store_key(char *key, char type, const uint8_t *bdaddr) {
+  sprintf(key, "%c%02x%02x%02x%02x%02x%02x", type, bdaddr[5], bdaddr[4], bdaddr[3], bdaddr[2], bdaddr[1], bdaddr[0]);
+}
+
+/* Models are keyed by all of their Device ID: the vendor ID means nothing without its source, and a new
+   firmware version may change the descriptor */
+static void bt_store_model_key(char *key, uint16_t vendor_source, uint16_t vendor, uint16_t product, uint16_t version) {
+  sprintf(key, "m%x%04x%04x%04x", vendor_source & 0x0F, vendor, product, version);
+}
+
+static bool bt_store_read(const char *key, void *data, size_t size) {
+  nvs_handle handle;
+  size_t length = size;
+
+  if (nvs_open(BT_STORE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    return false;
+
+  esp_err_t err = nvs_get_blob(handle, key, data, &length);
+  nvs_close(handle);
+
+  return err == ESP_OK && length == size;
+}
+
+static bool bt_store_write(const char *key, const void *data, size_t size) {
+  nvs_handle handle;
+
+  if (nvs_open(BT_STORE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    return false;
+
+  esp_err_t err = nvs_set_blob(handle, key, data, size);
+  if (err == ESP_OK)
+    err = nvs_commit(handle);
+  nvs_close(handle);
+
+  return err == ESP_OK;
+}
+
+static bool bt_store_load(char type, const uint8_t *bdaddr, void *data, size_t size) {
+  char key[16];
+
+  bt_store_key(key, type, bdaddr);
+  return bt_store_read(key, data, size);
+}
+
+static bool bt_store_save(char type, const uint8_t *bdaddr, const void *data, size_t size) {
+  char key[16];
+
+  bt_store_key(key, type, bdaddr);
+  return bt_store_write(key, data, size);
+}
+
+bool bt_store_load_hid(const uint8_t *bdaddr, bt_store_hid_t *record) {
+  if (!bt_store_load('h', bdaddr, record, sizeof(*record)))
+    return false;
+
+  return record->version == BT_STORE_HID_VERSION && record->descriptor_length <= BT_STORE_MAX_DESCRIPTOR;
+}
+
+bool bt_store_save_hid(const uint8_t *bdaddr, const bt_store_hid_t *record) {
+  return bt_store_save('h', bdaddr, record, sizeof(*record));
+}
+
+bool bt_store_load_model(uint16_t vendor_source, uint16_t vendor, uint16_t product, uint16_t version, bt_store_hid_t *record) {
+  char key[16];
+
+  bt_store_model_key(key, vendor_source, vendor, product, version);
+  if (!bt_store_read(key, record, sizeof(*record)))
+    return false;
+
+  return record->version == BT_STORE_HID_VERSION && record->descriptor_length <= BT_STORE_MAX_DESCRIPTOR;
+}
+
+bool bt_store_save_model(uint16_t vendor_source, uint16_t vendor, uint16_t product, uint16_t version, const bt_store_hid_t *record) {
+  char key[16];
+
+  bt_store_model_key(key, vendor_source, vendor, product, version);
+  return bt_store_write(key, record, sizeof(*record));
+}
+
+bool bt_store_load_link_key(const uint8_t *bdaddr, bt_store_link_key_t *link_key) {
+  return bt_store_load('k', bdaddr, link_key, sizeof(*link_key));
+}
+
+bool bt_store_save_link_key(const uint8_t *bdaddr, const bt_store_link_key_t *link_key) {
+  return bt_store_save('k', bdaddr, link_key, sizeof(*link_key));
+}
+
+bool bt_store_load_features(const uint8_t *bdaddr, uint8_t *features) {
+  return bt_store_load('f', bdaddr, features, BT_STORE_FEATURES_LEN);
+}
+
+bool bt_store_save_features(const uint8_t *bdaddr, const uint8_t *features) {
+  return bt_store_save('f', bdaddr, features, BT_STORE_FEATURES_LEN);
+}
+
+void bt_store_forget(const uint8_t *bdaddr) {
+  nvs_handle handle;
+  char key[16];
+
+  if (nvs_open(BT_STORE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    return;
+
+  bt_store_key(key, 'h', bdaddr);
+  nvs_erase_key(handle, key);
+  bt_store_key(key, 'k', bdaddr);
+  nvs_erase_key(handle, key);
+  bt_store_key(key, 'f', bdaddr);
+  nvs_erase_key(handle, key);
+  nvs_commit(handle);
+  nvs_close(handle);
+}
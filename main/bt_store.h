@@ -0,0 +1,49 @@
+#ifndef BT_STORE_H
+#define BT_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BT_STORE_MAX_DESCRIPTOR         512
+
+/* What SDP told us about a HID device, kept in flash so reconnects can skip SDP */
+typedef struct {
+  uint8_t version; // BT_STORE_HID_VERSION, older entries are ignored
+  uint8_t flags;   // SDP_HID_*
+  uint16_t vendor_source; // Device ID, all 0 if the device has no Device ID record
+  uint16_t vendor;
+  uint16_t product;
+  uint16_t product_version;
+  uint16_t descriptor_length; // 0 if a driver supplies the layout
+  uint8_t descriptor[BT_STORE_MAX_DESCRIPTOR];
+} bt_store_hid_t;
+
+#define BT_STORE_HID_VERSION            3
+
+bool bt_store_load_hid(const uint8_t *bdaddr, bt_store_hid_t *record);
+bool bt_store_save_hid(const uint8_t *bdaddr, const bt_store_hid_t *record);
+
+/* Same record shared by every device of a model, so a new unit of a known model skips the HID query.
+   A model is one Device ID: vendor ID source, vendor, product and version. */
+bool bt_store_load_model(uint16_t vendor_source, uint16_t vendor, uint16_t product, uint16_t version, bt_store_hid_t *record);
+bool bt_store_save_model(uint16_t vendor_source, uint16_t vendor, uint16_t product, uint16_t version, const bt_store_hid_t *record);
+
+/* Link key from the last pairing with a device, so it reconnects without pairing again */
+typedef struct {
+  uint8_t key[16];
+  uint8_t type; // Key_Type of the Link Key Notification event
+} bt_store_link_key_t;
+
+bool bt_store_load_link_key(const uint8_t *bdaddr, bt_store_link_key_t *link_key);
+bool bt_store_save_link_key(const uint8_t *bdaddr, const bt_store_link_key_t *link_key);
+
+/* LMP features of a bonded device, so it is not asked again on every reconnect */
+#define BT_STORE_FEATURES_LEN           8
+
+bool bt_store_load_features(const uint8_t *bdaddr, uint8_t *features);
+bool bt_store_save_features(const uint8_t *bdaddr, const uint8_t *features);
+
+/* Forgets the HID record, the link key and the features of a device */
+void bt_store_forget(const uint8_t *bdaddr);
+
+#endif
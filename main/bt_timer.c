@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "bt_timer.h"
+
+/* Hashed timing wheel: a timer goes into the slot its expiry falls in, with the number of whole turns
+   still to go. Every tick only the slot under the hand is walked. Timers are armed from the VHCI callback
+   and the Bluetooth tasks on both cores, so the wheel is guarded by a spinlock. The FreeRTOS timer only
+   runs while a timer is armed. */
+static bt_timer_t *wheel[BT_TIMER_SLOTS];
+static uint8_t hand;
+static uint16_t armed_count;
+static bool wheel_running;
+static bt_timer_t *running; // Timer whose callback is being called, see bt_timer_cancel()
+static portMUX_TYPE wheel_lock = portMUX_INITIALIZER_UNLOCKED;
+static TimerHandle_t wheel_timer = NULL;
+
+static void bt_timer_unlink(bt_timer_t *timer) {
+  if (timer->prev != NULL)
+    timer->prev->next = timer->next;
+  else
+    wheel[timer->slot] = timer->next;
+
+  if (timer->next != NULL)
+    timer->next->prev = timer->prev;
+
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->armed = false;
+  armed_count--;
+}
+
+static void bt_timer_tick(TimerHandle_t handle) {
+  bt_timer_t *expired = NULL;
+
+  portENTER_CRITICAL(&wheel_lock);
+  hand = (hand + 1) & (BT_TIMER_SLOTS - 1);
+
+  bt_timer_t *timer = wheel[hand];
+  while (timer != NULL) {
+    bt_timer_t *next = timer->next;
+
+    if (timer->rounds == 0) {
+      bt_timer_unlink(timer);
+      timer->expired_generation = timer->generation;
+      timer->expired_next = expired; // Callbacks run once the lock is released, they may arm timers again
+      expired = timer;
+    } else {
+      timer->rounds--;
+    }
+    timer = next;
+  }
+  portEXIT_CRITICAL(&wheel_lock);
+
+  while (expired != NULL) {
+    bt_timer_t *next = expired->expired_next;
+
+    // Armed again or cancelled since it expired, then this expiry no longer counts
+    portENTER_CRITICAL(&wheel_lock);
+    bool current = expired->generation == expired->expired_generation;
+    if (current)
+      running = expired;
+    portEXIT_CRITICAL(&wheel_lock);
+
+    if (current) {
+      expired->callback(expired->arg);
+      portENTER_CRITICAL(&wheel_lock);
+      running = NULL;
+      portEXIT_CRITICAL(&wheel_lock);
+    }
+    expired = next;
+  }
+
+  // The timer is one-shot, so it only goes on while something is armed. bt_timer_arm() starts it again.
+  portENTER_CRITICAL(&wheel_lock);
+  wheel_running = armed_count > 0;
+  bool restart = wheel_running;
+  portEXIT_CRITICAL(&wheel_lock);
+
+  if (restart && xTimerStart(wheel_timer, 0) != pdPASS) {
+    portENTER_CRITICAL(&wheel_lock);
+    wheel_running = false; // The next bt_timer_arm() tries again
+    portEXIT_CRITICAL(&wheel_lock);
+  }
+}
+
+bool bt_timer_start() {
+  if (wheel_timer != NULL)
+    return true;
+
+  wheel_timer = xTimerCreate("bt_timer", pdMS_TO_TICKS(BT_TIMER_TICK_MS), pdFALSE, NULL, bt_timer_tick);
+  if (wheel_timer == NULL) {
+    printf("Timer wheel could not be started\n");
+    return false;
+  }
+
+  return true;
+}
+
+void bt_timer_init(bt_timer_t *timer, bt_timer_callback_t callback, void *arg) {
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expired_next = NULL;
+  timer->armed = false;
+  timer->generation = 0;
+  timer->expired_generation = 0;
+  timer->callback = callback;
+  timer->arg = arg;
+}
+
+void bt_timer_arm(bt_timer_t *timer, uint32_t timeout) {
+  uint32_t ticks = (timeout + BT_TIMER_TICK_MS - 1) / BT_TIMER_TICK_MS;
+
+  if (ticks == 0)
+    ticks = 1;
+
+  portENTER_CRITICAL(&wheel_lock);
+  if (timer->armed)
+    bt_timer_unlink(timer);
+
+  // The hand has already moved past the current slot, so a whole turn lands back on it with no rounds left
+  timer->slot = (hand + ticks) & (BT_TIMER_SLOTS - 1);
+  timer->rounds = (ticks - 1) / BT_TIMER_SLOTS;
+  timer->prev = NULL;
+  timer->next = wheel[timer->slot];
+  if (timer->next != NULL)
+    timer->next->prev = timer;
+  wheel[timer->slot] = timer;
+  timer->armed = true;
+  timer->generation++;
+  armed_count++;
+
+  bool start = !wheel_running && wheel_timer != NULL;
+  if (start)
+    wheel_running = true;
+  portEXIT_CRITICAL(&wheel_lock);
+
+  if (start && xTimerStart(wheel_timer, 0) != pdPASS) {
+    portENTER_CRITICAL(&wheel_lock);
+    wheel_running = false;
+    portEXIT_CRITICAL(&wheel_lock);
+  }
+}
+
+void bt_timer_cancel(bt_timer_t *timer) {
+  portENTER_CRITICAL(&wheel_lock);
+  if (timer->armed)
+    bt_timer_unlink(timer);
+  timer->generation++;
+  bool wait = running == timer && xTaskGetCurrentTaskHandle() != xTimerGetTimerDaemonTaskHandle();
+  portEXIT_CRITICAL(&wheel_lock);
+
+  // Its callback is running on the timer task right now. Once it has returned, nothing it did is left
+  // for the caller to clean up.
+  while (wait) {
+    vTaskDelay(1);
+    portENTER_CRITICAL(&wheel_lock);
+    wait = running == timer;
+    portEXIT_CRITICAL(&wheel_lock);
+  }
+}
+
+bool bt_timer_armed(const bt_timer_t *timer) {
+  return timer->armed;
+}
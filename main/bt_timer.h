@@ -0,0 +1,40 @@
+#ifndef BT_TIMER_H
+#define BT_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BT_TIMER_TICK_MS                10
+#define BT_TIMER_SLOTS                  64 // Power of two. Longer timeouts wait extra rounds in their slot.
+
+typedef void (*bt_timer_callback_t)(void *arg);
+
+/* One timeout. Timers live in the structure that owns them and are linked into the wheel while armed, so
+   arming and cancelling are O(1) and nothing is allocated. */
+typedef struct bt_timer {
+  struct bt_timer *next;
+  struct bt_timer *prev;
+  struct bt_timer *expired_next; // Separate from next, the timer may be armed again before its callback runs
+  uint32_t rounds; // Full turns of the wheel left before it expires
+  uint8_t slot;
+  bool armed;
+  uint32_t generation;         // Changed by every arm and cancel
+  uint32_t expired_generation; // generation when it expired, the callback only runs if it still matches
+  bt_timer_callback_t callback; // Called from the FreeRTOS timer task, so it should only set flags
+  void *arg;
+} bt_timer_t;
+
+/* Creates the FreeRTOS timer that turns the wheel. It is started by the first bt_timer_arm(). */
+bool bt_timer_start();
+
+void bt_timer_init(bt_timer_t *timer, bt_timer_callback_t callback, void *arg);
+
+/* Expires after at least timeout milliseconds. Arming an armed timer restarts it. */
+void bt_timer_arm(bt_timer_t *timer, uint32_t timeout);
+
+/* Once it returns, the callback is not running and does not run for an expiry from before. If the callback
+   is running on the timer task, it waits for it to return. */
+void bt_timer_cancel(bt_timer_t *timer);
+bool bt_timer_armed(const bt_timer_t *timer);
+
+#endif
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_timer.h"
+#include "bt.h"
+#include "conn_profile.h"
+#include "bt_link.h"
+
+static profile_timeline_t current; // Only one connection is made at a time
+static uint16_t current_handle = 0xFFFF; // Link of the current timeline, none until Connection Complete
+static profile_phase_stats_t phase_stats[PROFILE_PHASE_COUNT];
+static uint32_t failed_connections;
+
+/* Current state of each machine and when it was entered. Unknown at first, so the first state is recorded
+   as well. */
+static uint8_t machine_state[3] = { PROFILE_STATE_NONE, PROFILE_STATE_NONE, PROFILE_STATE_NONE };
+static int64_t machine_since[3];
+
+static const char *machine_names[3] = { "HCI", "L2CAP", "AUTH" };
+static const char *phase_names[PROFILE_PHASE_COUNT] = { "init", "inquiry", "paging", "authentication", "l2cap control", "l2cap interrupt" };
+
+static uint8_t profile_phase(uint8_t machine, uint8_t state) {
+  if (machine == PROFILE_MACHINE_AUTH)
+    return state == PROFILE_AUTH_PENDING ? PROFILE_PHASE_AUTHENTICATION : PROFILE_PHASE_NONE;
+
+  if (machine == PROFILE_MACHINE_L2CAP) {
+    switch (state) {
+      case L2CAP_CONTROL_CONNECT_REQUEST:
+      case L2CAP_CONTROL_CONFIG_REQUEST:
+      case L2CAP_CONTROL_SUCCESS:
+        return PROFILE_PHASE_L2CAP_CONTROL;
+      case L2CAP_INTERRUPT_SETUP:
+      case L2CAP_INTERRUPT_CONNECT_REQUEST:
+      case L2CAP_INTERRUPT_CONFIG_REQUEST:
+        return PROFILE_PHASE_L2CAP_INTERRUPT;
+      default:
+        return PROFILE_PHASE_NONE;
+    }
+  }
+
+  switch (state) {
+    case HCI_INIT_STATE:
+    case HCI_RESET_STATE:
+    case HCI_CLASS_STATE:
+    case HCI_BDADDR_STATE:
+    case HCI_BUFFER_SIZE_STATE:
+    case HCI_LOCAL_VERSION_STATE:
+    case HCI_LOCAL_FEATURES_STATE:
+    case HCI_LOCAL_COMMANDS_STATE:
+    case HCI_LOCAL_EXT_FEATURES_STATE:
+    case HCI_INQUIRY_MODE_STATE:
+    case HCI_EVENT_MASK_STATE:
+    case HCI_SIMPLE_PAIRING_STATE:
+    case HCI_SET_NAME_STATE:
+      return PROFILE_PHASE_INIT;
+    case HCI_CHECK_DEVICE_SERVICE:
+    case HCI_INQUIRY_STATE:
+      return PROFILE_PHASE_INQUIRY;
+    case HCI_CONNECT_DEVICE_STATE:
+    case HCI_CONNECTED_DEVICE_STATE:
+    case HCI_RECONNECT_STATE:
+    case HCI_REMOTE_NAME_STATE:
+    case HCI_CONNECTED_STATE:
+      return PROFILE_PHASE_PAGING;
+    default: // Waiting for a connection is not part of making one
+      return PROFILE_PHASE_NONE;
+  }
+}
+
+void profile_state(uint8_t machine, uint8_t state) {
+  if (state == machine_state[machine])
+    return;
+
+  int64_t now = esp_timer_get_time();
+  uint8_t old_phase = profile_phase(machine, machine_state[machine]);
+  uint8_t new_phase = profile_phase(machine, state);
+
+  if (current.active && old_phase != PROFILE_PHASE_NONE)
+    current.phase_time[old_phase] += now - (machine_since[machine] > current.start ? machine_since[machine] : current.start);
+
+  machine_state[machine] = state;
+  machine_since[machine] = now;
+
+  if (!current.active && new_phase != PROFILE_PHASE_NONE) {
+    memset(&current, 0, sizeof(current));
+    current.active = true;
+    current.start = now;
+    current_handle = 0xFFFF;
+  }
+
+  if (current.active && current.entry_count < PROFILE_MAX_ENTRIES) {
+    profile_entry_t *entry = &current.entries[current.entry_count++];
+
+    entry->machine = machine;
+    entry->state = state;
+    entry->time = now - current.start;
+  }
+
+  if (machine == PROFILE_MACHINE_L2CAP && state == L2CAP_DONE && current.active)
+    profile_connection_done(true);
+}
+
+void profile_link(uint16_t handle) {
+  current_handle = handle;
+}
+
+void profile_connection_done(bool success) {
+  if (!current.active)
+    return;
+
+  int64_t now = esp_timer_get_time();
+
+  // Close the phases still running
+  for (uint8_t m = 0; m < 3; m++) {
+    uint8_t phase = profile_phase(m, machine_state[m]);
+
+    if (phase != PROFILE_PHASE_NONE)
+      current.phase_time[phase] += now - (machine_since[m] > current.start ? machine_since[m] : current.start);
+    machine_since[m] = now;
+  }
+
+  current.active = false;
+  current.success = success;
+
+  if (success) {
+    for (uint8_t i = 0; i < PROFILE_PHASE_COUNT; i++) {
+      uint32_t time = current.phase_time[i];
+      profile_phase_stats_t *stats = &phase_stats[i];
+
+      if (time == 0)
+        continue;
+
+      if (stats->connections == 0 || time < stats->min)
+        stats->min = time;
+      if (time > stats->max)
+        stats->max = time;
+      stats->total += time;
+      stats->connections++;
+    }
+  } else {
+    failed_connections++;
+  }
+
+  bt_link_t *link = bt_link_find(current_handle);
+  if (link != NULL)
+    link->profile = current;
+}
+
+void profile_phase_stats(uint8_t phase, profile_phase_stats_t *stats) {
+  if (phase < PROFILE_PHASE_COUNT)
+    *stats = phase_stats[phase];
+  else
+    memset(stats, 0, sizeof(*stats));
+}
+
+void profile_reset() {
+  memset(phase_stats, 0, sizeof(phase_stats));
+  failed_connections = 0;
+}
+
+void profile_print_timeline(const profile_timeline_t *timeline) {
+  printf("Connection timeline (%s):\n", timeline->success ? "connected" : "failed");
+
+  for (uint8_t i = 0; i < timeline->entry_count; i++) {
+    const profile_entry_t *entry = &timeline->entries[i];
+    printf("  %8lu us %-5s state %d\n", (unsigned long)entry->time, machine_names[entry->machine], entry->state);
+  }
+
+  for (uint8_t i = 0; i < PROFILE_PHASE_COUNT; i++) {
+    if (timeline->phase_time[i])
+      printf("  %-16s %8lu us\n", phase_names[i], (unsigned long)timeline->phase_time[i]);
+  }
+}
+
+void profile_print_stats() {
+  printf("Connection phases (ms)  count     mean      min      max, %lu failed\n", (unsigned long)failed_connections);
+
+  for (uint8_t i = 0; i < PROFILE_PHASE_COUNT; i++) {
+    const profile_phase_stats_t *stats = &phase_stats[i];
+
+    if (stats->connections)
+      printf("  %-20s %6lu %8lu %8lu %8lu\n", phase_names[i], (unsigned long)stats->connections,
+             (unsigned long)(stats->total / stats->connections / 1000), (unsigned long)(stats->min / 1000), (unsigned long)(stats->max / 1000));
+  }
+}
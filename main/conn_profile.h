@@ -0,0 +1,69 @@
+#ifndef CONN_PROFILE_H
+#define CONN_PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* State machines whose transitions are recorded */
+#define PROFILE_MACHINE_HCI             0
+#define PROFILE_MACHINE_L2CAP           1
+#define PROFILE_MACHINE_AUTH            2
+
+/* States of PROFILE_MACHINE_AUTH, which has no state variable of its own */
+#define PROFILE_AUTH_IDLE               0
+#define PROFILE_AUTH_PENDING            1
+
+#define PROFILE_STATE_NONE              0xFF // Before the first transition of a machine
+
+/* Phases of a connection, each made up of one or more states */
+#define PROFILE_PHASE_INIT              0
+#define PROFILE_PHASE_INQUIRY           1
+#define PROFILE_PHASE_PAGING            2
+#define PROFILE_PHASE_AUTHENTICATION    3
+#define PROFILE_PHASE_L2CAP_CONTROL     4
+#define PROFILE_PHASE_L2CAP_INTERRUPT   5
+#define PROFILE_PHASE_COUNT             6
+#define PROFILE_PHASE_NONE              0xFF
+
+#define PROFILE_MAX_ENTRIES             32
+
+typedef struct {
+  uint8_t machine;
+  uint8_t state;
+  uint32_t time; // Microseconds since the start of the timeline
+} profile_entry_t;
+
+/* Transitions of one connection, from the first state that belongs to a phase until the HID channels
+   are up or the link is gone */
+typedef struct {
+  bool active;
+  bool success;
+  int64_t start;
+  uint8_t entry_count; // Transitions past PROFILE_MAX_ENTRIES are only counted in the phase times
+  profile_entry_t entries[PROFILE_MAX_ENTRIES];
+  uint32_t phase_time[PROFILE_PHASE_COUNT]; // Microseconds
+} profile_timeline_t;
+
+typedef struct {
+  uint32_t connections; // Connections that went through the phase
+  uint64_t total;       // Microseconds
+  uint32_t min;
+  uint32_t max;
+} profile_phase_stats_t;
+
+/* Records that a state machine entered a state, which also ends the previous state of that machine */
+void profile_state(uint8_t machine, uint8_t state);
+
+/* The connection being made got its ACL link, so its timeline is stored in the link once it is done */
+void profile_link(uint16_t handle);
+
+/* Closes the current timeline and adds it to the statistics */
+void profile_connection_done(bool success);
+
+void profile_phase_stats(uint8_t phase, profile_phase_stats_t *stats);
+void profile_reset();
+
+void profile_print_timeline(const profile_timeline_t *timeline);
+void profile_print_stats();
+
+#endif
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include "hid_driver.h"
+
+static hid_driver_t *drivers[HID_MAX_DRIVERS];
+static uint8_t driver_count = 0;
+
+bool hid_driver_register(hid_driver_t *driver) {
+  if (driver_count >= HID_MAX_DRIVERS)
+    return false;
+
+  if (driver->descriptor != NULL && (driver->plan == NULL || !hid_plan_compile(driver->plan, driver->descriptor, driver->descriptor_length))) {
+    printf("HID driver %s: descriptor did not compile\n", driver->name);
+    return false;
+  }
+
+  drivers[driver_count++] = driver;
+  return true;
+}
+
+const hid_driver_t *hid_driver_find(uint16_t vendor, uint16_t product) {
+  const hid_driver_t *found = NULL;
+
+  for (uint8_t i = 0; i < driver_count; i++) {
+    if (drivers[i]->vendor != vendor)
+      continue;
+
+    if (drivers[i]->product == product)
+      return drivers[i];
+    if (drivers[i]->product == HID_PRODUCT_ANY)
+      found = drivers[i];
+  }
+
+  return found;
+}
+
+#ifdef HID_DRIVER_SELFTEST
+/* Boot mouse: three buttons, X and Y */
+static const uint8_t selftest_descriptor[] = {
+  0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+  0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+  0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x02, 0x81, 0x06,
+  0xC0, 0xC0
+};
+
+static hid_plan_t selftest_plan;
+static uint8_t selftest_inits;
+
+static void selftest_init(hid_device_t *device) {
+  selftest_inits++;
+}
+
+static hid_driver_t selftest_vendor = { "self test vendor", 0xF0F0, HID_PRODUCT_ANY, NULL, 0, NULL, selftest_init };
+static hid_driver_t selftest_product = { "self test product", 0xF0F0, 0x0001, selftest_descriptor, sizeof(selftest_descriptor), &selftest_plan, selftest_init };
+
+static bool hid_driver_selftest_check(const char *name, bool ok) {
+  if (!ok)
+    printf("HID driver self test failed: %s\n", name);
+  return ok;
+}
+
+bool hid_driver_selftest() {
+  uint8_t registered = driver_count;
+  hid_device_t *device;
+  bool ok = true;
+
+  if (!hid_driver_register(&selftest_vendor) || !hid_driver_register(&selftest_product)) {
+    driver_count = registered;
+    return hid_driver_selftest_check("register", false);
+  }
+
+  ok &= hid_driver_selftest_check("exact product", hid_driver_find(0xF0F0, 0x0001) == &selftest_product);
+  ok &= hid_driver_selftest_check("any product", hid_driver_find(0xF0F0, 0x0002) == &selftest_vendor);
+  ok &= hid_driver_selftest_check("other vendor", hid_driver_find(0xF0F1, 0x0001) == NULL);
+
+  // Model known before the channels are up, as from a stored record
+  device = hid_device_open(0x0EFF);
+  selftest_inits = 0;
+  ok &= hid_driver_selftest_check("driver layout", device != NULL && hid_device_set_model(device, 2, 0xF0F0, 0x0001, 0x0100) && device->plan_ready);
+  ok &= hid_driver_selftest_check("init waits for the channels", selftest_inits == 0);
+  if (device != NULL)
+    hid_device_connected(device);
+  ok &= hid_driver_selftest_check("init once connected", selftest_inits == 1);
+  hid_device_close(0x0EFF);
+
+  // Model found by SDP after the channels came up, by a driver without a descriptor
+  device = hid_device_open(0x0EFF);
+  selftest_inits = 0;
+  if (device != NULL)
+    hid_device_connected(device);
+  ok &= hid_driver_selftest_check("descriptor of the device", device != NULL && !hid_device_set_model(device, 2, 0xF0F0, 0x0002, 0x0100) && !device->plan_ready);
+  ok &= hid_driver_selftest_check("init after the channels", selftest_inits == 1);
+  if (device != NULL)
+    hid_device_set_model(device, 2, 0xF0F0, 0x0002, 0x0100);
+  ok &= hid_driver_selftest_check("init only once", selftest_inits == 1);
+  hid_device_close(0x0EFF);
+
+  driver_count = registered;
+  return ok;
+}
+#endif
@@ -0,0 +1,36 @@
+#ifndef HID_DRIVER_H
+#define HID_DRIVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hid_host.h"
+
+#define HID_MAX_DRIVERS                 8
+#define HID_PRODUCT_ANY                 0xFFFF // Matches every product of the vendor
+
+/* Support for a known device model, picked by the Vendor and Product ID of its Device ID record. A driver
+   with a descriptor has its report layout compiled once at registration, so devices it matches need no
+   HID descriptor from SDP. Devices without a driver use the descriptor they report. */
+typedef struct hid_driver {
+  const char *name;
+  uint16_t vendor;
+  uint16_t product;
+  const uint8_t *descriptor; // NULL to use the descriptor of the device
+  uint16_t descriptor_length;
+  hid_plan_t *plan;          // Storage for the compiled descriptor
+  void (*init)(hid_device_t *device); // Called once the HID channels are up, may be NULL
+} hid_driver_t;
+
+/* Returns false if the registry is full or the descriptor does not compile */
+bool hid_driver_register(hid_driver_t *driver);
+
+/* Exact product matches win over HID_PRODUCT_ANY. NULL if there is no driver for the model. */
+const hid_driver_t *hid_driver_find(uint16_t vendor, uint16_t product);
+
+#ifdef HID_DRIVER_SELFTEST
+/* Registers drivers for a made-up vendor and checks lookup and when init() runs, then unregisters them.
+   Returns false and prints the case if one fails. */
+bool hid_driver_selftest();
+#endif
+
+#endif
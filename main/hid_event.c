@@ -0,0 +1,159 @@
+#include <string.h>
+#include "esp_timer.h"
+#include "hid_event.h"
+
+/* Every subscriber has its own ring with the decoder as the only producer and the subscriber as
+   the only consumer, so no locks are needed across the cores. Each slot carries a sequence number:
+   odd while the producer writes it, 2 * position + 2 once the record at that position is complete. A
+   consumer that was lapped under HID_EVENT_LATEST sees a different sequence and skips ahead. */
+typedef struct {
+  volatile uint32_t sequence;
+  hid_event_t event;
+} hid_event_slot_t;
+
+typedef struct {
+  bool claimed;
+  volatile bool in_use; // Set once the subscriber is ready for the producer
+  uint8_t policy;
+  TaskHandle_t task;
+  volatile uint32_t head; // Written by the producer only
+  volatile uint32_t tail; // Written by the consumer only
+  volatile uint32_t rejected; // Lossless records that did not fit, written by the producer
+  uint32_t overwritten;       // Latest-wins records the consumer never saw, written by the consumer
+  hid_event_slot_t slots[HID_EVENT_QUEUE_LEN];
+} hid_subscriber_t;
+
+static hid_subscriber_t subscribers[HID_EVENT_MAX_SUBSCRIBERS];
+static hid_event_t publish_event;
+
+#define load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+int8_t hid_event_subscribe(uint8_t policy, TaskHandle_t task) {
+  for (int8_t i = 0; i < HID_EVENT_MAX_SUBSCRIBERS; i++) {
+    hid_subscriber_t *sub = &subscribers[i];
+
+    if (!__atomic_exchange_n(&sub->claimed, true, __ATOMIC_ACQ_REL)) {
+      sub->policy = policy;
+      sub->task = task;
+      sub->rejected = 0;
+      sub->overwritten = 0;
+      for (uint8_t j = 0; j < HID_EVENT_QUEUE_LEN; j++)
+        sub->slots[j].sequence = 0;
+      sub->tail = sub->head;
+      store_release(&sub->in_use, true); // Publish the setup before the producer uses it
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+void hid_event_unsubscribe(int8_t id) {
+  if (id >= 0 && id < HID_EVENT_MAX_SUBSCRIBERS) {
+    store_release(&subscribers[id].in_use, false);
+    store_release(&subscribers[id].claimed, false);
+  }
+}
+
+static void hid_event_push(hid_subscriber_t *sub, const hid_event_t *event) {
+  uint32_t head = sub->head;
+
+  if (sub->policy == HID_EVENT_LOSSLESS && head - load_acquire(&sub->tail) >= HID_EVENT_QUEUE_LEN) {
+    sub->rejected++;
+    return;
+  }
+
+  hid_event_slot_t *slot = &sub->slots[head & (HID_EVENT_QUEUE_LEN - 1)];
+
+  store_release(&slot->sequence, 2 * head + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->event = *event;
+  store_release(&slot->sequence, 2 * head + 2);
+  store_release(&sub->head, head + 1);
+
+  if (sub->task != NULL)
+    xTaskNotifyGive(sub->task);
+}
+
+void hid_event_publish(uint16_t handle, uint8_t device_class, uint8_t report_id, const latency_stamps_t *stamps, const hid_value_t *values, uint8_t count) {
+  hid_event_t *event = &publish_event;
+
+  event->handle = handle;
+  event->device_class = device_class;
+  event->report_id = report_id;
+  event->stamps = *stamps;
+  latency_record_report(stamps);
+
+  do {
+    uint8_t n = count > HID_EVENT_MAX_VALUES ? HID_EVENT_MAX_VALUES : count;
+
+    event->value_count = n;
+    event->flags = count > n ? HID_EVENT_CONTINUED : 0;
+    memcpy(event->values, values, n * sizeof(hid_value_t));
+
+    for (uint8_t i = 0; i < HID_EVENT_MAX_SUBSCRIBERS; i++) {
+      if (load_acquire(&subscribers[i].in_use))
+        hid_event_push(&subscribers[i], event);
+    }
+
+    values += n;
+    count -= n;
+  } while (count > 0);
+}
+
+bool hid_event_receive(int8_t id, hid_event_t *event) {
+  if (id < 0 || id >= HID_EVENT_MAX_SUBSCRIBERS)
+    return false;
+
+  hid_subscriber_t *sub = &subscribers[id];
+  uint32_t tail = sub->tail;
+
+  for (;;) {
+    uint32_t head = load_acquire(&sub->head);
+
+    if (tail == head)
+      break;
+
+    if (head - tail > HID_EVENT_QUEUE_LEN) { // Lapped, the oldest records are gone
+      sub->overwritten += head - tail - HID_EVENT_QUEUE_LEN;
+      tail = head - HID_EVENT_QUEUE_LEN;
+    }
+
+    hid_event_slot_t *slot = &sub->slots[tail & (HID_EVENT_QUEUE_LEN - 1)];
+    uint32_t sequence = load_acquire(&slot->sequence);
+
+    if (sequence == 2 * tail + 2) {
+      *event = slot->event;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+      if (load_acquire(&slot->sequence) == sequence) { // Not overwritten while copying
+        store_release(&sub->tail, tail + 1);
+        latency_record_delivery(&event->stamps, event->device_class, esp_timer_get_time());
+        return true;
+      }
+    }
+
+    // The producer has lapped this slot, try again from the new head
+    sub->overwritten++;
+    tail++;
+  }
+
+  store_release(&sub->tail, tail);
+  return false;
+}
+
+bool hid_event_wait(int8_t id, hid_event_t *event, TickType_t timeout) {
+  if (hid_event_receive(id, event))
+    return true;
+
+  ulTaskNotifyTake(pdTRUE, timeout);
+  return hid_event_receive(id, event);
+}
+
+uint32_t hid_event_dropped(int8_t id) {
+  if (id < 0 || id >= HID_EVENT_MAX_SUBSCRIBERS)
+    return 0;
+
+  return subscribers[id].rejected + subscribers[id].overwritten;
+}
@@ -0,0 +1,50 @@
+#ifndef HID_EVENT_H
+#define HID_EVENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "hid_parser.h"
+#include "latency.h"
+
+#define HID_EVENT_MAX_SUBSCRIBERS       4
+#define HID_EVENT_QUEUE_LEN             16 // Records per subscriber, power of two
+#define HID_EVENT_MAX_VALUES            12 // Larger reports are split over several records
+
+/* Drop policies */
+#define HID_EVENT_LATEST                0 // A full queue overwrites its oldest records, for state like sticks
+#define HID_EVENT_LOSSLESS              1 // A full queue rejects new records and counts them, for keys
+
+/* hid_event_t flags */
+#define HID_EVENT_CONTINUED             (1 << 0) // More values of the same report follow in the next record
+
+typedef struct {
+  uint16_t handle; // ACL handle of the device
+  uint8_t device_class;
+  uint8_t report_id;
+  uint8_t flags;
+  uint8_t value_count;
+  latency_stamps_t stamps; // From the VHCI callback to the decode
+  hid_value_t values[HID_EVENT_MAX_VALUES];
+} hid_event_t;
+
+/* Registers a consumer. task is notified with xTaskNotifyGive() for every new record, NULL to poll.
+   Returns the subscriber id, -1 if all are taken. */
+int8_t hid_event_subscribe(uint8_t policy, TaskHandle_t task);
+void hid_event_unsubscribe(int8_t id);
+
+/* Copies the oldest record of a subscriber, false if there is none. Only the subscribing task may call it.
+   The time the record spent queued is added to the latency statistics. */
+bool hid_event_receive(int8_t id, hid_event_t *event);
+
+/* Like hid_event_receive(), but blocks on the task notification for up to timeout ticks */
+bool hid_event_wait(int8_t id, hid_event_t *event, TickType_t timeout);
+
+/* Records lost to overwriting or rejection since the subscriber was registered */
+uint32_t hid_event_dropped(int8_t id);
+
+/* Hands decoded values to every subscriber. Called by the decoder only, see hid_pipeline.h. */
+void hid_event_publish(uint16_t handle, uint8_t device_class, uint8_t report_id, const latency_stamps_t *stamps, const hid_value_t *values, uint8_t count);
+
+#endif
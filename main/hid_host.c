@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <string.h>
+#include "hid_host.h"
+#include "hid_driver.h"
+#include "hid_event.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "bt_link.h"
+
+static uint8_t protocol_policies[BT_DEVICE_CLASS_COUNT] = {
+  HID_PROTOCOL_REPORT, HID_PROTOCOL_REPORT, HID_PROTOCOL_REPORT, HID_PROTOCOL_REPORT
+};
+
+typedef struct {
+  bool in_use;
+  bool model; // Keyed by vendor and product, else by bdaddr
+  uint8_t bdaddr[6];
+  uint16_t vendor;
+  uint16_t product;
+  uint8_t protocol;
+} hid_protocol_override_t;
+
+static hid_protocol_override_t protocol_overrides[HID_MAX_PROTOCOL_OVERRIDES];
+static hid_device_t hid_devices[BT_MAX_LINKS];
+static hid_value_t hid_values[HID_MAX_VALUES];
+static SemaphoreHandle_t hid_lock = NULL; // Plan, protocol and in_use of the devices, see hid_host_init()
+static hid_plan_t hid_staging_plan; // Descriptors are compiled here, so decoding only waits for the copy
+
+static void hid_lock_take() {
+  if (hid_lock != NULL)
+    xSemaphoreTake(hid_lock, portMAX_DELAY);
+}
+
+static void hid_lock_give() {
+  if (hid_lock != NULL)
+    xSemaphoreGive(hid_lock);
+}
+
+bool hid_host_init() {
+  if (hid_lock == NULL)
+    hid_lock = xSemaphoreCreateMutex();
+
+  return hid_lock != NULL;
+}
+
+uint8_t hid_protocol_policy(uint8_t device_class) {
+  if (device_class >= BT_DEVICE_CLASS_COUNT)
+    return HID_PROTOCOL_REPORT;
+
+  return protocol_policies[device_class];
+}
+
+void hid_protocol_policy_set(uint8_t device_class, uint8_t protocol) {
+  if (device_class != BT_DEVICE_CLASS_KEYBOARD && device_class != BT_DEVICE_CLASS_MOUSE)
+    protocol = HID_PROTOCOL_REPORT; // Nothing else has a boot report
+
+  if (device_class < BT_DEVICE_CLASS_COUNT)
+    protocol_policies[device_class] = protocol;
+}
+
+static hid_protocol_override_t *hid_protocol_override_find(bool model, const uint8_t *bdaddr, uint16_t vendor, uint16_t product) {
+  for (uint8_t i = 0; i < HID_MAX_PROTOCOL_OVERRIDES; i++) {
+    hid_protocol_override_t *entry = &protocol_overrides[i];
+
+    if (!entry->in_use || entry->model != model)
+      continue;
+    if (model ? (entry->vendor == vendor && entry->product == product) : memcmp(entry->bdaddr, bdaddr, 6) == 0)
+      return entry;
+  }
+
+  return NULL;
+}
+
+static bool hid_protocol_override_set(bool model, const uint8_t *bdaddr, uint16_t vendor, uint16_t product, uint8_t protocol) {
+  hid_protocol_override_t *entry = hid_protocol_override_find(model, bdaddr, vendor, product);
+
+  for (uint8_t i = 0; entry == NULL && i < HID_MAX_PROTOCOL_OVERRIDES; i++) {
+    if (!protocol_overrides[i].in_use)
+      entry = &protocol_overrides[i];
+  }
+
+  if (entry == NULL)
+    return false;
+
+  entry->in_use = true;
+  entry->model = model;
+  if (bdaddr != NULL)
+    memcpy(entry->bdaddr, bdaddr, 6);
+  entry->vendor = vendor;
+  entry->product = product;
+  entry->protocol = protocol == HID_PROTOCOL_BOOT ? HID_PROTOCOL_BOOT : HID_PROTOCOL_REPORT;
+  return true;
+}
+
+bool hid_protocol_override_device(const uint8_t *bdaddr, uint8_t protocol) {
+  return hid_protocol_override_set(false, bdaddr, 0, 0, protocol);
+}
+
+bool hid_protocol_override_model(uint16_t vendor, uint16_t product, uint8_t protocol) {
+  return hid_protocol_override_set(true, NULL, vendor, product, protocol);
+}
+
+/* Device override, then model override, then the policy of the class */
+static uint8_t hid_device_protocol(const hid_device_t *device) {
+  bt_link_t *link = bt_link_find(device->handle);
+  hid_protocol_override_t *entry = NULL;
+
+  if (link != NULL)
+    entry = hid_protocol_override_find(false, link->bdaddr, 0, 0);
+  if (entry == NULL && device->vendor != 0)
+    entry = hid_protocol_override_find(true, NULL, device->vendor, device->product);
+  if (entry != NULL)
+    return entry->protocol;
+
+  return hid_protocol_policy(link != NULL ? link->device_class : BT_DEVICE_CLASS_OTHER);
+}
+
+hid_device_t *hid_device_open(uint16_t handle) {
+  hid_device_t *device = hid_device_find(handle);
+
+  for (uint8_t i = 0; device == NULL && i < BT_MAX_LINKS; i++) {
+    if (!hid_devices[i].in_use)
+      device = &hid_devices[i];
+  }
+
+  if (device == NULL)
+    return NULL;
+
+  hid_lock_take();
+  device->in_use = true;
+  device->handle = handle;
+  device->vendor_source = 0;
+  device->vendor = 0;
+  device->product = 0;
+  device->version = 0;
+  device->driver = NULL;
+  device->channels_up = false;
+  device->driver_started = false;
+  device->protocol = hid_device_protocol(device);
+  device->plan_ready = false;
+  memset(&device->last, 0, sizeof(device->last));
+  hid_lock_give();
+
+  return device;
+}
+
+hid_device_t *hid_device_find(uint16_t handle) {
+  for (uint8_t i = 0; i < BT_MAX_LINKS; i++) {
+    if (hid_devices[i].in_use && hid_devices[i].handle == handle)
+      return &hid_devices[i];
+  }
+
+  return NULL;
+}
+
+void hid_device_close(uint16_t handle) {
+  hid_lock_take();
+  hid_device_t *device = hid_device_find(handle);
+
+  if (device != NULL)
+    device->in_use = false;
+  hid_lock_give();
+}
+
+void hid_device_handshake(hid_device_t *device, uint8_t result) {
+  if (result != HID_HANDSHAKE_SUCCESSFUL && device->protocol == HID_PROTOCOL_BOOT) {
+#ifdef DEBUG_HID
+    printf("HID device refused boot protocol: 0x%x\n", result);
+#endif
+    hid_lock_take();
+    device->protocol = HID_PROTOCOL_REPORT;
+    hid_lock_give();
+  }
+}
+
+static void hid_driver_start(hid_device_t *device) {
+  if (!device->channels_up || device->driver == NULL || device->driver_started)
+    return;
+
+  device->driver_started = true;
+  if (device->driver->init != NULL)
+    device->driver->init(device);
+}
+
+bool hid_device_set_model(hid_device_t *device, uint16_t vendor_source, uint16_t vendor, uint16_t product, uint16_t version) {
+  device->vendor_source = vendor_source;
+  device->vendor = vendor;
+  device->product = product;
+  device->version = version;
+  device->driver = hid_driver_find(vendor, product);
+  if (!device->channels_up) { // SET_PROTOCOL has not been sent yet, so a model override still counts
+    hid_lock_take();
+    device->protocol = hid_device_protocol(device);
+    hid_lock_give();
+  }
+
+  if (device->driver == NULL)
+    return false;
+
+#ifdef DEBUG_HID
+  printf("HID driver %s for %04x:%04x\n", device->driver->name, vendor, product);
+#endif
+  bool ready = device->driver->descriptor != NULL;
+
+  if (ready) {
+    hid_lock_take();
+    device->plan = *device->driver->plan;
+    device->plan_ready = true;
+    memset(device->last.valid, 0, sizeof(device->last.valid));
+    hid_lock_give();
+  }
+
+  hid_driver_start(device);
+  return ready;
+}
+
+void hid_device_connected(hid_device_t *device) {
+  device->channels_up = true;
+  hid_driver_start(device);
+}
+
+bool hid_device_set_descriptor(hid_device_t *device, const uint8_t *desc, uint16_t length) {
+  bool ready = hid_plan_compile(&hid_staging_plan, desc, length);
+
+  hid_lock_take();
+  if (ready)
+    device->plan = hid_staging_plan;
+  device->plan_ready = ready;
+  memset(device->last.valid, 0, sizeof(device->last.valid));
+  hid_lock_give();
+
+#ifdef DEBUG_HID
+  printf("HID descriptor compiled: %d reports, %d fields\n", device->plan.report_count, device->plan.field_count);
+#endif
+  return device->plan_ready;
+}
+
+void hid_input_report(hid_device_t *device, const uint8_t *report, uint16_t length, latency_stamps_t *stamps) {
+  uint8_t count;
+
+  if (device->protocol == HID_PROTOCOL_BOOT) { // Boot reports use the first two slots of the report state
+    if (length > 0 && report[0] == HID_BOOT_KEYBOARD_ID)
+      count = hid_boot_keyboard_decode(report, length, device->last.data[0], hid_values, HID_MAX_VALUES);
+    else
+      count = hid_boot_mouse_decode(report, length, device->last.data[1], hid_values, HID_MAX_VALUES);
+  } else if (device->plan_ready) {
+    count = hid_plan_decode_changes(&device->plan, &device->last, report, length, hid_values, HID_MAX_VALUES);
+  } else {
+    return;
+  }
+
+  if (count == 0)
+    return;
+
+  stamps->decode = esp_timer_get_time();
+
+#ifdef PRINTREPORT
+  for (uint8_t i = 0; i < count; i++)
+    printf("%x:%x=%ld ", hid_values[i].usage_page, hid_values[i].usage, (long)hid_values[i].value);
+
+  printf("\n");
+#endif
+
+  // Boot reports always carry an ID, report protocol ones only if the descriptor uses them
+  uint8_t report_id = (device->protocol == HID_PROTOCOL_BOOT || device->plan.uses_report_ids) ? report[0] : 0;
+
+  bt_link_t *link = bt_link_find(device->handle);
+
+  hid_event_publish(device->handle, link != NULL ? link->device_class : BT_DEVICE_CLASS_OTHER, report_id, stamps, hid_values, count);
+}
+
+void hid_device_input(uint16_t handle, const uint8_t *report, uint16_t length, latency_stamps_t *stamps) {
+  hid_lock_take();
+  hid_device_t *device = hid_device_find(handle);
+
+  if (device != NULL && length > 0)
+    hid_input_report(device, report, length, stamps);
+  hid_lock_give();
+}
@@ -0,0 +1,85 @@
+#ifndef HID_HOST_H
+#define HID_HOST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hid_parser.h"
+#include "latency.h"
+
+#define HID_MAX_VALUES                  64 // Values decoded from one report
+#define HID_MAX_PROTOCOL_OVERRIDES      8
+
+/* HID transaction header types, sent as the first byte on the control and interrupt channels */
+#define HID_THDR_HANDSHAKE              0x00
+#define HID_THDR_SET_PROTOCOL           0x70
+#define HID_THDR_DATA_INPUT             0xA1
+
+#define HID_HANDSHAKE_SUCCESSFUL        0x00
+
+/* Protocol modes, also the parameter of SET_PROTOCOL */
+#define HID_PROTOCOL_BOOT               0x00
+#define HID_PROTOCOL_REPORT             0x01
+
+struct hid_driver;
+
+/* HID state of one connected device, indexed by its ACL handle */
+typedef struct {
+  bool in_use;
+  uint16_t handle;
+  uint16_t vendor_source; // From the Device ID record, all 0 if unknown
+  uint16_t vendor;
+  uint16_t product;
+  uint16_t version;
+  const struct hid_driver *driver; // NULL for the generic descriptor driven path
+  bool channels_up; // hid_device_connected() was called
+  bool driver_started; // init() of the driver has run
+  uint8_t protocol; // HID_PROTOCOL_*
+  bool plan_ready;
+  hid_plan_t plan;
+  hid_report_state_t last; // Previous reports, only changed fields are passed on
+} hid_device_t;
+
+/* Protocol used for new devices of a class. Boot protocol only covers keyboards and mice, but needs no
+   report descriptor, so SDP and descriptor parsing can be skipped. Report protocol is the default. */
+uint8_t hid_protocol_policy(uint8_t device_class);
+void hid_protocol_policy_set(uint8_t device_class, uint8_t protocol);
+
+/* Protocol for one device or one model, over the policy of its class. A device override wins over a model
+   override. The model is only known before the HID channels are up if a record of the device is stored, so
+   a model override takes effect from its second connection on. Return false if the table is full. */
+bool hid_protocol_override_device(const uint8_t *bdaddr, uint8_t protocol);
+bool hid_protocol_override_model(uint16_t vendor, uint16_t product, uint8_t protocol);
+
+/* Creates the lock shared with the decode task, before either task runs */
+bool hid_host_init();
+
+/* The functions below that change a device take the lock, so they can be called while the decode task
+   decodes reports of the same device */
+hid_device_t *hid_device_open(uint16_t handle);
+hid_device_t *hid_device_find(uint16_t handle);
+void hid_device_close(uint16_t handle);
+
+/* Answer to SET_PROTOCOL. A device refusing boot protocol stays in report protocol. */
+void hid_device_handshake(hid_device_t *device, uint8_t result);
+
+/* Looks up the driver for the model. Its precompiled layout replaces the descriptor of the device if it
+   has one; returns true in that case. A driver found after the HID channels came up is started here. */
+bool hid_device_set_model(hid_device_t *device, uint16_t vendor_source, uint16_t vendor, uint16_t product, uint16_t version);
+
+/* HID channels are up, starts the driver if the model is known by now. The init() of a driver runs once
+   per connection, whichever of the two comes last. */
+void hid_device_connected(hid_device_t *device);
+
+/* Compiles the report descriptor of the device once, reports are decoded with the result */
+bool hid_device_set_descriptor(hid_device_t *device, const uint8_t *desc, uint16_t length);
+
+/* Input report from the interrupt channel, without the HID transaction header. Reports that change
+   nothing are dropped here, the others are published to the hid_event subscribers with the stage times
+   of the packet. The caller holds the lock. */
+void hid_input_report(hid_device_t *device, const uint8_t *report, uint16_t length, latency_stamps_t *stamps);
+
+/* Looks the device up and decodes the report under the lock. Subscribers are called with the lock held,
+   so they must not call back into the functions above. */
+void hid_device_input(uint16_t handle, const uint8_t *report, uint16_t length, latency_stamps_t *stamps);
+
+#endif
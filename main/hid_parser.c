@@ -0,0 +1,835 @@
+#include <stdio.h>
+#include <string.h>
+#include "hid_parser.h"
+
+#ifdef HID_BENCHMARK
+#ifdef __XTENSA__
+#include "xtensa/hal.h"
+#define BENCHMARK_UNIT "cycles"
+#define benchmark_now() xthal_get_ccount()
+#else
+#include <time.h>
+#define BENCHMARK_UNIT "ns"
+static uint32_t benchmark_now() { // Hosted builds have no cycle counter, use the monotonic clock instead
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#endif
+#endif
+
+#define HID_MAX_REPORT_BITS             ((HID_MAX_REPORT_SIZE - 1) * 8) // After the report ID
+
+/* Item types */
+#define HID_ITEM_MAIN                   0
+#define HID_ITEM_GLOBAL                 1
+#define HID_ITEM_LOCAL                  2
+#define HID_ITEM_LONG                   0xFE
+
+/* Main item tags */
+#define HID_MAIN_INPUT                  0x8
+#define HID_MAIN_OUTPUT                 0x9
+#define HID_MAIN_COLLECTION             0xA
+#define HID_MAIN_FEATURE                0xB
+#define HID_MAIN_END_COLLECTION         0xC
+
+/* Global item tags */
+#define HID_GLOBAL_USAGE_PAGE           0x0
+#define HID_GLOBAL_LOGICAL_MIN          0x1
+#define HID_GLOBAL_LOGICAL_MAX          0x2
+#define HID_GLOBAL_REPORT_SIZE          0x7
+#define HID_GLOBAL_REPORT_ID            0x8
+#define HID_GLOBAL_REPORT_COUNT         0x9
+#define HID_GLOBAL_PUSH                 0xA
+#define HID_GLOBAL_POP                  0xB
+
+/* Local item tags */
+#define HID_LOCAL_USAGE                 0x0
+#define HID_LOCAL_USAGE_MIN             0x1
+#define HID_LOCAL_USAGE_MAX             0x2
+
+/* Input item flags */
+#define HID_INPUT_CONSTANT              (1 << 0)
+#define HID_INPUT_VARIABLE              (1 << 1)
+#define HID_INPUT_RELATIVE              (1 << 2)
+
+#define HID_MAX_USAGES                  16
+#define HID_GLOBAL_STACK_SIZE           4
+
+typedef struct {
+  uint16_t usage_page;
+  int32_t logical_min;
+  int32_t logical_max;
+  uint32_t report_size;
+  uint32_t report_count;
+  uint8_t report_id;
+} hid_globals_t;
+
+typedef struct {
+  uint32_t usages[HID_MAX_USAGES]; // Extended usages, page in the upper 16 bits if it was given
+  uint8_t usage_count;
+  uint32_t usage_min;
+  uint32_t usage_max;
+  bool has_min;
+  bool has_max;
+} hid_locals_t;
+
+/* Fields are collected in descriptor order and grouped per report afterwards. Kept out of the stack, which
+   is small on the Bluetooth task. */
+static hid_field_t scratch_fields[HID_MAX_FIELDS];
+static uint8_t scratch_report[HID_MAX_FIELDS];
+
+/* Raw field values of the report being decoded. Reports are decoded on one task only. */
+static int32_t decode_raw[HID_MAX_FIELDS];
+static uint8_t decode_report[HID_MAX_REPORT_SIZE];
+static uint32_t decode_changed[HID_MAX_REPORT_SIZE / 32]; // One bit per byte that differs from the previous report
+static uint32_t decode_emitted[HID_MAX_FIELDS / 32];      // One bit per field whose change was returned
+
+static uint32_t hid_item_unsigned(const uint8_t *data, uint8_t size) {
+  uint32_t value = 0;
+
+  for (uint8_t i = 0; i < size; i++)
+    value |= (uint32_t)data[i] << (8 * i);
+
+  return value;
+}
+
+static int32_t hid_item_signed(const uint8_t *data, uint8_t size) {
+  uint32_t value = hid_item_unsigned(data, size);
+
+  if (size == 1)
+    return (int8_t)value;
+  if (size == 2)
+    return (int16_t)value;
+
+  return (int32_t)value;
+}
+
+static hid_report_layout_t *hid_plan_layout(hid_plan_t *plan, uint8_t report_id) {
+  for (uint8_t i = 0; i < plan->report_count; i++) {
+    if (plan->reports[i].report_id == report_id)
+      return &plan->reports[i];
+  }
+
+  if (plan->report_count >= HID_MAX_REPORTS)
+    return NULL;
+
+  hid_report_layout_t *layout = &plan->reports[plan->report_count++];
+  memset(layout, 0, sizeof(*layout));
+  layout->report_id = report_id;
+
+  return layout;
+}
+
+static uint32_t hid_local_usage(const hid_locals_t *locals, uint32_t index) {
+  if (index < locals->usage_count)
+    return locals->usages[index];
+
+  if (locals->has_min) {
+    uint32_t usage = locals->usage_min + index;
+
+    if (locals->has_max && usage > locals->usage_max)
+      usage = locals->usage_max;
+
+    return usage;
+  }
+
+  if (locals->usage_count)
+    return locals->usages[locals->usage_count - 1];
+
+  return 0;
+}
+
+/* Adds the fields of one Input item. What does not fit in the plan is left out rather than failing the
+   whole descriptor: reports past HID_MAX_REPORTS are not decoded, a report longer than
+   HID_MAX_REPORT_SIZE is dropped in hid_plan_compile(), and fields past HID_MAX_FIELDS are skipped. */
+static void hid_plan_input(hid_plan_t *plan, const hid_globals_t *globals, const hid_locals_t *locals, uint32_t flags, uint16_t *field_count) {
+  hid_report_layout_t *layout = hid_plan_layout(plan, globals->report_id);
+
+  if (layout == NULL || layout->bit_length > HID_MAX_REPORT_BITS)
+    return;
+
+  uint32_t bits = globals->report_size * globals->report_count;
+
+  if (globals->report_size > HID_MAX_REPORT_BITS || globals->report_count > HID_MAX_REPORT_BITS || layout->bit_length + bits > HID_MAX_REPORT_BITS) {
+    layout->bit_length = HID_MAX_REPORT_BITS + 1; // Marks the report as too long
+    return;
+  }
+
+  // Constant items are padding, and fields wider than 32 bits are vendor blobs nobody decodes
+  if (!(flags & HID_INPUT_CONSTANT) && globals->report_size >= 1 && globals->report_size <= 32) {
+    for (uint32_t i = 0; i < globals->report_count && *field_count < HID_MAX_FIELDS; i++) {
+
+      hid_field_t *field = &scratch_fields[*field_count];
+      uint32_t usage = hid_local_usage(locals, (flags & HID_INPUT_VARIABLE) ? i : 0);
+
+      field->bit_offset = layout->bit_length + i * globals->report_size;
+      field->bit_size = globals->report_size;
+      field->flags = 0;
+      field->usage_page = (usage >> 16) ? (usage >> 16) : globals->usage_page;
+      field->usage = usage & 0xFFFF;
+      field->logical_min = globals->logical_min;
+      field->logical_max = globals->logical_max;
+
+      if (globals->logical_min < 0)
+        field->flags |= HID_FIELD_SIGNED;
+      if (flags & HID_INPUT_RELATIVE) {
+        field->flags |= HID_FIELD_RELATIVE;
+        layout->flags |= HID_FIELD_RELATIVE;
+      }
+      if (!(flags & HID_INPUT_VARIABLE))
+        field->flags |= HID_FIELD_ARRAY;
+
+      scratch_report[*field_count] = layout - plan->reports;
+      (*field_count)++;
+    }
+  }
+
+  layout->bit_length += bits;
+}
+
+/* Splits the fields of a report into batches that each fit in a single load */
+static void hid_plan_batch(hid_plan_t *plan, hid_report_layout_t *layout) {
+  layout->first_batch = plan->batch_count;
+
+  for (uint8_t i = 0; i < layout->field_count;) {
+    const hid_field_t *first = &plan->fields[layout->first_field + i];
+    hid_batch_t *batch = &plan->batches[plan->batch_count++];
+
+    batch->byte_offset = first->bit_offset >> 3;
+    batch->shift = first->bit_offset & 0x07;
+    batch->bit_size = first->bit_size;
+    batch->flags = first->flags & HID_FIELD_SIGNED;
+    batch->count = 1;
+
+    while (i + batch->count < layout->field_count) {
+      const hid_field_t *next = &plan->fields[layout->first_field + i + batch->count];
+
+      if (next->bit_size != first->bit_size || (next->flags & HID_FIELD_SIGNED) != (first->flags & HID_FIELD_SIGNED)
+          || next->bit_offset != first->bit_offset + batch->count * first->bit_size
+          || batch->shift + (batch->count + 1) * first->bit_size > 64)
+        break;
+
+      batch->count++;
+    }
+
+    if (batch->shift + batch->count * batch->bit_size > 32)
+      batch->flags |= HID_BATCH_WIDE;
+
+    i += batch->count;
+  }
+
+  layout->batch_count = plan->batch_count - layout->first_batch;
+}
+
+bool hid_plan_compile(hid_plan_t *plan, const uint8_t *desc, uint16_t length) {
+  hid_globals_t stack[HID_GLOBAL_STACK_SIZE];
+  uint8_t stack_depth = 0;
+  hid_globals_t globals;
+  hid_locals_t locals;
+  uint16_t field_count = 0;
+  uint16_t i = 0;
+
+  memset(plan, 0, sizeof(*plan));
+  memset(&globals, 0, sizeof(globals));
+  memset(&locals, 0, sizeof(locals));
+
+  while (i < length) {
+    uint8_t prefix = desc[i];
+
+    if (prefix == HID_ITEM_LONG) { // Long items are reserved, skip them
+      if (i + 3 > length)
+        return false;
+      i += 3 + desc[i + 1];
+      continue;
+    }
+
+    uint8_t size = prefix & 0x03;
+    if (size == 3)
+      size = 4;
+    uint8_t type = (prefix >> 2) & 0x03;
+    uint8_t tag = prefix >> 4;
+    const uint8_t *data = &desc[i + 1];
+
+    if (i + 1 + size > length)
+      return false;
+
+    uint32_t value = hid_item_unsigned(data, size);
+
+    switch (type) {
+      case HID_ITEM_MAIN:
+        if (tag == HID_MAIN_INPUT) {
+          hid_plan_input(plan, &globals, &locals, value, &field_count);
+        }
+        // Output and feature reports are not decoded, collections only group usages
+        memset(&locals, 0, sizeof(locals));
+        break;
+
+      case HID_ITEM_GLOBAL:
+        switch (tag) {
+          case HID_GLOBAL_USAGE_PAGE:
+            globals.usage_page = value;
+            break;
+          case HID_GLOBAL_LOGICAL_MIN:
+            globals.logical_min = hid_item_signed(data, size);
+            break;
+          case HID_GLOBAL_LOGICAL_MAX:
+            globals.logical_max = hid_item_signed(data, size);
+            break;
+          case HID_GLOBAL_REPORT_SIZE:
+            globals.report_size = value;
+            break;
+          case HID_GLOBAL_REPORT_ID:
+            if (value == 0 || value > 0xFF)
+              return false;
+            globals.report_id = value;
+            plan->uses_report_ids = true;
+            break;
+          case HID_GLOBAL_REPORT_COUNT:
+            globals.report_count = value;
+            break;
+          case HID_GLOBAL_PUSH:
+            if (stack_depth >= HID_GLOBAL_STACK_SIZE)
+              return false;
+            stack[stack_depth++] = globals;
+            break;
+          case HID_GLOBAL_POP:
+            if (stack_depth == 0)
+              return false;
+            globals = stack[--stack_depth];
+            break;
+        }
+
+        // A logical maximum like 0xFF in one byte is meant as 255 when the minimum is not negative
+        if (tag == HID_GLOBAL_LOGICAL_MAX && globals.logical_min >= 0)
+          globals.logical_max = value;
+        break;
+
+      case HID_ITEM_LOCAL:
+        switch (tag) {
+          case HID_LOCAL_USAGE:
+            if (locals.usage_count < HID_MAX_USAGES)
+              locals.usages[locals.usage_count++] = value;
+            break;
+          case HID_LOCAL_USAGE_MIN:
+            locals.usage_min = value;
+            locals.has_min = true;
+            break;
+          case HID_LOCAL_USAGE_MAX:
+            locals.usage_max = value;
+            locals.has_max = true;
+            break;
+        }
+        break;
+    }
+
+    i += 1 + size;
+  }
+
+  // Group the fields per report, keeping the descriptor order within each report. Reports that are too
+  // long are dropped, so hid_plan_find() does not know them.
+  uint8_t report_count = 0;
+
+  for (uint8_t r = 0; r < plan->report_count; r++) {
+    hid_report_layout_t *layout = &plan->reports[report_count];
+
+    if (plan->reports[r].bit_length > HID_MAX_REPORT_BITS)
+      continue;
+
+    *layout = plan->reports[r];
+    layout->first_field = plan->field_count;
+
+    for (uint16_t f = 0; f < field_count; f++) {
+      if (scratch_report[f] == r)
+        plan->fields[plan->field_count++] = scratch_fields[f];
+    }
+
+    layout->field_count = plan->field_count - layout->first_field;
+    hid_plan_batch(plan, layout);
+    report_count++;
+  }
+  plan->report_count = report_count;
+
+  return plan->report_count > 0;
+}
+
+const hid_report_layout_t *hid_plan_find(const hid_plan_t *plan, uint8_t report_id) {
+  for (uint8_t i = 0; i < plan->report_count; i++) {
+    if (plan->reports[i].report_id == report_id)
+      return &plan->reports[i];
+  }
+
+  return NULL;
+}
+
+int32_t hid_field_extract(const hid_field_t *field, const uint8_t *data, uint16_t length) {
+  uint16_t byte = field->bit_offset >> 3;
+  uint8_t shift = field->bit_offset & 0x07;
+  uint8_t bytes = (shift + field->bit_size + 7) >> 3;
+  uint64_t raw = 0;
+
+  for (uint8_t i = 0; i < bytes && byte + i < length; i++)
+    raw |= (uint64_t)data[byte + i] << (8 * i);
+
+  uint32_t mask = field->bit_size >= 32 ? 0xFFFFFFFF : ((1UL << field->bit_size) - 1);
+  uint32_t value = (uint32_t)(raw >> shift) & mask;
+
+  if ((field->flags & HID_FIELD_SIGNED) && field->bit_size < 32 && (value & (1UL << (field->bit_size - 1))))
+    value |= ~mask; // Sign extend
+
+  return (int32_t)value;
+}
+
+void hid_plan_extract_scalar(const hid_plan_t *plan, const hid_report_layout_t *layout, const uint8_t *data, uint16_t length, int32_t *raw) {
+  const hid_field_t *field = &plan->fields[layout->first_field];
+
+  for (uint8_t i = 0; i < layout->field_count; i++)
+    raw[i] = hid_field_extract(&field[i], data, length);
+}
+
+/* Little endian load of up to eight bytes. Bytes past the end of a short report read as zero. */
+static inline uint64_t hid_load64(const uint8_t *data, uint16_t length, uint8_t offset) {
+  uint8_t word[8] = { 0 };
+
+  if (offset + 8 <= length) {
+    memcpy(word, &data[offset], 8);
+  } else if (offset < length) {
+    memcpy(word, &data[offset], length - offset);
+  }
+
+  return (uint64_t)word[0] | ((uint64_t)word[1] << 8) | ((uint64_t)word[2] << 16) | ((uint64_t)word[3] << 24)
+       | ((uint64_t)word[4] << 32) | ((uint64_t)word[5] << 40) | ((uint64_t)word[6] << 48) | ((uint64_t)word[7] << 56);
+}
+
+static inline uint32_t hid_load32(const uint8_t *data, uint16_t length, uint8_t offset) {
+  uint8_t word[4] = { 0 };
+
+  if (offset + 4 <= length) {
+    memcpy(word, &data[offset], 4);
+  } else if (offset < length) {
+    memcpy(word, &data[offset], length - offset);
+  }
+
+  return (uint32_t)word[0] | ((uint32_t)word[1] << 8) | ((uint32_t)word[2] << 16) | ((uint32_t)word[3] << 24);
+}
+
+void hid_plan_extract(const hid_plan_t *plan, const hid_report_layout_t *layout, const uint8_t *data, uint16_t length, int32_t *raw) {
+  const hid_batch_t *batch = &plan->batches[layout->first_batch];
+
+  for (uint8_t b = 0; b < layout->batch_count; b++, batch++) {
+    uint8_t size = batch->bit_size;
+    uint8_t extend = 32 - size; // Shifting up and back down sign extends
+
+    if (batch->flags & HID_BATCH_WIDE) { // Xtensa has no 64-bit registers, so only use them when needed
+      uint64_t word = hid_load64(data, length, batch->byte_offset) >> batch->shift;
+      uint64_t mask = (1ULL << size) - 1;
+
+      for (uint8_t i = 0; i < batch->count; i++, word >>= size)
+        *raw++ = (batch->flags & HID_FIELD_SIGNED) ? ((int32_t)((uint32_t)(word & mask) << extend) >> extend) : (int32_t)(word & mask);
+    } else {
+      uint32_t word = hid_load32(data, length, batch->byte_offset) >> batch->shift;
+
+      if (size == 32) { // A shift by the full width is undefined
+        *raw++ = (int32_t)word;
+        continue;
+      }
+
+      uint32_t mask = (1UL << size) - 1;
+
+      for (uint8_t i = 0; i < batch->count; i++, word >>= size)
+        *raw++ = (batch->flags & HID_FIELD_SIGNED) ? ((int32_t)((word & mask) << extend) >> extend) : (int32_t)(word & mask);
+    }
+  }
+}
+
+uint8_t hid_plan_decode(const hid_plan_t *plan, const uint8_t *report, uint16_t length, hid_value_t *values, uint8_t max_values) {
+  uint8_t report_id = 0;
+
+  if (plan->uses_report_ids) {
+    if (length == 0)
+      return 0;
+    report_id = report[0];
+    report++;
+    length--;
+  }
+
+  const hid_report_layout_t *layout = hid_plan_find(plan, report_id);
+
+  if (layout == NULL)
+    return 0;
+
+  uint8_t count = 0;
+  const hid_field_t *field = &plan->fields[layout->first_field];
+
+  hid_plan_extract(plan, layout, report, length, decode_raw);
+
+  for (uint8_t i = 0; i < layout->field_count && count < max_values; i++, field++) {
+    int32_t value = decode_raw[i];
+
+    if (field->flags & HID_FIELD_ARRAY) { // The value selects a usage, out of range or usage 0 means none
+      if (value < field->logical_min || value > field->logical_max || field->usage + (value - field->logical_min) == 0)
+        continue;
+      values[count].usage_page = field->usage_page;
+      values[count].usage = field->usage + (value - field->logical_min);
+      values[count].value = 1;
+    } else {
+      values[count].usage_page = field->usage_page;
+      values[count].usage = field->usage;
+      values[count].value = value;
+    }
+    count++;
+  }
+
+  return count;
+}
+
+/* Sets a bit in changed for every byte that differs, comparing a word at a time. Returns false if the
+   reports are identical. */
+static bool hid_report_diff(const uint8_t *report, const uint8_t *previous, uint16_t length, uint32_t *changed) {
+  bool any = false;
+
+  memset(changed, 0, HID_MAX_REPORT_SIZE / 8);
+
+  for (uint16_t i = 0; i < length; i += 4) {
+    uint32_t a = 0, b = 0;
+    uint8_t n = length - i < 4 ? length - i : 4;
+
+    memcpy(&a, &report[i], n);
+    memcpy(&b, &previous[i], n);
+
+    uint32_t diff = a ^ b;
+
+    if (diff == 0)
+      continue;
+
+    // The ESP32 is little endian, so the low byte of the word is the first byte of the report
+    for (uint8_t j = 0; j < n; j++, diff >>= 8) {
+      if (diff & 0xFF)
+        changed[(i + j) >> 5] |= 1UL << ((i + j) & 31);
+    }
+    any = true;
+  }
+
+  return any;
+}
+
+static bool hid_field_changed(const hid_field_t *field, const uint32_t *changed) {
+  uint16_t first = field->bit_offset >> 3;
+  uint16_t last = (field->bit_offset + field->bit_size - 1) >> 3;
+
+  for (uint16_t i = first; i <= last; i++) {
+    if (changed[i >> 5] & (1UL << (i & 31)))
+      return true;
+  }
+
+  return false;
+}
+
+/* Usage selected by an array field, 0 if none */
+static uint16_t hid_array_usage(const hid_field_t *field, int32_t value) {
+  if (value < field->logical_min || value > field->logical_max)
+    return 0;
+
+  return field->usage + (value - field->logical_min);
+}
+
+static bool hid_array_contains(const hid_plan_t *plan, const hid_report_layout_t *layout, const uint8_t *data, uint16_t length, uint16_t usage_page, uint16_t usage) {
+  const hid_field_t *field = &plan->fields[layout->first_field];
+
+  for (uint8_t i = 0; i < layout->field_count; i++, field++) {
+    if ((field->flags & HID_FIELD_ARRAY) && field->usage_page == usage_page && hid_array_usage(field, hid_field_extract(field, data, length)) == usage)
+      return true;
+  }
+
+  return false;
+}
+
+/* Copies the bits of one field into the stored report */
+static void hid_field_store(const hid_field_t *field, uint8_t *previous, const uint8_t *report) {
+  for (uint16_t bit = field->bit_offset; bit < field->bit_offset + field->bit_size; bit++) {
+    uint8_t mask = 1 << (bit & 0x07);
+    previous[bit >> 3] = (previous[bit >> 3] & ~mask) | (report[bit >> 3] & mask);
+  }
+}
+
+uint8_t hid_plan_decode_changes(const hid_plan_t *plan, hid_report_state_t *state, const uint8_t *report, uint16_t length, hid_value_t *values, uint8_t max_values) {
+  uint8_t report_id = 0;
+
+  if (plan->uses_report_ids) {
+    if (length == 0)
+      return 0;
+    report_id = report[0];
+    report++;
+    length--;
+  }
+
+  const hid_report_layout_t *layout = hid_plan_find(plan, report_id);
+
+  if (layout == NULL)
+    return 0;
+
+  uint8_t index = layout - plan->reports;
+  uint8_t *previous = state->data[index];
+  uint16_t bytes = (layout->bit_length + 7) >> 3;
+
+  // Pad short reports so they compare the same way every time
+  memset(decode_report, 0, bytes);
+  memcpy(decode_report, report, length < bytes ? length : bytes);
+
+  if (!state->valid[index]) {
+    memset(previous, 0, bytes);
+    memset(decode_changed, 0xFF, sizeof(decode_changed)); // Everything is new
+  } else if (!hid_report_diff(decode_report, previous, bytes, decode_changed) && !(layout->flags & HID_FIELD_RELATIVE)) {
+    return 0; // The same movement twice is still movement, so only reports without relative fields are dropped
+  }
+
+  uint8_t count = 0;
+  bool arrays_changed = false;
+  bool truncated = false;
+  const hid_field_t *field = &plan->fields[layout->first_field];
+
+  hid_plan_extract(plan, layout, decode_report, bytes, decode_raw);
+  memset(decode_emitted, 0, sizeof(decode_emitted));
+
+  for (uint8_t i = 0; i < layout->field_count; i++, field++) {
+    if (field->flags & HID_FIELD_ARRAY) { // Handled below, entries can move between array fields
+      if (hid_field_changed(field, decode_changed))
+        arrays_changed = true;
+      continue;
+    }
+
+    if (field->flags & HID_FIELD_RELATIVE) { // Like the boot mouse, only movement is reported
+      if (decode_raw[i] == 0)
+        continue;
+    } else if (!hid_field_changed(field, decode_changed)) {
+      continue;
+    } else if (state->valid[index] && hid_field_extract(field, previous, bytes) == decode_raw[i]) {
+      continue; // Bits packed into a changed byte, like buttons, may still hold their old value
+    }
+
+    if (count >= max_values) {
+      truncated = true;
+      break;
+    }
+
+    values[count].usage_page = field->usage_page;
+    values[count].usage = field->usage;
+    values[count].value = decode_raw[i];
+    count++;
+    decode_emitted[i >> 5] |= 1UL << (i & 31);
+  }
+
+  if (arrays_changed && !truncated) {
+    field = &plan->fields[layout->first_field];
+
+    for (uint8_t i = 0; i < layout->field_count; i++, field++) {
+      if (!(field->flags & HID_FIELD_ARRAY) || !hid_field_changed(field, decode_changed))
+        continue;
+
+      uint16_t released = hid_array_usage(field, hid_field_extract(field, previous, bytes));
+      uint16_t pressed = hid_array_usage(field, decode_raw[i]);
+
+      released = (released != 0 && state->valid[index] && !hid_array_contains(plan, layout, decode_report, bytes, field->usage_page, released)) ? released : 0;
+      pressed = (pressed != 0 && !hid_array_contains(plan, layout, previous, bytes, field->usage_page, pressed)) ? pressed : 0;
+
+      // A release and press of the same entry go out together, so neither is repeated with the next report
+      if (count + (released != 0) + (pressed != 0) > max_values) {
+        truncated = true;
+        break;
+      }
+
+      if (released != 0) {
+        values[count].usage_page = field->usage_page;
+        values[count].usage = released;
+        values[count].value = 0;
+        count++;
+      }
+
+      if (pressed != 0) {
+        values[count].usage_page = field->usage_page;
+        values[count].usage = pressed;
+        values[count].value = 1;
+        count++;
+      }
+      decode_emitted[i >> 5] |= 1UL << (i & 31);
+    }
+  }
+
+  if (truncated) { // Fields that did not fit keep their old value, so they still differ next time
+    field = &plan->fields[layout->first_field];
+
+    for (uint8_t i = 0; i < layout->field_count; i++, field++) {
+      if (decode_emitted[i >> 5] & (1UL << (i & 31)))
+        hid_field_store(field, previous, decode_report);
+    }
+  } else {
+    memcpy(previous, decode_report, bytes);
+  }
+  state->valid[index] = true;
+
+  return count;
+}
+
+static void hid_value_set(hid_value_t *value, uint16_t usage_page, uint16_t usage, int32_t v) {
+  value->usage_page = usage_page;
+  value->usage = usage;
+  value->value = v;
+}
+
+static bool hid_boot_key_down(const uint8_t *keys, uint8_t key) {
+  for (uint8_t i = 0; i < 6; i++) {
+    if (keys[i] == key)
+      return true;
+  }
+
+  return false;
+}
+
+uint8_t hid_boot_keyboard_decode(const uint8_t *report, uint16_t length, uint8_t *previous, hid_value_t *values, uint8_t max_values) {
+  if (length < 1 + HID_BOOT_KEYBOARD_SIZE || report[0] != HID_BOOT_KEYBOARD_ID)
+    return 0;
+
+  const uint8_t *keys = &report[3];
+  uint8_t count = 0;
+  uint8_t modifiers = report[1] ^ previous[0];
+
+  for (uint8_t i = 0; i < 8 && count < max_values; i++) {
+    if (modifiers & (1 << i))
+      hid_value_set(&values[count++], 0x07, 0xE0 + i, (report[1] >> i) & 0x01); // Left Control to Right GUI
+  }
+
+  // Key codes 0 to 3 mean no key, rollover and errors
+  for (uint8_t i = 0; i < 6 && count < max_values; i++) {
+    if (previous[2 + i] > 0x03 && !hid_boot_key_down(keys, previous[2 + i]))
+      hid_value_set(&values[count++], 0x07, previous[2 + i], 0);
+  }
+
+  for (uint8_t i = 0; i < 6 && count < max_values; i++) {
+    if (keys[i] > 0x03 && !hid_boot_key_down(&previous[2], keys[i]))
+      hid_value_set(&values[count++], 0x07, keys[i], 1);
+  }
+
+  if (keys[0] != 0x01) // Keep the last real state through a rollover report
+    memcpy(previous, &report[1], HID_BOOT_KEYBOARD_SIZE);
+
+  return count;
+}
+
+uint8_t hid_boot_mouse_decode(const uint8_t *report, uint16_t length, uint8_t *previous, hid_value_t *values, uint8_t max_values) {
+  if (length < 4 || report[0] != HID_BOOT_MOUSE_ID)
+    return 0;
+
+  uint8_t count = 0;
+  uint8_t buttons = report[1] ^ previous[0];
+
+  for (uint8_t i = 0; i < 3 && count < max_values; i++) {
+    if (buttons & (1 << i))
+      hid_value_set(&values[count++], 0x09, i + 1, (report[1] >> i) & 0x01);
+  }
+  previous[0] = report[1];
+
+  // Axes are relative, so only movement is reported
+  if (report[2] && count < max_values)
+    hid_value_set(&values[count++], 0x01, 0x30, (int8_t)report[2]);
+  if (report[3] && count < max_values)
+    hid_value_set(&values[count++], 0x01, 0x31, (int8_t)report[3]);
+  if (length > 4 && report[4] && count < max_values) // The wheel is not part of the boot report, but most mice send it
+    hid_value_set(&values[count++], 0x01, 0x38, (int8_t)report[4]);
+
+  return count;
+}
+
+#ifdef HID_BENCHMARK
+/* Generic gamepad: 16 buttons, hat switch, four 8-bit sticks and two 8-bit triggers */
+static const uint8_t benchmark_generic[] = {
+  0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0x85, 0x01,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x10, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x10, 0x81, 0x02,
+  0x05, 0x01, 0x09, 0x39, 0x15, 0x00, 0x25, 0x07, 0x75, 0x04, 0x95, 0x01, 0x81, 0x42,
+  0x75, 0x04, 0x95, 0x01, 0x81, 0x01,
+  0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09, 0x35, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x04, 0x81, 0x02,
+  0x05, 0x02, 0x09, 0xC5, 0x09, 0xC4, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x02, 0x81, 0x02,
+  0xC0
+};
+
+/* Input report 0x01 of a DualShock 4 over Bluetooth: sticks, hat, 14 buttons, a 6-bit counter, triggers */
+static const uint8_t benchmark_ds4[] = {
+  0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0x85, 0x01,
+  0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09, 0x35, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x04, 0x81, 0x02,
+  0x09, 0x39, 0x15, 0x00, 0x25, 0x07, 0x75, 0x04, 0x95, 0x01, 0x81, 0x42,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x0E, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x0E, 0x81, 0x02,
+  0x06, 0x00, 0xFF, 0x09, 0x20, 0x15, 0x00, 0x25, 0x7F, 0x75, 0x06, 0x95, 0x01, 0x81, 0x02,
+  0x05, 0x01, 0x09, 0x33, 0x09, 0x34, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x02, 0x81, 0x02,
+  0xC0
+};
+
+/* Nintendo style pad: 12-bit sticks packed back to back between button bytes */
+static const uint8_t benchmark_packed[] = {
+  0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0x85, 0x30,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x18, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x18, 0x81, 0x02,
+  0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x33, 0x09, 0x34, 0x15, 0x00, 0x26, 0xFF, 0x0F, 0x75, 0x0C, 0x95, 0x04, 0x81, 0x02,
+  0xC0
+};
+
+static hid_plan_t benchmark_plan;
+static int32_t benchmark_scalar[HID_MAX_FIELDS];
+static int32_t benchmark_batched[HID_MAX_FIELDS];
+
+static void hid_benchmark_run(const char *name, const uint8_t *desc, uint16_t desc_length) {
+  const uint16_t iterations = 1000;
+  uint8_t report[16];
+  uint32_t sum = 0;
+
+  uint32_t start = benchmark_now();
+  bool ok = hid_plan_compile(&benchmark_plan, desc, desc_length);
+  uint32_t compile_cycles = benchmark_now() - start;
+
+  if (!ok) {
+    printf("HID benchmark %s: descriptor did not compile\n", name);
+    return;
+  }
+
+  const hid_report_layout_t *layout = &benchmark_plan.reports[0];
+  uint16_t length = (layout->bit_length + 7) / 8;
+
+  for (uint8_t i = 0; i < sizeof(report); i++)
+    report[i] = 0x5A ^ (i * 37);
+
+  // Both kernels have to agree before their timings mean anything
+  for (uint16_t i = 0; i < 256; i++) {
+    report[i % length] = i * 13;
+    hid_plan_extract_scalar(&benchmark_plan, layout, report, length, benchmark_scalar);
+    hid_plan_extract(&benchmark_plan, layout, report, length, benchmark_batched);
+
+    if (memcmp(benchmark_scalar, benchmark_batched, layout->field_count * sizeof(int32_t)) != 0) {
+      printf("HID benchmark %s: batched extraction differs from scalar\n", name);
+      return;
+    }
+  }
+
+  start = benchmark_now();
+  for (uint16_t i = 0; i < iterations; i++) {
+    report[0] = i; // Keep the compiler from hoisting the extraction
+    hid_plan_extract_scalar(&benchmark_plan, layout, report, length, benchmark_scalar);
+    sum += benchmark_scalar[0];
+  }
+  uint32_t scalar_cycles = benchmark_now() - start;
+
+  start = benchmark_now();
+  for (uint16_t i = 0; i < iterations; i++) {
+    report[0] = i;
+    hid_plan_extract(&benchmark_plan, layout, report, length, benchmark_batched);
+    sum += benchmark_batched[0];
+  }
+  uint32_t batched_cycles = benchmark_now() - start;
+
+  printf("HID benchmark %s: compile %lu " BENCHMARK_UNIT ", %u fields in %u batches, scalar %lu " BENCHMARK_UNIT "/report, batched %lu " BENCHMARK_UNIT "/report (%lu)\n",
+         name, (unsigned long)compile_cycles, layout->field_count, layout->batch_count,
+         (unsigned long)(scalar_cycles / iterations), (unsigned long)(batched_cycles / iterations), (unsigned long)sum);
+}
+
+void hid_plan_benchmark() {
+  hid_benchmark_run("generic", benchmark_generic, sizeof(benchmark_generic));
+  hid_benchmark_run("ds4", benchmark_ds4, sizeof(benchmark_ds4));
+  hid_benchmark_run("packed", benchmark_packed, sizeof(benchmark_packed));
+}
+#endif
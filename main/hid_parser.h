@@ -0,0 +1,118 @@
+#ifndef HID_PARSER_H
+#define HID_PARSER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HID_MAX_REPORTS                 8
+#define HID_MAX_FIELDS                  128
+#define HID_MAX_REPORT_SIZE             128 // Bytes, including the report ID
+
+/* hid_field_t flags */
+#define HID_FIELD_SIGNED                (1 << 0)
+#define HID_FIELD_RELATIVE              (1 << 1)
+#define HID_FIELD_ARRAY                 (1 << 2) // Value is an index into the usage range starting at usage
+
+/* One value in an input report */
+typedef struct {
+  uint16_t bit_offset; // From the first byte after the report ID
+  uint8_t bit_size;    // 1 to 32
+  uint8_t flags;
+  uint16_t usage_page;
+  uint16_t usage;
+  int32_t logical_min;
+  int32_t logical_max;
+} hid_field_t;
+
+/* Run of fields with the same size and signedness packed back to back. All of them are extracted from
+   one 32 or 64-bit load with shifts and masks. */
+typedef struct {
+  uint8_t byte_offset; // First byte of the load
+  uint8_t shift;       // Bit position of the first field in the load
+  uint8_t bit_size;
+  uint8_t count;
+  uint8_t flags;       // HID_FIELD_SIGNED, HID_BATCH_WIDE
+} hid_batch_t;
+
+#define HID_BATCH_WIDE                  (1 << 7) // Needs a 64-bit load
+
+typedef struct {
+  uint8_t report_id;   // 0 if the descriptor does not use report IDs
+  uint16_t bit_length;
+  uint8_t first_field; // Index into hid_plan_t.fields
+  uint8_t field_count;
+  uint8_t first_batch; // Index into hid_plan_t.batches
+  uint8_t batch_count;
+  uint8_t flags;       // HID_FIELD_RELATIVE if any field is relative
+} hid_report_layout_t;
+
+/* A report descriptor compiled into a flat list of fields per input report, so decoding a report is a
+   single walk over its fields without looking at the descriptor again */
+typedef struct {
+  bool uses_report_ids;
+  uint8_t report_count;
+  hid_report_layout_t reports[HID_MAX_REPORTS];
+  uint8_t field_count;
+  hid_field_t fields[HID_MAX_FIELDS];
+  uint8_t batch_count;
+  hid_batch_t batches[HID_MAX_FIELDS];
+} hid_plan_t;
+
+typedef struct {
+  uint16_t usage_page;
+  uint16_t usage;
+  int32_t value;
+} hid_value_t;
+
+/* Last report received for each report of a plan, used to find the fields that changed */
+typedef struct {
+  bool valid[HID_MAX_REPORTS];
+  uint8_t data[HID_MAX_REPORTS][HID_MAX_REPORT_SIZE];
+} hid_report_state_t;
+
+/* Returns false if the descriptor is malformed or has no input report that fits in the plan. Reports and
+   fields beyond the limits above are left out. */
+bool hid_plan_compile(hid_plan_t *plan, const uint8_t *desc, uint16_t length);
+
+const hid_report_layout_t *hid_plan_find(const hid_plan_t *plan, uint8_t report_id);
+
+/* Extracts a single field from the report data following the report ID */
+int32_t hid_field_extract(const hid_field_t *field, const uint8_t *data, uint16_t length);
+
+/* Extracts the raw value of every field in a report from the data following the report ID, one field
+   after the other. Reference for hid_plan_extract(). */
+void hid_plan_extract_scalar(const hid_plan_t *plan, const hid_report_layout_t *layout, const uint8_t *data, uint16_t length, int32_t *raw);
+
+/* Same result as hid_plan_extract_scalar(), but extracts whole batches of fields per word */
+void hid_plan_extract(const hid_plan_t *plan, const hid_report_layout_t *layout, const uint8_t *data, uint16_t length, int32_t *raw);
+
+/* Decodes an input report, starting with its report ID if the descriptor uses them. Returns the number of
+   values written, at most max_values. */
+uint8_t hid_plan_decode(const hid_plan_t *plan, const uint8_t *report, uint16_t length, hid_value_t *values, uint8_t max_values);
+
+/* Like hid_plan_decode(), but only returns the fields whose bytes differ from the previous report with the
+   same ID, and then stores the report in state. Array entries come out as usage presses (value 1) and
+   releases (value 0). Relative fields are movement, so they are returned whenever they are not zero, even
+   if the previous report was the same. If the changes do not fit in max_values, only the fields that were
+   returned are stored, and the rest come out with the next report. */
+uint8_t hid_plan_decode_changes(const hid_plan_t *plan, hid_report_state_t *state, const uint8_t *report, uint16_t length, hid_value_t *values, uint8_t max_values);
+
+/* Boot protocol reports have a fixed layout, so they are decoded without a plan. Both take the report
+   starting with its report ID and the previous report of the same kind, which they update, and return
+   only what changed, like hid_plan_decode_changes(). */
+#define HID_BOOT_KEYBOARD_ID            0x01
+#define HID_BOOT_MOUSE_ID               0x02
+#define HID_BOOT_KEYBOARD_SIZE          8 // Modifiers, reserved, six key codes
+#define HID_BOOT_MOUSE_SIZE             4 // Buttons, X, Y and an optional wheel
+
+uint8_t hid_boot_keyboard_decode(const uint8_t *report, uint16_t length, uint8_t *previous, hid_value_t *values, uint8_t max_values);
+uint8_t hid_boot_mouse_decode(const uint8_t *report, uint16_t length, uint8_t *previous, hid_value_t *values, uint8_t max_values);
+
+#ifdef HID_BENCHMARK
+/* Compiles three gamepad descriptors and times 1000 extractions of a report of each, scalar and batched.
+   Counts CPU cycles on the ESP32, where app_main calls it. A hosted build counts nanoseconds, e.g.
+   gcc -O2 -DHID_BENCHMARK hid_parser.c with a main() that calls it. */
+void hid_plan_benchmark();
+#endif
+
+#endif
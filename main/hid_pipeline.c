@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#include "hid_host.h"
+#include "hid_pipeline.h"
+
+/* Single producer ring: the VHCI callback writes reports, the decode task reads them. A slot is only
+   written while it is outside head..tail, so the indices are all that is shared. */
+typedef struct {
+  uint16_t handle;
+  uint16_t length;
+  latency_stamps_t stamps;
+  uint8_t data[HID_MAX_REPORT_SIZE];
+} hid_raw_report_t;
+
+static hid_raw_report_t queue[HID_PIPELINE_QUEUE_LEN];
+static volatile uint32_t queue_head; // Written by the producer only
+static volatile uint32_t queue_tail; // Written by the consumer only
+static volatile uint32_t dropped;
+
+static TaskHandle_t decode_task = NULL;
+
+#define load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static void hid_decode_task(void *pvParameters) {
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    uint32_t tail = queue_tail;
+
+    while (tail != load_acquire(&queue_head)) {
+      hid_raw_report_t *raw = &queue[tail & (HID_PIPELINE_QUEUE_LEN - 1)];
+
+      hid_device_input(raw->handle, raw->data, raw->length, &raw->stamps);
+      store_release(&queue_tail, ++tail);
+    }
+  }
+}
+
+bool hid_pipeline_start(const hid_pipeline_config_t *config, TaskFunction_t radio_task) {
+  if (!hid_host_init()) {
+    printf("HID lock could not be created\n");
+    return false;
+  }
+
+  if (config->split && xTaskCreatePinnedToCore(&hid_decode_task, "hidDecodeTask", config->decode_stack, NULL,
+      config->decode_priority, &decode_task, config->decode_core) != pdPASS) {
+    printf("HID decode task could not be created, decoding reports as they arrive\n");
+    decode_task = NULL;
+  }
+
+  return xTaskCreatePinnedToCore(radio_task, "mainTask", config->radio_stack, NULL, config->radio_priority,
+    NULL, config->radio_core) == pdPASS;
+}
+
+void hid_pipeline_submit(uint16_t handle, const uint8_t *report, uint16_t length, const latency_stamps_t *stamps) {
+  if (decode_task == NULL) { // Not split, decode right here
+    latency_stamps_t local = *stamps;
+    hid_device_input(handle, report, length, &local);
+    return;
+  }
+
+  uint32_t head = queue_head;
+
+  if (length > HID_MAX_REPORT_SIZE || head - load_acquire(&queue_tail) >= HID_PIPELINE_QUEUE_LEN) {
+    dropped++;
+    return;
+  }
+
+  hid_raw_report_t *raw = &queue[head & (HID_PIPELINE_QUEUE_LEN - 1)];
+  raw->handle = handle;
+  raw->length = length;
+  raw->stamps = *stamps;
+  memcpy(raw->data, report, length);
+  store_release(&queue_head, head + 1);
+
+  xTaskNotifyGive(decode_task);
+}
+
+uint32_t hid_pipeline_dropped() {
+  return dropped;
+}
@@ -0,0 +1,47 @@
+#ifndef HID_PIPELINE_H
+#define HID_PIPELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "hid_parser.h"
+#include "latency.h"
+
+#define HID_PIPELINE_QUEUE_LEN          32 // Raw reports between the radio and decode tasks, power of two
+
+/* Where the Bluetooth work runs. The radio task runs the HCI and L2CAP state machines next to the VHCI
+   callback. With split set, input reports are copied raw into a queue and decoded, filtered and delivered
+   by a task of their own, so decoding many devices does not hold up controller events. */
+typedef struct {
+  bool split;
+  BaseType_t radio_core;
+  UBaseType_t radio_priority;
+  uint32_t radio_stack;
+  BaseType_t decode_core;
+  UBaseType_t decode_priority;
+  uint32_t decode_stack;
+} hid_pipeline_config_t;
+
+#define HID_PIPELINE_CONFIG_DEFAULT() { \
+  .split = true,                        \
+  .radio_core = 0,                      \
+  .radio_priority = 5,                  \
+  .radio_stack = 2048,                  \
+  .decode_core = 1,                     \
+  .decode_priority = 4,                 \
+  .decode_stack = 4096,                 \
+}
+
+/* Creates the radio task running radio_task and, if the pipeline is split, the decode task. If the decode
+   task cannot be created, reports are decoded as they arrive like with an unsplit pipeline. Returns false
+   if the radio task could not be created. */
+bool hid_pipeline_start(const hid_pipeline_config_t *config, TaskFunction_t radio_task);
+
+/* Hands an input report, starting with its report ID, to the decoder. Called from the VHCI callback only.
+   Reports that find the queue full are dropped and counted. */
+void hid_pipeline_submit(uint16_t handle, const uint8_t *report, uint16_t length, const latency_stamps_t *stamps);
+
+uint32_t hid_pipeline_dropped();
+
+#endif
@@ -0,0 +1,217 @@
+#include <string.h>
+#include "l2cap_config.h"
+
+#define READ_UINT16(p) ((uint16_t)((p)[0] | ((p)[1] << 8)))
+#define READ_UINT32(p) ((uint32_t)((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((uint32_t)(p)[3] << 24)))
+
+#define WRITE_UINT16(p, v) { *(p)++ = (uint8_t)(v); *(p)++ = (uint8_t)((v) >> 8); }
+#define WRITE_UINT32(p, v) { *(p)++ = (uint8_t)(v); *(p)++ = (uint8_t)((v) >> 8); *(p)++ = (uint8_t)((v) >> 16); *(p)++ = (uint8_t)((v) >> 24); }
+
+void l2cap_config_defaults(l2cap_config_t *cfg) {
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->mtu = L2CAP_DEFAULT_MTU;
+  cfg->flush_timeout = L2CAP_FLUSH_TIMEOUT_INFINITE;
+  cfg->qos.service_type = L2CAP_QOS_BEST_EFFORT;
+  cfg->qos.token_bucket_size = 0;
+  cfg->qos.peak_bandwidth = 0;
+  cfg->qos.latency = 0xFFFFFFFF; // Don't care
+  cfg->qos.delay_variation = 0xFFFFFFFF;
+  cfg->rfc.mode = L2CAP_MODE_BASIC;
+  cfg->fcs = L2CAP_FCS_16BIT;
+}
+
+void l2cap_channel_init(l2cap_channel_t *channel, uint16_t mtu, uint16_t flush_timeout) {
+  l2cap_config_defaults(&channel->local);
+  l2cap_config_defaults(&channel->remote);
+  channel->config_attempts = 0;
+
+  channel->local.mtu = mtu;
+  channel->local.options = L2CAP_CFG_MTU;
+
+  if (flush_timeout != L2CAP_FLUSH_TIMEOUT_INFINITE) {
+    channel->local.flush_timeout = flush_timeout;
+    channel->local.options |= L2CAP_CFG_FLUSH_TIMEOUT;
+  }
+}
+
+static bool l2cap_config_known(uint8_t type) {
+  type &= ~L2CAP_CFG_TYPE_HINT;
+  return type >= L2CAP_CFG_TYPE_MTU && type <= L2CAP_CFG_TYPE_FCS;
+}
+
+uint16_t l2cap_config_parse(const uint8_t *data, uint16_t length, l2cap_config_t *cfg) {
+  uint16_t i = 0;
+
+  while (i < length) {
+    if (i + 2 > length)
+      return L2CAP_CFG_REJECTED;
+
+    uint8_t type = data[i];
+    uint8_t len = data[i + 1];
+    const uint8_t *p = &data[i + 2];
+
+    if (i + 2 + len > length)
+      return L2CAP_CFG_REJECTED;
+
+    switch (type & ~L2CAP_CFG_TYPE_HINT) {
+      case L2CAP_CFG_TYPE_MTU:
+        if (len != 2)
+          return L2CAP_CFG_REJECTED;
+        cfg->mtu = READ_UINT16(p);
+        cfg->options |= L2CAP_CFG_MTU;
+        break;
+
+      case L2CAP_CFG_TYPE_FLUSH_TIMEOUT:
+        if (len != 2)
+          return L2CAP_CFG_REJECTED;
+        cfg->flush_timeout = READ_UINT16(p);
+        cfg->options |= L2CAP_CFG_FLUSH_TIMEOUT;
+        break;
+
+      case L2CAP_CFG_TYPE_QOS:
+        if (len != 22)
+          return L2CAP_CFG_REJECTED;
+        // p[0] is a reserved flags byte
+        cfg->qos.service_type = p[1];
+        cfg->qos.token_rate = READ_UINT32(&p[2]);
+        cfg->qos.token_bucket_size = READ_UINT32(&p[6]);
+        cfg->qos.peak_bandwidth = READ_UINT32(&p[10]);
+        cfg->qos.latency = READ_UINT32(&p[14]);
+        cfg->qos.delay_variation = READ_UINT32(&p[18]);
+        cfg->options |= L2CAP_CFG_QOS;
+        break;
+
+      case L2CAP_CFG_TYPE_RFC:
+        if (len != 9)
+          return L2CAP_CFG_REJECTED;
+        cfg->rfc.mode = p[0];
+        cfg->rfc.tx_window = p[1];
+        cfg->rfc.max_transmit = p[2];
+        cfg->rfc.retransmission_timeout = READ_UINT16(&p[3]);
+        cfg->rfc.monitor_timeout = READ_UINT16(&p[5]);
+        cfg->rfc.mps = READ_UINT16(&p[7]);
+        cfg->options |= L2CAP_CFG_RFC;
+        break;
+
+      case L2CAP_CFG_TYPE_FCS:
+        if (len != 1)
+          return L2CAP_CFG_REJECTED;
+        cfg->fcs = p[0];
+        cfg->options |= L2CAP_CFG_FCS;
+        break;
+
+      default:
+        if (!(type & L2CAP_CFG_TYPE_HINT)) // Unknown hints are silently skipped
+          return L2CAP_CFG_UNKNOWN_OPTIONS;
+        break;
+    }
+
+    i += 2 + len;
+  }
+
+  return L2CAP_CFG_SUCCESS;
+}
+
+uint16_t l2cap_config_unknown(const uint8_t *data, uint16_t length, uint8_t *out, uint16_t max) {
+  uint16_t used = 0;
+  uint16_t i = 0;
+
+  while (i + 2 <= length && i + 2 + data[i + 1] <= length) {
+    uint16_t option_length = 2 + data[i + 1];
+
+    if (!(data[i] & L2CAP_CFG_TYPE_HINT) && !l2cap_config_known(data[i]) && used + option_length <= max) {
+      memcpy(&out[used], &data[i], option_length);
+      used += option_length;
+    }
+
+    i += option_length;
+  }
+
+  return used;
+}
+
+uint16_t l2cap_config_encode(uint8_t *data, uint16_t max, const l2cap_config_t *cfg) {
+  uint8_t *p = data;
+
+  if ((cfg->options & L2CAP_CFG_MTU) && p - data + 4 <= max) {
+    *p++ = L2CAP_CFG_TYPE_MTU;
+    *p++ = 2;
+    WRITE_UINT16(p, cfg->mtu);
+  }
+
+  if ((cfg->options & L2CAP_CFG_FLUSH_TIMEOUT) && p - data + 4 <= max) {
+    *p++ = L2CAP_CFG_TYPE_FLUSH_TIMEOUT;
+    *p++ = 2;
+    WRITE_UINT16(p, cfg->flush_timeout);
+  }
+
+  if ((cfg->options & L2CAP_CFG_QOS) && p - data + 24 <= max) {
+    *p++ = L2CAP_CFG_TYPE_QOS;
+    *p++ = 22;
+    *p++ = 0x00; // Flags
+    *p++ = cfg->qos.service_type;
+    WRITE_UINT32(p, cfg->qos.token_rate);
+    WRITE_UINT32(p, cfg->qos.token_bucket_size);
+    WRITE_UINT32(p, cfg->qos.peak_bandwidth);
+    WRITE_UINT32(p, cfg->qos.latency);
+    WRITE_UINT32(p, cfg->qos.delay_variation);
+  }
+
+  if ((cfg->options & L2CAP_CFG_RFC) && p - data + 11 <= max) {
+    *p++ = L2CAP_CFG_TYPE_RFC;
+    *p++ = 9;
+    *p++ = cfg->rfc.mode;
+    *p++ = cfg->rfc.tx_window;
+    *p++ = cfg->rfc.max_transmit;
+    WRITE_UINT16(p, cfg->rfc.retransmission_timeout);
+    WRITE_UINT16(p, cfg->rfc.monitor_timeout);
+    WRITE_UINT16(p, cfg->rfc.mps);
+  }
+
+  if ((cfg->options & L2CAP_CFG_FCS) && p - data + 3 <= max) {
+    *p++ = L2CAP_CFG_TYPE_FCS;
+    *p++ = 1;
+    *p++ = cfg->fcs;
+  }
+
+  return (uint16_t)(p - data);
+}
+
+uint16_t l2cap_config_negotiate(l2cap_config_t *cfg) {
+  uint8_t unacceptable = 0;
+
+  if ((cfg->options & L2CAP_CFG_MTU) && cfg->mtu < L2CAP_MIN_MTU) {
+    cfg->mtu = L2CAP_MIN_MTU;
+    unacceptable |= L2CAP_CFG_MTU;
+  }
+
+  if ((cfg->options & L2CAP_CFG_FLUSH_TIMEOUT) && cfg->flush_timeout == 0) { // 0 is reserved
+    cfg->flush_timeout = L2CAP_FLUSH_TIMEOUT_INFINITE;
+    unacceptable |= L2CAP_CFG_FLUSH_TIMEOUT;
+  }
+
+  if ((cfg->options & L2CAP_CFG_QOS) && cfg->qos.service_type > L2CAP_QOS_GUARANTEED) {
+    cfg->qos.service_type = L2CAP_QOS_BEST_EFFORT;
+    unacceptable |= L2CAP_CFG_QOS;
+  }
+
+  if ((cfg->options & L2CAP_CFG_RFC) && cfg->rfc.mode != L2CAP_MODE_BASIC) { // Only basic mode is implemented
+    memset(&cfg->rfc, 0, sizeof(cfg->rfc));
+    cfg->rfc.mode = L2CAP_MODE_BASIC;
+    unacceptable |= L2CAP_CFG_RFC;
+  }
+
+  if (unacceptable) {
+    cfg->options = unacceptable;
+    return L2CAP_CFG_UNACCEPTABLE_PARAMS;
+  }
+
+  return L2CAP_CFG_SUCCESS;
+}
+
+uint16_t l2cap_channel_tx_mtu(const l2cap_channel_t *channel) {
+  if (channel->remote.options & L2CAP_CFG_MTU)
+    return channel->remote.mtu;
+
+  return L2CAP_DEFAULT_MTU;
+}
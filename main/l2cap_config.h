@@ -0,0 +1,100 @@
+#ifndef L2CAP_CONFIG_H
+#define L2CAP_CONFIG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* L2CAP configuration option types */
+#define L2CAP_CFG_TYPE_MTU              0x01
+#define L2CAP_CFG_TYPE_FLUSH_TIMEOUT    0x02
+#define L2CAP_CFG_TYPE_QOS              0x03
+#define L2CAP_CFG_TYPE_RFC              0x04
+#define L2CAP_CFG_TYPE_FCS              0x05
+#define L2CAP_CFG_TYPE_HINT             0x80 // Set if the option may be ignored by the receiver
+
+/* Bits in l2cap_config_t.options telling which options are present */
+#define L2CAP_CFG_MTU                   (1U << 0)
+#define L2CAP_CFG_FLUSH_TIMEOUT         (1U << 1)
+#define L2CAP_CFG_QOS                   (1U << 2)
+#define L2CAP_CFG_RFC                   (1U << 3)
+#define L2CAP_CFG_FCS                   (1U << 4)
+
+/* Configuration response results */
+#define L2CAP_CFG_SUCCESS               0x0000
+#define L2CAP_CFG_UNACCEPTABLE_PARAMS   0x0001
+#define L2CAP_CFG_REJECTED              0x0002
+#define L2CAP_CFG_UNKNOWN_OPTIONS       0x0003
+
+#define L2CAP_DEFAULT_MTU               672
+#define L2CAP_MIN_MTU                   48
+#define L2CAP_FLUSH_TIMEOUT_INFINITE    0xFFFF
+#define L2CAP_CONFIG_MAX_ATTEMPTS       3 // Config Requests answered with Unacceptable Parameters before the channel is given up
+
+#define L2CAP_QOS_NO_TRAFFIC            0x00
+#define L2CAP_QOS_BEST_EFFORT           0x01
+#define L2CAP_QOS_GUARANTEED            0x02
+
+#define L2CAP_MODE_BASIC                0x00
+
+#define L2CAP_FCS_NONE                  0x00
+#define L2CAP_FCS_16BIT                 0x01
+
+typedef struct {
+  uint8_t service_type;
+  uint32_t token_rate;        // Bytes/second
+  uint32_t token_bucket_size; // Bytes
+  uint32_t peak_bandwidth;    // Bytes/second
+  uint32_t latency;           // Microseconds
+  uint32_t delay_variation;   // Microseconds
+} l2cap_flow_spec_t;
+
+typedef struct {
+  uint8_t mode;
+  uint8_t tx_window;
+  uint8_t max_transmit;
+  uint16_t retransmission_timeout; // Milliseconds
+  uint16_t monitor_timeout;        // Milliseconds
+  uint16_t mps;
+} l2cap_rfc_t;
+
+typedef struct {
+  uint8_t options; // L2CAP_CFG_* bits
+  uint16_t mtu;
+  uint16_t flush_timeout; // Milliseconds, L2CAP_FLUSH_TIMEOUT_INFINITE if packets are never flushed
+  l2cap_flow_spec_t qos;
+  l2cap_rfc_t rfc;
+  uint8_t fcs;
+} l2cap_config_t;
+
+/* Negotiated state of one channel. A configuration request describes the sender: its receive MTU,
+   the flush timeout of its outgoing data and the traffic it is going to send. */
+typedef struct {
+  l2cap_config_t local;  // What we asked the peer for
+  l2cap_config_t remote; // What the peer asked for and we accepted
+  uint8_t config_attempts; // Config Requests the peer refused as unacceptable
+} l2cap_channel_t;
+
+void l2cap_config_defaults(l2cap_config_t *cfg);
+void l2cap_channel_init(l2cap_channel_t *channel, uint16_t mtu, uint16_t flush_timeout);
+
+/* Parses the options of a configuration request or response into cfg. Returns L2CAP_CFG_SUCCESS,
+   L2CAP_CFG_UNKNOWN_OPTIONS if a non-hint option is not understood or L2CAP_CFG_REJECTED if the options
+   are malformed. */
+uint16_t l2cap_config_parse(const uint8_t *data, uint16_t length, l2cap_config_t *cfg);
+
+/* Copies every non-hint option that is not understood, as received, for the Unknown Options response.
+   Options that do not fit in max bytes are left out. Returns the number of bytes copied. */
+uint16_t l2cap_config_unknown(const uint8_t *data, uint16_t length, uint8_t *out, uint16_t max);
+
+/* Writes the options present in cfg that fit in max bytes and returns the number of bytes used. An option
+   that does not fit is left out whole, never cut. */
+uint16_t l2cap_config_encode(uint8_t *data, uint16_t max, const l2cap_config_t *cfg);
+
+/* Checks the options requested by the peer. On L2CAP_CFG_UNACCEPTABLE_PARAMS only the offending options
+   are left in cfg, holding the values we would accept instead. */
+uint16_t l2cap_config_negotiate(l2cap_config_t *cfg);
+
+/* Largest payload we may send on the channel */
+uint16_t l2cap_channel_tx_mtu(const l2cap_channel_t *channel);
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <string.h>
+#include "latency.h"
+#include "bt_link.h"
+
+static latency_histogram_t stage_histograms[LATENCY_STAGE_COUNT];
+static latency_histogram_t class_histograms[BT_DEVICE_CLASS_COUNT]; // End to end
+
+static const char *stage_names[LATENCY_STAGE_COUNT] = { "hci", "l2cap", "decode", "deliver" };
+static const char *class_names[BT_DEVICE_CLASS_COUNT] = { "other", "keyboard", "mouse", "gamepad" };
+
+static uint8_t latency_bin(uint32_t us) {
+  if (us < 4)
+    return us;
+
+  uint8_t exponent = 31 - __builtin_clz(us);
+
+  return 4 + (exponent - 2) * 4 + ((us >> (exponent - 2)) & 0x03);
+}
+
+/* Largest value that falls into a bin */
+static uint32_t latency_bin_limit(uint8_t bin) {
+  if (bin < 4)
+    return bin;
+
+  uint8_t exponent = (bin - 4) / 4 + 2;
+  uint64_t low = (uint64_t)(4 + (bin - 4) % 4) << (exponent - 2);
+
+  return low + (1UL << (exponent - 2)) - 1;
+}
+
+/* Histograms are updated from both cores, so the counters are bumped atomically. A summary taken while
+   values are added may be off by those values, which does not matter for percentiles. */
+static void latency_add(latency_histogram_t *histogram, int64_t us) {
+  uint32_t value = us < 0 ? 0 : (us > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)us);
+  uint32_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&histogram->bins[latency_bin(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+
+  while (value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static uint32_t latency_percentile(const latency_histogram_t *histogram, uint32_t count, uint8_t percent) {
+  uint32_t rank = (uint32_t)(((uint64_t)count * percent + 99) / 100); // 1-based rank of the percentile
+  uint32_t seen = 0;
+
+  for (uint8_t i = 0; i < LATENCY_BINS; i++) {
+    seen += histogram->bins[i];
+    if (seen >= rank && seen > 0)
+      return latency_bin_limit(i) < histogram->max ? latency_bin_limit(i) : histogram->max;
+  }
+
+  return histogram->max;
+}
+
+static void latency_summarize(const latency_histogram_t *histogram, latency_summary_t *summary) {
+  summary->count = histogram->count;
+  summary->max = histogram->max;
+  summary->p50 = summary->count ? latency_percentile(histogram, summary->count, 50) : 0;
+  summary->p99 = summary->count ? latency_percentile(histogram, summary->count, 99) : 0;
+}
+
+void latency_record_report(const latency_stamps_t *stamps) {
+  latency_add(&stage_histograms[LATENCY_STAGE_HCI], stamps->hci - stamps->rx);
+  latency_add(&stage_histograms[LATENCY_STAGE_L2CAP], stamps->l2cap - stamps->hci);
+  latency_add(&stage_histograms[LATENCY_STAGE_DECODE], stamps->decode - stamps->l2cap);
+}
+
+void latency_record_delivery(const latency_stamps_t *stamps, uint8_t device_class, int64_t now) {
+  latency_add(&stage_histograms[LATENCY_STAGE_DELIVER], now - stamps->decode);
+
+  if (device_class < BT_DEVICE_CLASS_COUNT)
+    latency_add(&class_histograms[device_class], now - stamps->rx);
+}
+
+void latency_stage_summary(uint8_t stage, latency_summary_t *summary) {
+  memset(summary, 0, sizeof(*summary));
+
+  if (stage < LATENCY_STAGE_COUNT)
+    latency_summarize(&stage_histograms[stage], summary);
+}
+
+void latency_class_summary(uint8_t device_class, latency_summary_t *summary) {
+  memset(summary, 0, sizeof(*summary));
+
+  if (device_class < BT_DEVICE_CLASS_COUNT)
+    latency_summarize(&class_histograms[device_class], summary);
+}
+
+void latency_reset() {
+  memset(stage_histograms, 0, sizeof(stage_histograms));
+  memset(class_histograms, 0, sizeof(class_histograms));
+}
+
+void latency_print() {
+  latency_summary_t summary;
+
+  printf("Input latency (us)    count      p50      p99      max\n");
+
+  for (uint8_t i = 0; i < LATENCY_STAGE_COUNT; i++) {
+    latency_stage_summary(i, &summary);
+    printf("  stage %-10s %8lu %8lu %8lu %8lu\n", stage_names[i], (unsigned long)summary.count,
+           (unsigned long)summary.p50, (unsigned long)summary.p99, (unsigned long)summary.max);
+  }
+
+  for (uint8_t i = 0; i < BT_DEVICE_CLASS_COUNT; i++) {
+    latency_class_summary(i, &summary);
+    if (summary.count)
+      printf("  total %-10s %8lu %8lu %8lu %8lu\n", class_names[i], (unsigned long)summary.count,
+             (unsigned long)summary.p50, (unsigned long)summary.p99, (unsigned long)summary.max);
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Stages of an input report, each measured from the end of the previous one */
+#define LATENCY_STAGE_HCI               0 // VHCI callback to the end of the HCI handling of the ACL packet
+#define LATENCY_STAGE_L2CAP             1 // HCI handling done to the report reaching the interrupt channel
+#define LATENCY_STAGE_DECODE            2 // L2CAP dispatch to decoded values
+#define LATENCY_STAGE_DELIVER           3 // Decoded values to dequeue by a subscriber
+#define LATENCY_STAGE_COUNT             4
+
+/* Log-linear buckets: exact below 4 us, then four buckets per power of two, so every bucket is within
+   25% of the values in it */
+#define LATENCY_BINS                    124
+
+typedef struct {
+  uint32_t bins[LATENCY_BINS];
+  uint32_t count;
+  uint32_t max; // Microseconds
+} latency_histogram_t;
+
+typedef struct {
+  uint32_t count;
+  uint32_t p50; // Microseconds, upper bound of the bucket
+  uint32_t p99;
+  uint32_t max;
+} latency_summary_t;
+
+/* esp_timer_get_time() at each stage of one report */
+typedef struct {
+  int64_t rx;
+  int64_t hci;
+  int64_t l2cap;
+  int64_t decode;
+} latency_stamps_t;
+
+/* Adds the stages up to the decode. Called once per report by the decoder. */
+void latency_record_report(const latency_stamps_t *stamps);
+
+/* Adds the delivery stage and the end to end time for the device class. Called by subscribers. */
+void latency_record_delivery(const latency_stamps_t *stamps, uint8_t device_class, int64_t now);
+
+void latency_stage_summary(uint8_t stage, latency_summary_t *summary);
+void latency_class_summary(uint8_t device_class, latency_summary_t *summary);
+void latency_reset();
+
+/* Prints p50/p99/max of every stage and device class */
+void latency_print();
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_timer.h"
+#include "provision.h"
+
+typedef struct {
+  uint8_t bdaddr[6];
+  uint8_t class_of_device[3];
+} provision_candidate_t;
+
+static provision_candidate_t candidates[PROVISION_MAX_CANDIDATES];
+static uint8_t candidate_count;
+
+static uint8_t seen[PROVISION_MAX_SEEN][6]; // Ring, the oldest unit is forgotten first
+static uint8_t seen_count;
+static uint8_t seen_next;
+
+static provision_stage_stats_t stage_stats[PROVISION_STAGE_COUNT];
+static uint8_t stage = PROVISION_STAGE_NONE;
+static int64_t stage_since;
+static int64_t session_start;
+static int64_t idle_since; // End of the previous unit, start of the discovery wait
+static bool verified;
+static uint32_t units_passed;
+static uint32_t units_failed;
+
+static const char *stage_names[PROVISION_STAGE_COUNT] = { "discover", "connect", "pair", "l2cap", "verify", "disconnect" };
+
+static void provision_stage_add(uint8_t index, uint32_t time) {
+  provision_stage_stats_t *stats = &stage_stats[index];
+
+  if (stats->units == 0 || time < stats->min)
+    stats->min = time;
+  if (time > stats->max)
+    stats->max = time;
+  stats->total += time;
+  stats->units++;
+}
+
+static bool provision_seen(const uint8_t *bdaddr) {
+  for (uint8_t i = 0; i < seen_count; i++) {
+    if (memcmp(seen[i], bdaddr, 6) == 0)
+      return true;
+  }
+  return false;
+}
+
+void provision_start() {
+  memset(stage_stats, 0, sizeof(stage_stats));
+  candidate_count = 0;
+  seen_count = 0;
+  seen_next = 0;
+  stage = PROVISION_STAGE_NONE;
+  verified = false;
+  units_passed = 0;
+  units_failed = 0;
+  session_start = esp_timer_get_time();
+  idle_since = session_start;
+}
+
+bool provision_candidate_add(const uint8_t *bdaddr, const uint8_t *class_of_device) {
+  if (candidate_count == PROVISION_MAX_CANDIDATES || provision_seen(bdaddr))
+    return false;
+
+  for (uint8_t i = 0; i < candidate_count; i++) {
+    if (memcmp(candidates[i].bdaddr, bdaddr, 6) == 0)
+      return false;
+  }
+
+  memcpy(candidates[candidate_count].bdaddr, bdaddr, 6);
+  memcpy(candidates[candidate_count].class_of_device, class_of_device, 3);
+  candidate_count++;
+  return true;
+}
+
+bool provision_candidate_next(uint8_t *bdaddr, uint8_t *class_of_device) {
+  if (candidate_count == 0)
+    return false;
+
+  memcpy(bdaddr, candidates[0].bdaddr, 6);
+  memcpy(class_of_device, candidates[0].class_of_device, 3);
+  candidate_count--;
+  memmove(&candidates[0], &candidates[1], candidate_count * sizeof(candidates[0]));
+  return true;
+}
+
+bool provision_candidate_pending() {
+  return candidate_count > 0;
+}
+
+void provision_stage(uint8_t next) {
+  int64_t now = esp_timer_get_time();
+
+  if (next == PROVISION_STAGE_CONNECT) {
+    provision_stage_add(PROVISION_STAGE_DISCOVER, (uint32_t)(now - idle_since));
+    verified = false;
+  } else if (stage != PROVISION_STAGE_NONE) {
+    provision_stage_add(stage, (uint32_t)(now - stage_since));
+  }
+
+  stage = next;
+  stage_since = now;
+}
+
+uint8_t provision_current_stage() {
+  return stage;
+}
+
+void provision_report() {
+  verified = true;
+}
+
+bool provision_verified() {
+  return verified;
+}
+
+void provision_unit_done(const uint8_t *bdaddr, bool success) {
+  int64_t now = esp_timer_get_time();
+
+  if (stage == PROVISION_STAGE_NONE)
+    return;
+
+  provision_stage_add(stage, (uint32_t)(now - stage_since));
+  stage = PROVISION_STAGE_NONE;
+  idle_since = now;
+
+  if (success)
+    units_passed++;
+  else
+    units_failed++;
+
+  if (!provision_seen(bdaddr)) { // Failed units are not retried either, they are taken off the line
+    memcpy(seen[seen_next], bdaddr, 6);
+    seen_next = (seen_next + 1) % PROVISION_MAX_SEEN;
+    if (seen_count < PROVISION_MAX_SEEN)
+      seen_count++;
+  }
+}
+
+uint32_t provision_units_per_hour() {
+  int64_t elapsed = esp_timer_get_time() - session_start;
+
+  if (elapsed <= 0)
+    return 0;
+
+  return (uint32_t)((uint64_t)units_passed * 3600000000ULL / (uint64_t)elapsed);
+}
+
+void provision_stage_stats(uint8_t index, provision_stage_stats_t *stats) {
+  *stats = stage_stats[index];
+}
+
+void provision_print() {
+  printf("Provisioning: %lu passed, %lu failed, %lu units/hour\n", (unsigned long)units_passed,
+    (unsigned long)units_failed, (unsigned long)provision_units_per_hour());
+  printf("  %-10s %6s %8s %8s %8s\n", "stage", "units", "avg us", "min us", "max us");
+
+  for (uint8_t i = 0; i < PROVISION_STAGE_COUNT; i++) {
+    if (stage_stats[i].units) {
+      printf("  %-10s %6lu %8lu %8lu %8lu\n", stage_names[i], (unsigned long)stage_stats[i].units,
+        (unsigned long)(stage_stats[i].total / stage_stats[i].units), (unsigned long)stage_stats[i].min,
+        (unsigned long)stage_stats[i].max);
+    }
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef PROVISION_H
+#define PROVISION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Stages of one unit on the provisioning line. Discovery of the next unit overlaps the later stages of
+   the current one, so PROVISION_STAGE_DISCOVER only counts the time the line sat waiting for a unit. */
+#define PROVISION_STAGE_DISCOVER        0
+#define PROVISION_STAGE_CONNECT         1
+#define PROVISION_STAGE_PAIR            2
+#define PROVISION_STAGE_L2CAP           3
+#define PROVISION_STAGE_VERIFY          4 // Waiting for the first input report
+#define PROVISION_STAGE_DISCONNECT      5
+#define PROVISION_STAGE_COUNT           6
+#define PROVISION_STAGE_NONE            0xFF
+
+#define PROVISION_MAX_CANDIDATES        4  // Units found by inquiry and waiting for their turn
+#define PROVISION_MAX_SEEN              64 // Units already handled, so inquiry does not pick them up again
+#define PROVISION_UNIT_TIMEOUT          15000 // Milliseconds from connect until a unit is given up
+
+typedef struct {
+  uint32_t units;  // Units that went through the stage
+  uint64_t total;  // Microseconds
+  uint32_t min;
+  uint32_t max;
+} provision_stage_stats_t;
+
+/* Starts a session: clears the statistics, the candidates and the units seen */
+void provision_start();
+
+/* Queues a unit found by inquiry. Returns false if it was handled or queued already, or the queue is full. */
+bool provision_candidate_add(const uint8_t *bdaddr, const uint8_t *class_of_device);
+bool provision_candidate_next(uint8_t *bdaddr, uint8_t *class_of_device);
+bool provision_candidate_pending();
+
+/* Moves the current unit to a stage, which ends the previous one. PROVISION_STAGE_CONNECT starts a unit. */
+void provision_stage(uint8_t stage);
+uint8_t provision_current_stage();
+
+/* An input report arrived from the current unit */
+void provision_report();
+bool provision_verified();
+
+/* Ends the current unit and remembers its address so it is not provisioned twice */
+void provision_unit_done(const uint8_t *bdaddr, bool success);
+
+uint32_t provision_units_per_hour();
+void provision_stage_stats(uint8_t stage, provision_stage_stats_t *stats);
+void provision_print();
+
+#endif
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdp.h"
+
+#define READ_UINT16_BE(p) ((uint16_t)(((p)[0] << 8) | (p)[1]))
+#define READ_UINT32_BE(p) ((uint32_t)(((uint32_t)(p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3]))
+
+void sdp_query_begin(sdp_query_t *query, uint16_t uuid, uint16_t first_attribute, uint16_t last_attribute) {
+  query->uuid = uuid;
+  query->first_attribute = first_attribute;
+  query->last_attribute = last_attribute;
+  query->transaction_id++;
+  query->continuation_length = 0;
+  query->length = 0;
+}
+
+uint16_t sdp_query_request(sdp_query_t *query, uint8_t *pdu) {
+  uint8_t *p = &pdu[5];
+
+  *p++ = 0x35; // ServiceSearchPattern: sequence with one byte size
+  *p++ = 0x03;
+  *p++ = 0x19; // UUID16
+  *p++ = (uint8_t)(query->uuid >> 8);
+  *p++ = (uint8_t)query->uuid;
+  *p++ = (uint8_t)(SDP_MAX_ATTRIBUTE_BYTES >> 8); // MaximumAttributeByteCount
+  *p++ = (uint8_t)SDP_MAX_ATTRIBUTE_BYTES;
+  *p++ = 0x35; // AttributeIDList: one range
+  *p++ = 0x05;
+  *p++ = 0x0A; // UINT32, first and last attribute ID
+  *p++ = (uint8_t)(query->first_attribute >> 8);
+  *p++ = (uint8_t)query->first_attribute;
+  *p++ = (uint8_t)(query->last_attribute >> 8);
+  *p++ = (uint8_t)query->last_attribute;
+  *p++ = query->continuation_length;
+  memcpy(p, query->continuation, query->continuation_length);
+  p += query->continuation_length;
+
+  uint16_t parameter_length = p - &pdu[5];
+
+  pdu[0] = SDP_SERVICE_SEARCH_ATTR_REQUEST;
+  pdu[1] = (uint8_t)(query->transaction_id >> 8);
+  pdu[2] = (uint8_t)query->transaction_id;
+  pdu[3] = (uint8_t)(parameter_length >> 8);
+  pdu[4] = (uint8_t)parameter_length;
+
+  return 5 + parameter_length;
+}
+
+uint8_t sdp_query_response(sdp_query_t *query, const uint8_t *pdu, uint16_t length) {
+  if (length < 5 || READ_UINT16_BE(&pdu[1]) != query->transaction_id || pdu[0] != SDP_SERVICE_SEARCH_ATTR_RESPONSE)
+    return SDP_QUERY_ERROR;
+
+  uint16_t parameter_length = READ_UINT16_BE(&pdu[3]);
+
+  if (parameter_length + 5 > length || parameter_length < 3)
+    return SDP_QUERY_ERROR;
+
+  uint16_t byte_count = READ_UINT16_BE(&pdu[5]);
+
+  if (2 + byte_count + 1 > parameter_length || query->length + byte_count > sizeof(query->lists))
+    return SDP_QUERY_ERROR;
+
+  memcpy(&query->lists[query->length], &pdu[7], byte_count);
+  query->length += byte_count;
+
+  const uint8_t *continuation = &pdu[7 + byte_count];
+
+  if (continuation[0] > SDP_MAX_CONTINUATION || 2 + byte_count + 1 + continuation[0] > parameter_length)
+    return SDP_QUERY_ERROR;
+
+  query->continuation_length = continuation[0];
+  memcpy(query->continuation, &continuation[1], continuation[0]);
+
+  return query->continuation_length ? SDP_QUERY_MORE : SDP_QUERY_DONE;
+}
+
+bool sdp_de_header(const uint8_t *p, uint16_t length, uint8_t *type, uint32_t *size, uint8_t *header_length) {
+  if (length < 1)
+    return false;
+
+  uint8_t index = p[0] & 0x07;
+
+  *type = p[0] >> 3;
+
+  if (*type == SDP_DE_NIL) {
+    *size = 0;
+    *header_length = 1;
+  } else if (index < 5) { // Size is implied: 1, 2, 4, 8 or 16 bytes
+    *size = 1 << index;
+    *header_length = 1;
+  } else {
+    *header_length = 1 + (1 << (index - 5)); // Size follows in 1, 2 or 4 bytes
+
+    if (length < *header_length)
+      return false;
+
+    if (index == 5)
+      *size = p[1];
+    else if (index == 6)
+      *size = READ_UINT16_BE(&p[1]);
+    else
+      *size = READ_UINT32_BE(&p[1]);
+  }
+
+  return *size <= (uint32_t)(length - *header_length); // A 32-bit size would wrap the sum around
+}
+
+bool sdp_de_uint(const uint8_t *p, uint16_t length, uint32_t *value) {
+  uint8_t type, header_length;
+  uint32_t size;
+
+  if (!sdp_de_header(p, length, &type, &size, &header_length) || (type != SDP_DE_UINT && type != SDP_DE_BOOL) || size > 4)
+    return false;
+
+  *value = 0;
+  for (uint8_t i = 0; i < size; i++)
+    *value = (*value << 8) | p[header_length + i];
+
+  return true;
+}
+
+bool sdp_find_attribute(const sdp_query_t *query, uint16_t id, const uint8_t **value, uint16_t *value_length) {
+  uint8_t type, header_length;
+  uint32_t size;
+  const uint8_t *p = query->lists;
+  uint16_t length = query->length;
+
+  // AttributeLists is a sequence of records, each a sequence of ID and value pairs
+  if (!sdp_de_header(p, length, &type, &size, &header_length) || type != SDP_DE_SEQUENCE)
+    return false;
+  p += header_length;
+  length = size;
+
+  if (!sdp_de_header(p, length, &type, &size, &header_length) || type != SDP_DE_SEQUENCE)
+    return false;
+  p += header_length;
+  length = size;
+
+  while (length > 0) {
+    uint32_t attribute;
+
+    if (!sdp_de_uint(p, length, &attribute) || !sdp_de_header(p, length, &type, &size, &header_length))
+      return false;
+    p += header_length + size;
+    length -= header_length + size;
+
+    if (!sdp_de_header(p, length, &type, &size, &header_length))
+      return false;
+
+    if (attribute == id) {
+      *value = p;
+      *value_length = header_length + size;
+      return true;
+    }
+
+    p += header_length + size;
+    length -= header_length + size;
+  }
+
+  return false;
+}
+
+static void sdp_hid_flag(const sdp_query_t *query, uint16_t id, uint8_t flag, sdp_hid_info_t *info) {
+  const uint8_t *value;
+  uint16_t length;
+  uint32_t set;
+
+  if (sdp_find_attribute(query, id, &value, &length) && sdp_de_uint(value, length, &set) && set)
+    info->flags |= flag;
+}
+
+static bool sdp_uint_attribute(const sdp_query_t *query, uint16_t id, uint32_t *value) {
+  const uint8_t *p;
+  uint16_t length;
+
+  return sdp_find_attribute(query, id, &p, &length) && sdp_de_uint(p, length, value);
+}
+
+bool sdp_pnp_info(const sdp_query_t *query, sdp_pnp_info_t *info) {
+  uint32_t vendor, product, version = 0, source = 0;
+
+  if (!sdp_uint_attribute(query, SDP_ATTR_PNP_VENDOR_ID, &vendor) || !sdp_uint_attribute(query, SDP_ATTR_PNP_PRODUCT_ID, &product))
+    return false;
+
+  sdp_uint_attribute(query, SDP_ATTR_PNP_VERSION, &version);
+  sdp_uint_attribute(query, SDP_ATTR_PNP_VENDOR_ID_SOURCE, &source);
+
+  info->vendor = vendor;
+  info->product = product;
+  info->version = version;
+  info->vendor_source = source;
+  return true;
+}
+
+bool sdp_hid_info(const sdp_query_t *query, sdp_hid_info_t *info) {
+  const uint8_t *p;
+  uint16_t length;
+  uint8_t type, header_length;
+  uint32_t size;
+
+  memset(info, 0, sizeof(*info));
+  sdp_hid_flag(query, SDP_ATTR_HID_VIRTUAL_CABLE, SDP_HID_VIRTUAL_CABLE, info);
+  sdp_hid_flag(query, SDP_ATTR_HID_RECONNECT_INITIATE, SDP_HID_RECONNECT_INITIATE, info);
+  sdp_hid_flag(query, SDP_ATTR_HID_NORMALLY_CONNECTABLE, SDP_HID_NORMALLY_CONNECTABLE, info);
+  sdp_hid_flag(query, SDP_ATTR_HID_BOOT_DEVICE, SDP_HID_BOOT_DEVICE, info);
+
+  if (!sdp_find_attribute(query, SDP_ATTR_HID_DESCRIPTOR_LIST, &p, &length))
+    return false;
+
+  // Sequence of (class descriptor type, descriptor) sequences, the report descriptor has type 0x22
+  if (!sdp_de_header(p, length, &type, &size, &header_length) || type != SDP_DE_SEQUENCE)
+    return false;
+  p += header_length;
+  length = size;
+
+  while (length > 0) {
+    if (!sdp_de_header(p, length, &type, &size, &header_length) || type != SDP_DE_SEQUENCE)
+      return false;
+
+    const uint8_t *entry = p + header_length;
+    uint16_t entry_length = size;
+    uint32_t descriptor_type;
+
+    p += header_length + size;
+    length -= header_length + size;
+
+    if (!sdp_de_uint(entry, entry_length, &descriptor_type) || !sdp_de_header(entry, entry_length, &type, &size, &header_length))
+      continue;
+    entry += header_length + size;
+    entry_length -= header_length + size;
+
+    if (descriptor_type != 0x22 || !sdp_de_header(entry, entry_length, &type, &size, &header_length) || type != SDP_DE_TEXT)
+      continue;
+
+    info->descriptor = entry + header_length;
+    info->descriptor_length = size;
+    return true;
+  }
+
+  return false;
+}
+
+#ifdef SDP_SELFTEST
+/* A Device ID record with vendor 0x045E and product 0x028E in a ServiceSearchAttributeResponse */
+static const uint8_t selftest_pnp_response[] = {
+  SDP_SERVICE_SEARCH_ATTR_RESPONSE, 0x00, 0x01, 0x00, 0x13, 0x00, 0x10,
+  0x35, 0x0E, 0x35, 0x0C, 0x09, 0x02, 0x01, 0x09, 0x04, 0x5E, 0x09, 0x02, 0x02, 0x09, 0x02, 0x8E,
+  0x00
+};
+
+/* The byte count runs past the end of the parameters */
+static const uint8_t selftest_short_response[] = {
+  SDP_SERVICE_SEARCH_ATTR_RESPONSE, 0x00, 0x01, 0x00, 0x05, 0x00, 0x10, 0x35, 0x0E, 0x00
+};
+
+static sdp_query_t selftest_query;
+
+static bool sdp_selftest_check(const char *name, bool ok) {
+  if (!ok)
+    printf("SDP self test failed: %s\n", name);
+  return ok;
+}
+
+bool sdp_selftest() {
+  static const uint8_t uint8[] = { 0x08, 0x05 };
+  static const uint8_t uint16[] = { 0x09, 0x12, 0x34 };
+  static const uint8_t truncated[] = { 0x36, 0x00 };
+  static const uint8_t huge[] = { 0x37, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+  static const uint8_t missing_value[] = { 0x35, 0x05, 0x35, 0x03, 0x09, 0x02, 0x01 };
+  uint8_t type, header_length;
+  uint32_t size, value;
+  const uint8_t *attribute;
+  uint16_t attribute_length;
+  sdp_pnp_info_t info;
+  bool ok = true;
+
+  ok &= sdp_selftest_check("uint8", sdp_de_header(uint8, sizeof(uint8), &type, &size, &header_length) && type == SDP_DE_UINT && size == 1 && header_length == 1);
+  ok &= sdp_selftest_check("uint16", sdp_de_uint(uint16, sizeof(uint16), &value) && value == 0x1234);
+  ok &= sdp_selftest_check("uint16 cut short", !sdp_de_uint(uint16, 2, &value));
+  ok &= sdp_selftest_check("truncated size", !sdp_de_header(truncated, sizeof(truncated), &type, &size, &header_length));
+  ok &= sdp_selftest_check("32-bit size", !sdp_de_header(huge, sizeof(huge), &type, &size, &header_length));
+
+  sdp_query_begin(&selftest_query, SDP_UUID_PNP_INFORMATION, SDP_ATTR_PNP_VENDOR_ID, SDP_ATTR_PNP_VENDOR_ID_SOURCE);
+  selftest_query.transaction_id = 1;
+  ok &= sdp_selftest_check("response", sdp_query_response(&selftest_query, selftest_pnp_response, sizeof(selftest_pnp_response)) == SDP_QUERY_DONE);
+  ok &= sdp_selftest_check("device id", sdp_pnp_info(&selftest_query, &info) && info.vendor == 0x045E && info.product == 0x028E && info.version == 0);
+  ok &= sdp_selftest_check("missing attribute", !sdp_find_attribute(&selftest_query, SDP_ATTR_HID_DESCRIPTOR_LIST, &attribute, &attribute_length));
+
+  sdp_query_begin(&selftest_query, SDP_UUID_PNP_INFORMATION, SDP_ATTR_PNP_VENDOR_ID, SDP_ATTR_PNP_VENDOR_ID_SOURCE);
+  selftest_query.transaction_id = 1;
+  ok &= sdp_selftest_check("short response", sdp_query_response(&selftest_query, selftest_short_response, sizeof(selftest_short_response)) == SDP_QUERY_ERROR);
+
+  memcpy(selftest_query.lists, missing_value, sizeof(missing_value));
+  selftest_query.length = sizeof(missing_value);
+  ok &= sdp_selftest_check("attribute without value", !sdp_find_attribute(&selftest_query, SDP_ATTR_PNP_VENDOR_ID, &attribute, &attribute_length));
+
+  return ok;
+}
+#endif
@@ -0,0 +1,109 @@
+#ifndef SDP_H
+#define SDP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SDP_PSM                         0x0001
+#define SDP_L2CAP_MTU                   256 // Receive MTU of the SDP channel, also the reassembly buffer size
+#define SDP_MAX_ATTRIBUTE_BYTES         200 // Per response, longer records come in several with continuation states
+#define SDP_MAX_ATTRIBUTE_LISTS         768 // Whole record
+#define SDP_MAX_CONTINUATION            16
+
+/* PDU IDs */
+#define SDP_ERROR_RESPONSE              0x01
+#define SDP_SERVICE_SEARCH_ATTR_REQUEST 0x06
+#define SDP_SERVICE_SEARCH_ATTR_RESPONSE 0x07
+
+/* Service class UUIDs */
+#define SDP_UUID_HID                    0x1124
+#define SDP_UUID_PNP_INFORMATION        0x1200
+
+/* Device ID attributes */
+#define SDP_ATTR_PNP_VENDOR_ID          0x0201
+#define SDP_ATTR_PNP_PRODUCT_ID         0x0202
+#define SDP_ATTR_PNP_VERSION            0x0203
+#define SDP_ATTR_PNP_VENDOR_ID_SOURCE   0x0205
+
+/* HID profile attributes */
+#define SDP_ATTR_HID_VIRTUAL_CABLE      0x0204
+#define SDP_ATTR_HID_RECONNECT_INITIATE 0x0205
+#define SDP_ATTR_HID_DESCRIPTOR_LIST    0x0206
+#define SDP_ATTR_HID_NORMALLY_CONNECTABLE 0x020D
+#define SDP_ATTR_HID_BOOT_DEVICE        0x020E
+
+/* Data element types, the upper five bits of the header byte */
+#define SDP_DE_NIL                      0
+#define SDP_DE_UINT                     1
+#define SDP_DE_INT                      2
+#define SDP_DE_UUID                     3
+#define SDP_DE_TEXT                     4
+#define SDP_DE_BOOL                     5
+#define SDP_DE_SEQUENCE                 6
+#define SDP_DE_ALTERNATIVE              7
+#define SDP_DE_URL                      8
+
+/* sdp_query_response() results */
+#define SDP_QUERY_MORE                  0 // Send sdp_query_request() again with the continuation state
+#define SDP_QUERY_DONE                  1
+#define SDP_QUERY_ERROR                 2
+
+/* sdp_hid_info_t flags */
+#define SDP_HID_VIRTUAL_CABLE           (1 << 0)
+#define SDP_HID_RECONNECT_INITIATE      (1 << 1)
+#define SDP_HID_NORMALLY_CONNECTABLE    (1 << 2)
+#define SDP_HID_BOOT_DEVICE             (1 << 3)
+
+/* One ServiceSearchAttribute transaction, possibly spread over several request/response pairs */
+typedef struct {
+  uint16_t uuid;
+  uint16_t first_attribute;
+  uint16_t last_attribute;
+  uint16_t transaction_id;
+  uint8_t continuation_length;
+  uint8_t continuation[SDP_MAX_CONTINUATION];
+  uint16_t length;
+  uint8_t lists[SDP_MAX_ATTRIBUTE_LISTS]; // AttributeLists collected so far
+} sdp_query_t;
+
+typedef struct {
+  uint8_t flags; // SDP_HID_*
+  const uint8_t *descriptor; // Points into the query buffer
+  uint16_t descriptor_length;
+} sdp_hid_info_t;
+
+/* Starts a query for the attributes in [first, last] of the records of a service class */
+void sdp_query_begin(sdp_query_t *query, uint16_t uuid, uint16_t first_attribute, uint16_t last_attribute);
+
+/* Writes the next request PDU and returns its length */
+uint16_t sdp_query_request(sdp_query_t *query, uint8_t *pdu);
+
+/* Takes in a response PDU */
+uint8_t sdp_query_response(sdp_query_t *query, const uint8_t *pdu, uint16_t length);
+
+/* Reads the header of the data element at p. Returns false if it does not fit in length. */
+bool sdp_de_header(const uint8_t *p, uint16_t length, uint8_t *type, uint32_t *size, uint8_t *header_length);
+
+/* Finds an attribute in the first record of a completed query. value points at its data element. */
+bool sdp_find_attribute(const sdp_query_t *query, uint16_t id, const uint8_t **value, uint16_t *value_length);
+
+/* Value of an unsigned integer or boolean data element */
+bool sdp_de_uint(const uint8_t *p, uint16_t length, uint32_t *value);
+
+typedef struct {
+  uint16_t vendor;
+  uint16_t product;
+  uint16_t version;
+  uint16_t vendor_source; // 1 = Bluetooth SIG, 2 = USB Implementers Forum
+} sdp_pnp_info_t;
+
+bool sdp_hid_info(const sdp_query_t *query, sdp_hid_info_t *info);
+bool sdp_pnp_info(const sdp_query_t *query, sdp_pnp_info_t *info);
+
+#ifdef SDP_SELFTEST
+/* Runs the parser over fixed data elements and responses, malformed ones included. Returns false and
+   prints the case if one of them is not handled as expected. */
+bool sdp_selftest();
+#endif
+
+#endif